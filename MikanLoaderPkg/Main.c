@@ -4,14 +4,18 @@
 #include  <Library/PrintLib.h>
 #include  <Library/MemoryAllocationLib.h>
 #include  <Library/BaseMemoryLib.h>
+#include  <Library/BaseLib.h>
 #include  <Protocol/LoadedImage.h>
 #include  <Protocol/SimpleFileSystem.h>
 #include  <Protocol/DiskIo2.h>
 #include  <Protocol/BlockIo.h>
+#include  <Protocol/DevicePath.h>
+#include  <Protocol/PciIo.h>
 #include  <Guid/FileInfo.h>
 #include  "frame_buffer_config.hpp"
 #include  "memory_map.hpp"
 #include  "elf.hpp"
+#include  "boot_volume.hpp"
 
 EFI_STATUS GetMemoryMap(struct MemoryMap* map) {
   if (map->buffer == NULL) {
@@ -196,8 +200,8 @@ void CopyLoadSegments(Elf64_Ehdr* ehdr) {
   }
 }
 
-// ファイルの中身をbufferポインタが指す先のバッファに読み込む
-EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
+// ファイルの中身をbufferポインタが指す先のバッファに読み込み、読み込んだバイト数を read_bytes に書き込む
+EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer, UINTN* read_bytes) {
   EFI_STATUS status;
 
   UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 12;
@@ -217,7 +221,8 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
     return status;
   }
 
-  return file->Read(file, &file_size, *buffer);
+  *read_bytes = file_size;
+  return file->Read(file, read_bytes, *buffer);
 }
 
 // image(ここではブートローダを指す)がある記憶装置に紐つくBlock I/O Protocolを開く
@@ -247,15 +252,20 @@ EFI_STATUS OpenBlockIoProtocolForLoadedImage(
   return status;
 }
 
+// 起動メディアの先頭から read_bytes バイトを読み込む
+// カーネルがページ単位でそのまま使えるよう、ページ境界から始まる領域に読み込む
 EFI_STATUS ReadBlocks(
     EFI_BLOCK_IO_PROTOCOL* block_io, UINT32 media_id,
     UINTN read_bytes, VOID** buffer) {
   EFI_STATUS status;
 
-  status = gBS->AllocatePool(EfiLoaderData, read_bytes, buffer);
+  EFI_PHYSICAL_ADDRESS buffer_addr;
+  status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                              EFI_SIZE_TO_PAGES(read_bytes), &buffer_addr);
   if (EFI_ERROR(status)){
     return status;
   }
+  *buffer = (VOID*)buffer_addr;
 
   status = block_io->ReadBlocks(
       block_io,
@@ -267,6 +277,111 @@ EFI_STATUS ReadBlocks(
   return status;
 }
 
+// 起動メディアの先頭にある BPB から、予約領域と FAT を合わせたバイト数を求める
+EFI_STATUS CalcFATRegionBytes(
+    EFI_BLOCK_IO_PROTOCOL* block_io, UINT32 media_id, UINTN* bytes) {
+  EFI_STATUS status;
+  UINT32 block_size = block_io->Media->BlockSize;
+
+  UINT8* bpb;
+  status = gBS->AllocatePool(EfiLoaderData, block_size, (VOID**)&bpb);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  status = block_io->ReadBlocks(block_io, media_id, 0, block_size, bpb);
+  if (EFI_ERROR(status)) {
+    gBS->FreePool(bpb);
+    return status;
+  }
+
+  UINTN bytes_per_sector = ReadUnaligned16((UINT16*)(bpb + 11));
+  UINTN reserved_sector_count = ReadUnaligned16((UINT16*)(bpb + 14));
+  UINTN num_fats = bpb[16];
+  UINTN fat_size_32 = ReadUnaligned32((UINT32*)(bpb + 36));
+  gBS->FreePool(bpb);
+
+  UINTN region_bytes = (reserved_sector_count + num_fats * fat_size_32) * bytes_per_sector;
+  if (region_bytes == 0) {
+    return EFI_UNSUPPORTED;
+  }
+  *bytes = (region_bytes + block_size - 1) / block_size * block_size;
+  return EFI_SUCCESS;
+}
+
+// image がある記憶装置が virtio-blk の PCI デバイスなら、その位置を boot_volume に設定する
+EFI_STATUS FindVirtioBlkForLoadedImage(
+    EFI_HANDLE image_handle, struct BootVolume* boot_volume) {
+  EFI_STATUS status;
+  EFI_LOADED_IMAGE_PROTOCOL* loaded_image;
+
+  status = gBS->OpenProtocol(
+      image_handle,
+      &gEfiLoadedImageProtocolGuid,
+      (VOID**)&loaded_image,
+      image_handle,
+      NULL,
+      EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  EFI_DEVICE_PATH_PROTOCOL* device_path;
+  status = gBS->OpenProtocol(
+      loaded_image->DeviceHandle,
+      &gEfiDevicePathProtocolGuid,
+      (VOID**)&device_path,
+      image_handle,
+      NULL,
+      EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  // デバイスパスをたどって、記憶装置の親にあたる PCI デバイスを探す
+  EFI_HANDLE pci_handle;
+  status = gBS->LocateDevicePath(&gEfiPciIoProtocolGuid, &device_path, &pci_handle);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  EFI_PCI_IO_PROTOCOL* pci_io;
+  status = gBS->OpenProtocol(
+      pci_handle,
+      &gEfiPciIoProtocolGuid,
+      (VOID**)&pci_io,
+      image_handle,
+      NULL,
+      EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  // カーネルのドライバが扱えるのは legacy インターフェースを持つ virtio-blk (vendor 0x1af4, device 0x1001)
+  UINT16 ids[2];
+  status = pci_io->Pci.Read(pci_io, EfiPciIoWidthUint16, 0, 2, ids);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  if (ids[0] != 0x1af4 || ids[1] != 0x1001) {
+    return EFI_UNSUPPORTED;
+  }
+
+  UINTN segment, bus, device, function;
+  status = pci_io->GetLocation(pci_io, &segment, &bus, &device, &function);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  if (segment != 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  boot_volume->has_pci_device = 1;
+  boot_volume->pci_bus = bus;
+  boot_volume->pci_device = device;
+  boot_volume->pci_function = function;
+  return EFI_SUCCESS;
+}
+
 /**
  * ブートローダのメイン関数
  */
@@ -274,6 +389,7 @@ EFI_STATUS EFIAPI UefiMain(
     EFI_HANDLE image_handle,
     EFI_SYSTEM_TABLE* system_table) {
   EFI_STATUS status;
+  UINT64 loader_start_tsc = AsmReadTsc();
 
   Print(L"Hello, Mikan World!\n");
 
@@ -343,7 +459,8 @@ EFI_STATUS EFIAPI UefiMain(
   }
 
   VOID* kernel_buffer;
-  status = ReadFile(kernel_file, &kernel_buffer);
+  UINTN kernel_file_size;
+  status = ReadFile(kernel_file, &kernel_buffer, &kernel_file_size);
   if (EFI_ERROR(status)) {
     Print(L"error: %r", status);
     Halt();
@@ -376,7 +493,10 @@ EFI_STATUS EFIAPI UefiMain(
   }
   
   // ボリュームイメージを読み込む
-  VOID* volume_image;
+  struct BootVolume boot_volume;
+  SetMem(&boot_volume, sizeof(boot_volume), 0);
+  boot_volume.loader_start_tsc = loader_start_tsc;
+  boot_volume.volume_read_start_tsc = AsmReadTsc();
 
   EFI_FILE_PROTOCOL* volume_file;
   status = root_dir->Open(
@@ -384,13 +504,15 @@ EFI_STATUS EFIAPI UefiMain(
       EFI_FILE_MODE_READ, 0);
   if (status == EFI_SUCCESS) {
     // fat_disk という名前のファイルがあれば、それをボリュームとして読み込む
-    status = ReadFile(volume_file, &volume_image);
+    UINTN volume_bytes;
+    status = ReadFile(volume_file, &boot_volume.image, &volume_bytes);
     if (EFI_ERROR(status)) {
       Print(L"failed to read volume file: %r", status);
       Halt();
     }
+    boot_volume.image_bytes = volume_bytes;
+    boot_volume.volume_bytes = volume_bytes;
   } else {
-    // fat_disk ファイルがなければ、起動メディアの全体(上限: 16MiB) を読み込む
     EFI_BLOCK_IO_PROTOCOL* block_io;
     status = OpenBlockIoProtocolForLoadedImage(image_handle, &block_io);
     if (EFI_ERROR(status)) {
@@ -400,19 +522,37 @@ EFI_STATUS EFIAPI UefiMain(
 
     EFI_BLOCK_IO_MEDIA* media = block_io->Media;
     UINTN volume_bytes = (UINTN)media->BlockSize * (media->LastBlock + 1);
-    if (volume_bytes > 32 * 1024 * 1024) {
-      volume_bytes = 32 * 1024 * 1024;
+    UINTN read_bytes = volume_bytes;
+
+    // 起動メディアが virtio-blk デバイス全体なら、カーネルが残りを必要に応じて読み込むので
+    // BPB と FAT だけを読み込む. そうでなければ起動メディアの全体(上限: 32MiB) を読み込む
+    if (!media->LogicalPartition &&
+        !EFI_ERROR(FindVirtioBlkForLoadedImage(image_handle, &boot_volume)) &&
+        !EFI_ERROR(CalcFATRegionBytes(block_io, media->MediaId, &read_bytes)) &&
+        read_bytes <= volume_bytes) {
+      Print(L"Boot volume is virtio-blk %d.%d.%d\n",
+          boot_volume.pci_bus, boot_volume.pci_device, boot_volume.pci_function);
+    } else {
+      boot_volume.has_pci_device = 0;
+      read_bytes = volume_bytes;
+      if (read_bytes > 32 * 1024 * 1024) {
+        read_bytes = 32 * 1024 * 1024;
+      }
+      volume_bytes = read_bytes;
     }
 
-    Print(L"Reading %lu bytes (Present %d, BlockSize %u, LastBlock %u)\n",
-        volume_bytes, media->MediaPresent, media->BlockSize, media->LastBlock);
+    Print(L"Reading %lu of %lu bytes (Present %d, BlockSize %u, LastBlock %u)\n",
+        read_bytes, volume_bytes, media->MediaPresent, media->BlockSize, media->LastBlock);
 
-    status = ReadBlocks(block_io, media->MediaId, volume_bytes, &volume_image);
+    status = ReadBlocks(block_io, media->MediaId, read_bytes, &boot_volume.image);
     if (EFI_ERROR(status)) {
       Print(L"failed to read blocks: %r\n", status);
       Halt();
     }
+    boot_volume.image_bytes = read_bytes;
+    boot_volume.volume_bytes = volume_bytes;
   }
+  boot_volume.volume_read_end_tsc = AsmReadTsc();
 
   // ブートサービスを終了し、カーネル起動準備
   status = gBS->ExitBootServices(image_handle, memmap.map_key);
@@ -465,10 +605,11 @@ EFI_STATUS EFIAPI UefiMain(
   typedef void EntryPointType(
       const struct FrameBufferConfig*, const struct MemoryMap*, 
       const VOID*,  // acpi_table
-      VOID*         // volume_image
+      const struct BootVolume*
   );
   EntryPointType* entry_point = (EntryPointType*)entry_addr;
-  entry_point(&config, &memmap, acpi_table, volume_image);
+  boot_volume.loader_end_tsc = AsmReadTsc();
+  entry_point(&config, &memmap, acpi_table, &boot_volume);
 
   Print(L"All done\n");
 
@@ -1,5 +1,10 @@
 #include <cstdio>
 #include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+// 一度に大きな単位で読み書きして、システムコールの回数を減らす
+static char buf[64 * 1024];
 
 extern "C" void main(int argc, char** argv) {
   if (argc < 3) {
@@ -7,22 +12,21 @@ extern "C" void main(int argc, char** argv) {
     exit(1);
   }
 
-  FILE* fp_src = fopen(argv[1], "r");
-  if (fp_src == nullptr) {
+  const int fd_src = open(argv[1], O_RDONLY);
+  if (fd_src < 0) {
     printf("failed to open for read: %s\n", argv[1]);
     exit(1);
   }
 
-  FILE* fp_dest = fopen(argv[2], "w");
-  if (fp_dest == nullptr) {
+  const int fd_dest = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd_dest < 0) {
     printf("failed to open for write: %s\n", argv[2]);
     exit(1);
   }
 
-  char buf[256];
-  size_t bytes;
-  while ((bytes = fread(buf, 1, sizeof(buf), fp_src)) > 0) {
-    const size_t written = fwrite(buf, 1, bytes, fp_dest);
+  ssize_t bytes;
+  while ((bytes = read(fd_src, buf, sizeof(buf))) > 0) {
+    const ssize_t written = write(fd_dest, buf, bytes);
     if (bytes != written) {
       printf("failed to write to %s\n", argv[2]);
       exit(1);
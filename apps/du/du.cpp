@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../syscall.h"
+
+// ディレクトリの木をたどり、ディレクトリごとのファイルの合計サイズを表示する
+// -a を付けるとファイルも 1 つずつ表示する (find の代わりに使える)
+// ReadDir は 1 回の呼び出しで複数のエントリと大きさを返すので、ファイルを 1 つずつ開く必要はない
+
+namespace {
+  const size_t kEntriesPerCall = 32;
+
+  AppDirEntry entries[kEntriesPerCall];
+  bool print_files = false;
+  size_t num_files = 0, num_dirs = 0, num_syscalls = 0;
+
+  std::string JoinPath(const std::string& dir, const char* name) {
+    if (dir.empty() || dir.back() == '/') {
+      return dir + name;
+    }
+    return dir + "/" + name;
+  }
+
+  // path 以下のファイルの合計サイズを返す
+  uint64_t Walk(const std::string& path) {
+    uint64_t total = 0;
+    std::vector<std::string> subdirs;
+
+    // エントリを読み終えてから下のディレクトリに進むので、entries は使い回せる
+    for (size_t offset = 0; ; ) {
+      const auto res = SyscallReadDir(path.c_str(), entries, kEntriesPerCall, offset);
+      ++num_syscalls;
+      if (res.error) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(res.error));
+        return total;
+      } else if (res.value == 0) {
+        break;
+      }
+      offset += res.value;
+
+      for (size_t i = 0; i < res.value; ++i) {
+        const auto& e = entries[i];
+        if (e.attr & APP_DIR_ATTR_VOLUME_ID ||
+            strcmp(e.name, ".") == 0 || strcmp(e.name, "..") == 0) {
+          continue;
+        }
+        if (e.attr & APP_DIR_ATTR_DIRECTORY) {
+          subdirs.push_back(JoinPath(path, e.name));
+          continue;
+        }
+        ++num_files;
+        total += e.size;
+        if (print_files) {
+          printf("%8lu  %s\n", (e.size + 1023) / 1024, JoinPath(path, e.name).c_str());
+        }
+      }
+    }
+
+    for (const auto& subdir : subdirs) {
+      total += Walk(subdir);
+    }
+    ++num_dirs;
+    printf("%8lu  %s\n", (total + 1023) / 1024, path.c_str());
+    return total;
+  }
+}
+
+extern "C" void main(int argc, char** argv) {
+  const char* root = "/";
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-a") == 0) {
+      print_files = true;
+    } else {
+      root = argv[i];
+    }
+  }
+
+  const uint64_t total = Walk(root);
+  fprintf(stderr, "%lu bytes in %lu files, %lu directories (%lu ReadDir calls)\n",
+          total, num_files, num_dirs, num_syscalls);
+  exit(0);
+}
@@ -0,0 +1,200 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include "../syscall.h"
+
+// io ring を使い、ファイルの読み込み・タイマ・描画・イベント待ちを 1 つのループで同時に進めるデモ
+// 操作ごとにシステムコールを呼ばず、SQ に積んだ操作の完了を CQ から回収する
+
+namespace {
+  const uint32_t kSQEntries = 16;
+  const uint32_t kChunkBytes = 16 * 1024;
+  const int kNumChunks = 2;  // 同時に発行する読み込みの数
+
+  // user_data の上位で操作の種類を区別する
+  const uint64_t kTagRead = 1ull << 32;
+  const uint64_t kTagTimer = 2ull << 32;
+  const uint64_t kTagEvent = 3ull << 32;
+  const uint64_t kTagDraw = 4ull << 32;
+
+  IORingHeader* ring;
+  IORingSQE* sq;
+  IORingCQE* cq;
+  uint8_t* buf;
+
+  void SetupRing() {
+    auto res = SyscallIORingSetup(kSQEntries, kChunkBytes * kNumChunks + 256);
+    if (res.error) {
+      fprintf(stderr, "IORingSetup: %s\n", strerror(res.error));
+      exit(1);
+    }
+    auto base = reinterpret_cast<uint8_t*>(res.value);
+    ring = reinterpret_cast<IORingHeader*>(base);
+    sq = reinterpret_cast<IORingSQE*>(base + ring->sq_offset);
+    cq = reinterpret_cast<IORingCQE*>(base + ring->cq_offset);
+    buf = base + ring->buf_offset;
+  }
+
+  // SQ の空き要素を取得する. 満杯なら nullptr
+  IORingSQE* GetSQE() {
+    const uint32_t head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_tail - head >= ring->sq_entries) {
+      return nullptr;
+    }
+    auto sqe = &sq[ring->sq_tail & (ring->sq_entries - 1)];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  // GetSQE で取得した要素をカーネルに渡す
+  void PushSQE() {
+    __atomic_store_n(&ring->sq_tail, ring->sq_tail + 1, __ATOMIC_RELEASE);
+  }
+
+  void SubmitRead(int fd, int chunk, uint64_t offset) {
+    auto sqe = GetSQE();
+    sqe->op = kIORingRead;
+    sqe->fd = fd;
+    sqe->offset = offset;
+    sqe->buf = chunk * kChunkBytes;
+    sqe->len = kChunkBytes;
+    sqe->user_data = kTagRead | chunk;
+    PushSQE();
+  }
+
+  void SubmitTimer(uint64_t ms) {
+    auto sqe = GetSQE();
+    sqe->op = kIORingTimeout;
+    sqe->offset = ms;
+    sqe->user_data = kTagTimer;
+    PushSQE();
+  }
+
+  void SubmitReadEvent() {
+    auto sqe = GetSQE();
+    sqe->op = kIORingReadEvent;
+    sqe->user_data = kTagEvent;
+    PushSQE();
+  }
+
+  // 進捗を描画する. 描画の完了は待たない
+  void SubmitDraw(uint64_t layer_id, size_t total, int ticks, bool done) {
+    auto rect = GetSQE();
+    if (!rect) {
+      return;
+    }
+    rect->op = kIORingWinFillRectangle;
+    rect->layer_id_flags = layer_id | LAYER_NO_REDRAW;
+    rect->x = 4;
+    rect->y = 24;
+    rect->w = 192;
+    rect->h = 16;
+    rect->color = 0xffffff;
+    rect->user_data = kTagDraw;
+    PushSQE();
+
+    auto text = GetSQE();
+    if (!text) {
+      return;
+    }
+    const char spinner[] = "|/-\\";
+    char* s = reinterpret_cast<char*>(buf + kChunkBytes * kNumChunks);
+    const int len = snprintf(s, 256, "%c %lu bytes",
+                             done ? '*' : spinner[ticks % 4], total);
+    text->op = kIORingWinWriteString;
+    text->layer_id_flags = layer_id;
+    text->x = 8;
+    text->y = 24;
+    text->color = 0x000000;
+    text->buf = kChunkBytes * kNumChunks;
+    text->len = len;
+    text->user_data = kTagDraw;
+    PushSQE();
+  }
+}
+
+extern "C" void main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+    exit(1);
+  }
+
+  const int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "failed to open %s\n", argv[1]);
+    exit(1);
+  }
+
+  auto win = SyscallOpenWindow(200, 44, 10, 10, "ioring");
+  if (win.error) {
+    fprintf(stderr, "%s\n", strerror(win.error));
+    exit(1);
+  }
+  const uint64_t layer_id = win.value;
+
+  SetupRing();
+
+  // 読み込みは kNumChunks 個ずつ発行する. 完了は発行順に届く
+  uint64_t next_offset = 0;
+  for (int chunk = 0; chunk < kNumChunks; ++chunk) {
+    SubmitRead(fd, chunk, next_offset);
+    next_offset += kChunkBytes;
+  }
+  SubmitTimer(100);
+  SubmitReadEvent();
+
+  size_t total = 0;
+  uint32_t checksum = 0;
+  int ticks = 0, reads_in_flight = kNumChunks;
+  bool eof = false, reading = true;
+
+  while (true) {
+    const uint32_t n = SyscallIORingEnter(1).value;
+    for (uint32_t i = 0; i < n; ++i) {
+      const IORingCQE& cqe = cq[ring->cq_head & (ring->cq_entries - 1)];
+      const uint64_t tag = cqe.user_data & ~0xffffffffull;
+
+      if (tag == kTagRead) {
+        --reads_in_flight;
+        if (cqe.result < 0) {
+          fprintf(stderr, "read failed: %s\n", strerror(-cqe.result));
+          eof = true;
+        } else {
+          const int chunk = cqe.user_data & 0xffffffff;
+          const uint8_t* p = buf + chunk * kChunkBytes;
+          for (int64_t j = 0; j < cqe.result; ++j) {
+            checksum = checksum * 31 + p[j];
+          }
+          total += cqe.result;
+          if (cqe.result < kChunkBytes) {
+            eof = true;
+          } else if (!eof) {
+            SubmitRead(fd, chunk, next_offset);
+            next_offset += kChunkBytes;
+            ++reads_in_flight;
+          }
+        }
+        if (eof && reads_in_flight == 0) {
+          reading = false;
+          SubmitDraw(layer_id, total, ticks, true);
+          printf("%s: %lu bytes, checksum %08x\n", argv[1], total, checksum);
+        }
+      } else if (tag == kTagTimer) {
+        ++ticks;
+        if (reading) {
+          SubmitDraw(layer_id, total, ticks, false);
+          SubmitTimer(100);
+        }
+      } else if (tag == kTagEvent) {
+        if (cqe.event.type == AppEvent::kQuit) {
+          SyscallCloseWindow(layer_id);
+          exit(0);
+        }
+        SubmitReadEvent();
+      }
+
+      __atomic_store_n(&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+    }
+  }
+}
@@ -13,7 +13,11 @@ int close(int fd) {
 }
 
 int fstat(int fd, struct stat* buf) {
-  errno = EBADF;
+  struct SyscallResult res = SyscallFStat(fd, buf);
+  if (res.error == 0) {
+    return 0;
+  }
+  errno = res.error;
   return -1;
 }
 
@@ -22,8 +26,15 @@ pid_t getpid(void) {
 }
 
 int isatty(int fd) {
-  errno = EBADF;
-  return -1;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    return 0;
+  }
+  if (!S_ISCHR(st.st_mode)) {
+    errno = ENOTTY;
+    return 0;
+  }
+  return 1;
 }
 
 int kill(pid_t pid, int sig) {
@@ -41,7 +52,29 @@ int open(const char* path, int flags) {
 }
 
 off_t lseek(int fd, off_t offset, int whence) {
-  errno = EBADF;
+  struct SyscallResult res = SyscallLSeek(fd, offset, whence);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
+  return -1;
+}
+
+ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
+  struct SyscallResult res = SyscallPRead(fd, buf, count, offset);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
+  return -1;
+}
+
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset) {
+  struct SyscallResult res = SyscallPWrite(fd, buf, count, offset);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
   return -1;
 }
 
@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../syscall.h"
+
+// ファイルの任意の位置から 4KiB ずつランダムに読み込み、1 回あたりの時間を測る
+// ファイルが無ければ 64MiB のファイルを作成してから測る
+
+namespace {
+  const size_t kBlockSize = 4096;
+  const size_t kDefaultFileSize = 64 * 1024 * 1024;
+
+  uint8_t block[kBlockSize];
+
+  uint64_t xorshift_state = 88172645463325252ull;
+  uint64_t Random() {
+    xorshift_state ^= xorshift_state << 13;
+    xorshift_state ^= xorshift_state >> 7;
+    xorshift_state ^= xorshift_state << 17;
+    return xorshift_state;
+  }
+
+  uint64_t ElapsedMS(uint64_t start_tick) {
+    const auto [ tick, freq ] = SyscallGetCurrentTick();
+    return (tick - start_tick) * 1000 / freq;
+  }
+
+  bool CreateFile(const char* path, size_t size) {
+    const int fd = open(path, O_WRONLY | O_CREAT);
+    if (fd < 0) {
+      return false;
+    }
+    for (size_t off = 0; off < size; off += kBlockSize) {
+      memset(block, off / kBlockSize, kBlockSize);
+      if (write(fd, block, kBlockSize) != kBlockSize) {
+        close(fd);
+        return false;
+      }
+    }
+    close(fd);
+    return true;
+  }
+}
+
+extern "C" void main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <file> [reads]\n", argv[0]);
+    exit(1);
+  }
+  const char* path = argv[1];
+  const int reads = argc >= 3 ? atoi(argv[2]) : 4096;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("creating %s (%lu MiB)\n", path, kDefaultFileSize / 1024 / 1024);
+    if (!CreateFile(path, kDefaultFileSize)) {
+      fprintf(stderr, "failed to create %s\n", path);
+      exit(1);
+    }
+    fd = open(path, O_RDONLY);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "failed to open %s\n", path);
+    exit(1);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < kBlockSize) {
+    fprintf(stderr, "%s is too small\n", path);
+    exit(1);
+  }
+  const size_t num_blocks = st.st_size / kBlockSize;
+
+  // 最初の 1 回はファイル末尾を読む. クラスタチェーンを全てたどることになる
+  uint64_t begin = __builtin_ia32_rdtsc();
+  SyscallPRead(fd, block, kBlockSize, (num_blocks - 1) * kBlockSize);
+  const uint64_t first = __builtin_ia32_rdtsc() - begin;
+
+  const uint64_t start_tick = SyscallGetCurrentTick().value;
+  begin = __builtin_ia32_rdtsc();
+  uint32_t sum = 0;
+  for (int i = 0; i < reads; ++i) {
+    const size_t off = Random() % num_blocks * kBlockSize;
+    const auto res = SyscallPRead(fd, block, kBlockSize, off);
+    if (res.error || res.value != kBlockSize) {
+      fprintf(stderr, "read failed at %lu\n", off);
+      exit(1);
+    }
+    sum += block[0];
+  }
+  const uint64_t cycles = __builtin_ia32_rdtsc() - begin;
+  const uint64_t ms = ElapsedMS(start_tick);
+
+  printf("file size  : %ld bytes\n", st.st_size);
+  printf("first read : %lu cycles\n", first);
+  printf("random read: %d x %lu bytes in %lu ms, %lu cycles/read (sum %u)\n",
+         reads, kBlockSize, ms, cycles / reads, sum);
+  if (ms > 0) {
+    printf("throughput : %lu KiB/s\n", reads * kBlockSize * 1000 / ms / 1024);
+  }
+  close(fd);
+  exit(0);
+}
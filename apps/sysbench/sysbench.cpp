@@ -0,0 +1,40 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../syscall.h"
+
+// 中身がほぼ空のシステムコールを繰り返し呼び、1回あたりの往復にかかる TSC サイクル数を測る
+template <class Func>
+uint64_t MeasureCycles(int count, Func f) {
+  uint64_t best = UINT64_MAX;
+  for (int trial = 0; trial < 5; ++trial) {
+    const uint64_t begin = __builtin_ia32_rdtsc();
+    for (int i = 0; i < count; ++i) {
+      f();
+    }
+    const uint64_t cycles = __builtin_ia32_rdtsc() - begin;
+    if (cycles < best) {
+      best = cycles;
+    }
+  }
+  return best / count;
+}
+
+extern "C" void main(int argc, char** argv) {
+  int count = 100000;
+  if (argc >= 2) {
+    count = atoi(argv[1]);
+  }
+  if (count <= 0) {
+    printf("Usage: %s [count]\n", argv[0]);
+    exit(1);
+  }
+
+  // タスクを参照しないシステムコール(入口・出口のコストのみ)
+  const auto tick = MeasureCycles(count, []{ SyscallGetCurrentTick(); });
+  // 実行中タスクを参照してすぐエラーを返すシステムコール
+  const auto badfd = MeasureCycles(count, []{ SyscallReadFile(-1, nullptr, 0); });
+
+  printf("GetCurrentTick : %lu cycles/call\n", tick);
+  printf("ReadFile(-1)   : %lu cycles/call\n", badfd);
+  exit(0);
+}
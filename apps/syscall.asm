@@ -26,3 +26,14 @@ define_syscall OpenFile,         0x8000000c
 define_syscall ReadFile,         0x8000000d
 define_syscall DemandPages,      0x8000000e
 define_syscall MapFile,          0x8000000f
+define_syscall LSeek,            0x80000010
+define_syscall PRead,            0x80000011
+define_syscall PWrite,           0x80000012
+define_syscall ReadV,            0x80000013
+define_syscall WriteV,           0x80000014
+define_syscall FStat,            0x80000015
+define_syscall IORingSetup,      0x80000016
+define_syscall IORingEnter,      0x80000017
+define_syscall WinDrawPolyline,  0x80000018
+define_syscall WinFillPolygon,   0x80000019
+define_syscall ReadDir,          0x8000001a
@@ -10,6 +10,9 @@ extern "C" {
 
 #include "../kernel/logger.hpp"
 #include "../kernel/app_event.hpp"
+#include "../kernel/app_file.hpp"
+#include "../kernel/app_graphics.hpp"
+#include "../kernel/app_io_ring.hpp"
 
 struct SyscallResult {
   uint64_t value;
@@ -45,6 +48,23 @@ struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
 struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags); 
 
+struct stat;
+
+struct SyscallResult SyscallLSeek(int fd, int64_t offset, int whence);
+struct SyscallResult SyscallPRead(int fd, void* buf, size_t count, size_t offset);
+struct SyscallResult SyscallPWrite(int fd, const void* buf, size_t count, size_t offset);
+struct SyscallResult SyscallReadV(int fd, const struct AppIOVec* iov, int iovcnt);
+struct SyscallResult SyscallWriteV(int fd, const struct AppIOVec* iov, int iovcnt);
+struct SyscallResult SyscallFStat(int fd, struct stat* buf);
+
+struct SyscallResult SyscallIORingSetup(uint32_t sq_entries, uint32_t buf_bytes);
+struct SyscallResult SyscallIORingEnter(uint32_t min_complete);
+
+struct SyscallResult SyscallWinDrawPolyline(uint64_t layer_id_flags, const struct AppPoint* points, size_t n, uint32_t color);
+struct SyscallResult SyscallWinFillPolygon(uint64_t layer_id_flags, const struct AppPoint* points, size_t n, uint32_t color);
+
+struct SyscallResult SyscallReadDir(const char* path, struct AppDirEntry* entries, size_t count, size_t offset);
+
 #ifdef __cplusplus
 }
 #endif
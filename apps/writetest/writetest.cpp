@@ -0,0 +1,127 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../syscall.h"
+
+// 1KiB から 64MiB までの大きさのファイルを書き込んで書き込み速度を測り、読み戻して内容を確かめる
+// 書き込みは chunk バイトずつ行う. 大きさごとに内容を変えるので、前回の内容が残っていれば検出できる
+// 時間は open から最後の write を経て close するまでを 1 区間として測る. 内容は測る前にすべて作っておく
+
+namespace {
+  const size_t kDefaultMaxBytes = 64 * 1024 * 1024;
+  const size_t kDefaultChunkBytes = 64 * 1024;
+  const size_t kMaxChunkBytes = 1024 * 1024;
+
+  uint8_t buf[kMaxChunkBytes];
+
+  // ファイルの off バイト目に書く値
+  uint8_t Pattern(size_t off, uint32_t seed) {
+    const uint32_t x = (off / 4) * 2654435761u + seed;
+    return (x >> ((off % 4) * 8)) ^ (x >> 24);
+  }
+
+  void Fill(uint8_t* p, size_t len, uint32_t seed) {
+    for (size_t i = 0; i < len; ++i) {
+      p[i] = Pattern(i, seed);
+    }
+  }
+
+  uint64_t ElapsedMS(uint64_t start_tick) {
+    const auto [ now, freq ] = SyscallGetCurrentTick();
+    return (now - start_tick) * 1000 / freq;
+  }
+
+  // ファイルの内容が書き込んだとおりか確かめる. 最初に食い違った位置を返し、一致すれば size を返す
+  size_t Verify(const char* path, size_t size, size_t chunk, uint32_t seed) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return 0;
+    }
+    size_t off = 0;
+    while (off < size) {
+      const ssize_t n = read(fd, buf, chunk);
+      if (n <= 0) {
+        break;
+      }
+      for (ssize_t i = 0; i < n; ++i) {
+        if (buf[i] != Pattern(off + i, seed)) {
+          close(fd);
+          return off + i;
+        }
+      }
+      off += n;
+    }
+    // ファイルが書き込んだ量より長ければ、それも食い違いとする
+    if (off == size && read(fd, buf, 1) != 0) {
+      off = size + 1;
+    }
+    close(fd);
+    return off;
+  }
+}
+
+extern "C" void main(int argc, char** argv) {
+  const char* path = argc >= 2 ? argv[1] : "writetest.dat";
+  const size_t max_bytes = argc >= 3 ? strtoul(argv[2], nullptr, 0) : kDefaultMaxBytes;
+  const size_t chunk = argc >= 4 ? strtoul(argv[3], nullptr, 0) : kDefaultChunkBytes;
+  if (chunk == 0 || chunk > kMaxChunkBytes) {
+    fprintf(stderr, "Usage: %s [file] [max bytes] [chunk bytes (<= %lu)]\n", argv[0], kMaxChunkBytes);
+    exit(1);
+  }
+
+  uint8_t* data = reinterpret_cast<uint8_t*>(malloc(max_bytes));
+  if (data == nullptr) {
+    fprintf(stderr, "failed to allocate %lu bytes\n", max_bytes);
+    exit(1);
+  }
+
+  printf("%10s %8s %10s %14s  %s\n", "size", "ms", "KiB/s", "cycles", "verify");
+  int failures = 0;
+  uint32_t seed = 1;
+  for (size_t size = 1024; size <= max_bytes; size *= 4, ++seed) {
+    // 内容を作る時間は測らない
+    Fill(data, size, seed);
+
+    // タイマ割り込みの刻みより短い区間もあるので、TSC でも測る
+    const uint64_t start_tick = SyscallGetCurrentTick().value;
+    const uint64_t begin = __builtin_ia32_rdtsc();
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0) {
+      fprintf(stderr, "failed to open %s\n", path);
+      exit(1);
+    }
+    size_t written = 0;
+    while (written < size) {
+      const size_t n = size - written < chunk ? size - written : chunk;
+      const ssize_t res = write(fd, data + written, n);
+      if (res != n) {
+        fprintf(stderr, "write failed at %lu\n", written + (res > 0 ? res : 0));
+        exit(1);
+      }
+      written += n;
+    }
+    close(fd);
+    const uint64_t cycles = __builtin_ia32_rdtsc() - begin;
+    const uint64_t ms = ElapsedMS(start_tick);
+
+    const size_t mismatch = Verify(path, size, chunk, seed);
+    printf("%10lu %8lu ", size, ms);
+    if (ms > 0) {
+      printf("%10lu", size * 1000 / ms / 1024);
+    } else {
+      printf("%10s", "-");
+    }
+    printf(" %14lu", cycles);
+    if (mismatch == size) {
+      printf("  ok\n");
+    } else {
+      printf("  NG at %lu\n", mismatch);
+      ++failures;
+    }
+  }
+
+  free(data);
+  exit(failures == 0 ? 0 : 1);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ReadV/WriteV で読み書きする1つのバッファ
+struct AppIOVec {
+  void* base;
+  size_t len;
+};
+
+// AppDirEntry.name の大きさ. 長い名前(UTF-16 で 255 文字)を UTF-8 にしても収まる
+#define APP_DIR_NAME_LEN 768
+
+// AppDirEntry.attr の値 (FAT の属性そのもの)
+#define APP_DIR_ATTR_VOLUME_ID 0x08
+#define APP_DIR_ATTR_DIRECTORY 0x10
+
+// ReadDir で取得する、ディレクトリ内の 1 エントリの情報
+// 時刻はエントリの日時を UTC とみなした 1970-01-01 からの秒数. 記録されていなければ 0
+struct AppDirEntry {
+  char name[APP_DIR_NAME_LEN];  // NUL 終端した UTF-8 の名前. 長い名前があればそれを使う
+  uint64_t size;
+  uint32_t first_cluster;
+  uint8_t attr;
+  uint8_t reserved[3];
+  int64_t create_time;
+  int64_t write_time;
+  int64_t access_time;         // 日付のみ記録されている
+};
+
+#ifdef __cplusplus
+}
+#endif
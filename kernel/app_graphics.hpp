@@ -0,0 +1,14 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// WinDrawPolyline/WinFillPolygon に渡す頂点(ウィンドウ内の座標)
+struct AppPoint {
+  int32_t x, y;
+};
+
+#ifdef __cplusplus
+}
+#endif
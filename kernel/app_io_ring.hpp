@@ -0,0 +1,57 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// io ring で要求できる操作の種類
+enum IORingOp {
+  kIORingNop,
+  kIORingRead,            // fd, offset, buf, len
+  kIORingWrite,           // fd, offset, buf, len
+  kIORingTimeout,         // offset: タイムアウトまでの時間[msec]
+  kIORingReadEvent,       // 完了時に event にイベントが入る
+  kIORingWinFillRectangle,// layer_id_flags, x, y, w, h, color
+  kIORingWinWriteString,  // layer_id_flags, x, y, color, buf, len
+  kIORingWinRedraw,       // layer_id_flags
+};
+
+// offset にこの値を指定すると、ファイルの現在の読み書き位置を使う
+#define IORING_CURRENT_OFFSET (~0ull)
+
+// サブミッションキューの要素(アプリ -> カーネル)
+struct IORingSQE {
+  uint32_t op;
+  int32_t fd;
+  uint64_t user_data;       // 完了時にそのまま返される値
+  uint64_t offset;
+  uint64_t layer_id_flags;
+  uint32_t buf;             // データ領域の先頭からのオフセット
+  uint32_t len;
+  int32_t x, y, w, h;
+  uint32_t color;
+  uint32_t reserved;
+};
+
+// コンプリーションキューの要素(カーネル -> アプリ)
+struct IORingCQE {
+  uint64_t user_data;
+  int64_t result;           // 成功時は 0 以上の値、失敗時は -errno
+  struct AppEvent event;    // kIORingReadEvent の結果
+};
+
+// 共有領域の先頭に置かれるヘッダ
+// 各キューの head/tail は単調増加するカウンタで、要素数で割った余りが位置を表す
+struct IORingHeader {
+  uint32_t sq_head;         // カーネルが進める
+  uint32_t sq_tail;         // アプリが進める
+  uint32_t cq_head;         // アプリが進める
+  uint32_t cq_tail;         // カーネルが進める
+  uint32_t sq_entries, cq_entries;
+  uint32_t sq_offset, cq_offset;   // 共有領域の先頭からのオフセット
+  uint32_t buf_offset, buf_size;   // 読み書きに使うデータ領域
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,6 +19,34 @@ IoIn32:
   in eax, dx
   ret
 
+global IoOut8  ; void IoOut8(uint16_t addr, uint8_t data);
+IoOut8:
+  mov dx, di    ; dx = addr
+  mov al, sil   ; al = data
+  out dx, al
+  ret
+
+global IoIn8  ; uint8_t IoIn8(uint16_t addr);
+IoIn8:
+  mov dx, di  ; dx = addr
+  xor eax, eax
+  in al, dx
+  ret
+
+global IoOut16  ; void IoOut16(uint16_t addr, uint16_t data);
+IoOut16:
+  mov dx, di    ; dx = addr
+  mov ax, si    ; ax = data
+  out dx, ax
+  ret
+
+global IoIn16  ; uint16_t IoIn16(uint16_t addr);
+IoIn16:
+  mov dx, di  ; dx = addr
+  xor eax, eax
+  in ax, dx
+  ret
+
 global GetCS  ; uint16_t GetCS(void);
 GetCS:
   xor eax, eax  ; also clears upper 32 btis of rax
@@ -96,6 +124,8 @@ GetCR3:
   mov rax, cr3
   ret
 
+extern per_cpu_data
+
 global SwitchContext  ; void SwitchContext(void* next_ctx, void* current_ctx);
 SwitchContext:
   mov [rsi + 0x40], rax
@@ -271,8 +301,16 @@ WriteMSR: ; void WriteMSR(uint32_t msr, uint64_t value);
   wrmsr
   ret
 
-extern GetCurrentTaskOSStackPointer
+global ReadMSR
+ReadMSR: ; uint64_t ReadMSR(uint32_t msr);
+  mov ecx, edi
+  rdmsr
+  shl rdx, 32
+  or rax, rdx
+  ret
+
 extern syscall_table
+extern SyscallTraced
 global SyscallEntry
 SyscallEntry: ; void SyscallEntry(void);
   push rbp
@@ -288,9 +326,8 @@ SyscallEntry: ; void SyscallEntry(void);
   and rsp, 0xfffffffffffffff0
   push rax
   push rdx
-  cli
-  call GetCurrentTaskOSStackPointer
-  sti
+  mov rax, [rel per_cpu_data + 0x08]  ; 実行中タスクのOS用スタックポインタの保存先を取得
+  mov rax, [rax]
   mov rdx, [rsp + 0]  ; RDX
   mov [rax - 16], rdx
   mov rdx, [rsp + 8]  ; RAX
@@ -301,8 +338,11 @@ SyscallEntry: ; void SyscallEntry(void);
   pop rax
   and rsp, 0xfffffffffffffff0
 
+  cmp qword [rel per_cpu_data + 0x10], 0  ; システムコールのトレースが有効か?
+  jne .trace
   call [syscall_table + 8 * eax]
 
+.return:
   mov rsp, rbp
 
   pop rsi ; システムコール番号を復帰
@@ -327,6 +367,12 @@ SyscallEntry: ; void SyscallEntry(void);
 
   ret ; CallApp の次の行に飛ぶ
 
+.trace:
+  sub rsp, 8
+  push rax  ; 第7引数: システムコール番号
+  call SyscallTraced
+  jmp .return
+
 global ExitApp  ; void ExitApp(uint64_t rsp, int32_t ret_val);
 ExitApp:
   mov rsp, rdi  ; スタックをOS用の領域に切り替え
@@ -347,6 +393,13 @@ InvalidateTLB:
   invlpg [rdi]
   ret
 
+global ReadTSC  ; uint64_t ReadTSC(void);
+ReadTSC:
+  rdtsc
+  shl rdx, 32
+  or rax, rdx
+  ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
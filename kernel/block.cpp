@@ -0,0 +1,23 @@
+#include "block.hpp"
+
+#include <cstring>
+
+RAMBlockDevice::RAMBlockDevice(void* image, size_t bytes)
+    : image_{reinterpret_cast<uint8_t*>(image)}, num_blocks_{bytes / kBlockSize} {
+}
+
+Error RAMBlockDevice::Read(uint64_t lba, void* buf, size_t count) {
+  if (lba + count > num_blocks_) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  memcpy(buf, image_ + lba * kBlockSize, count * kBlockSize);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error RAMBlockDevice::Write(uint64_t lba, const void* buf, size_t count) {
+  if (lba + count > num_blocks_) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  memcpy(image_ + lba * kBlockSize, buf, count * kBlockSize);
+  return MAKE_ERROR(Error::kSuccess);
+}
@@ -0,0 +1,43 @@
+/**
+ * @file block.hpp
+ *
+ * セクタ単位で読み書きするブロックデバイスの共通インターフェース
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "error.hpp"
+
+// 読み書きのバッファはアイデンティティマッピングされた領域(= 物理アドレス)を指すこと
+// デバイスによっては DMA でバッファに直接転送する
+class BlockDevice {
+  public:
+    virtual ~BlockDevice() = default;
+    // 1 ブロック(セクタ)のバイト数
+    virtual size_t BlockSize() const = 0;
+    virtual uint64_t NumBlocks() const = 0;
+    // lba から count ブロックを buf に読み込む
+    virtual Error Read(uint64_t lba, void* buf, size_t count) = 0;
+    // buf の内容を lba から count ブロックに書き込む
+    virtual Error Write(uint64_t lba, const void* buf, size_t count) = 0;
+};
+
+// ローダがメモリに読み込んだボリュームのイメージを読み書きする
+// 書き込んだ内容はメモリ上にしか残らない
+class RAMBlockDevice : public BlockDevice {
+  public:
+    static const size_t kBlockSize = 512;
+
+    RAMBlockDevice(void* image, size_t bytes);
+    size_t BlockSize() const override { return kBlockSize; }
+    uint64_t NumBlocks() const override { return num_blocks_; }
+    Error Read(uint64_t lba, void* buf, size_t count) override;
+    Error Write(uint64_t lba, const void* buf, size_t count) override;
+
+  private:
+    uint8_t* image_;
+    uint64_t num_blocks_;
+};
@@ -0,0 +1,486 @@
+#include "block_cache.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include "asmfunc.h"
+#include "fat.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include "virtio_blk.hpp"
+
+BlockCache* block_cache;
+
+namespace {
+  // キャッシュに置くページ数の上限 (64MiB)
+  const size_t kMaxCachePages = 16384;
+
+  const int kFlushTimerValue = 1;
+  const int kFlushPeriod = kTimerFreq * 5;
+
+  // デバイス上の offset から bytes バイトを含むブロックの範囲を求める
+  std::pair<uint64_t, size_t> BlockRange(const BlockDevice& dev, uint64_t offset, uint64_t bytes) {
+    const size_t block_size = dev.BlockSize();
+    return { offset / block_size, (bytes + block_size - 1) / block_size };
+  }
+}
+
+BlockCache::BlockCache(BlockDevice& dev, uint64_t bytes, size_t max_pages)
+    : dev_{dev}, bytes_{bytes}, resident_(max_pages) {
+}
+
+Error BlockCache::Initialize() {
+  // PML4 の 1 エントリ (512GiB) に収まるボリュームだけを扱う
+  if (bytes_ > 512ull * 1024 * 1024 * 1024 || resident_.empty()) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  auto& entry = pml4_table[LinearAddress4Level{kBaseAddr}.Part(4)];
+  if (entry.bits.present) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+
+  auto [ pdp_table, err ] = NewPageMap();
+  if (err) {
+    return err;
+  }
+  // アプリの PML4 は作成時にカーネルの PML4 の下半分をコピーするので、
+  // ここで PDPT を登録しておけば以降に作られるページもすべてのアプリから見える
+  // (user ビットを立てないので、アプリ自身からは触れない)
+  entry.data = 0;
+  entry.SetPointer(pdp_table);
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  pdp_table_ = pdp_table;
+
+  // まとめて書き戻すための領域が取れなければ、1 ページずつ書き戻す
+  if (auto buf = memory_manager->Allocate(kMaxWriteBackPages); !buf.error) {
+    write_buf_ = reinterpret_cast<uint8_t*>(buf.value.Frame());
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+PageMapEntry* BlockCache::GetPTE(uint64_t page, bool create) {
+  const LinearAddress4Level addr{page};
+  PageMapEntry* table = pdp_table_;
+  for (int level = 3; level > 1; --level) {
+    auto& entry = table[addr.Part(level)];
+    if (!entry.bits.present) {
+      if (!create) {
+        return nullptr;
+      }
+      auto [ child_map, err ] = NewPageMap();
+      if (err) {
+        return nullptr;
+      }
+      entry.data = 0;
+      entry.SetPointer(child_map);
+      entry.bits.present = 1;
+      entry.bits.writable = 1;
+    }
+    table = entry.Pointer();
+  }
+  return &table[addr.Part(1)];
+}
+
+bool BlockCache::IsResident(uint64_t page) {
+  auto pte = GetPTE(page, false);
+  return pte && pte->bits.present;
+}
+
+// 空きを確保してから呼び出すこと
+Error BlockCache::MapPage(uint64_t page, void* frame) {
+  auto pte = GetPTE(page, true);
+  if (pte == nullptr) {
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+  pte->data = 0;
+  pte->SetPointer(reinterpret_cast<PageMapEntry*>(frame));
+  pte->bits.present = 1;
+  pte->bits.writable = 1;
+
+  resident_[(resident_head_ + num_resident_) % resident_.size()] = page;
+  ++num_resident_;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error BlockCache::HandlePageFault(uint64_t addr) {
+  const uint64_t page = addr & ~(kPageSize - 1);
+
+  // 直前のページが読み込み済みなら順にアクセスされているとみなして、続くページもまとめて読み込む
+  // ボリュームの末尾か、読み込み済みのページで打ち切る
+  size_t n = 1;
+  if (page > kBaseAddr && IsResident(page - kPageSize)) {
+    const size_t limit = std::min(kReadAheadPages, resident_.size());
+    while (n < limit && page + n * kPageSize < kBaseAddr + bytes_ &&
+           !IsResident(page + n * kPageSize)) {
+      ++n;
+    }
+  }
+
+  return LoadPages(page, n);
+}
+
+// page から n ページを 1 回の要求で読み込んでマップする. 割り込み禁止状態で呼び出すこと
+Error BlockCache::LoadPages(uint64_t page, size_t n) {
+  while (num_resident_ + n > resident_.size()) {
+    if (auto err = EvictOne()) {
+      return err;
+    }
+  }
+
+  auto frame = memory_manager->Allocate(n);
+  if (frame.error && n > 1) {
+    n = 1;
+    frame = memory_manager->Allocate(1);
+  }
+  if (frame.error) {
+    return frame.error;
+  }
+  auto buf = reinterpret_cast<uint8_t*>(frame.value.Frame());
+
+  // ボリューム末尾のページは、ボリュームを越える部分を 0 で埋める
+  const uint64_t offset = page - kBaseAddr;
+  const uint64_t bytes = std::min(n * kPageSize, bytes_ - offset);
+  if (bytes < n * kPageSize) {
+    memset(buf + bytes, 0, n * kPageSize - bytes);
+  }
+  const auto [ lba, count ] = BlockRange(dev_, offset, bytes);
+  if (auto err = dev_.Read(lba, buf, count)) {
+    memory_manager->Free(frame.value, n);
+    return err;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (auto err = MapPage(page + i * kPageSize, buf + i * kPageSize)) {
+      memory_manager->Free(FrameID{frame.value.ID() + i}, n - i);
+      return err;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void BlockCache::Prefetch(const void* addr, size_t bytes) {
+  const auto begin = reinterpret_cast<uint64_t>(addr) & ~(kPageSize - 1);
+  const auto end = std::min(reinterpret_cast<uint64_t>(addr) + bytes, kBaseAddr + bytes_);
+  // 追い出しで読み込んだばかりのページを失わないよう、1 回に読み込む量はキャッシュの一部に抑える
+  const size_t max_pages = std::max<size_t>(std::min(kMaxPrefetchPages, resident_.size() / 4), 1);
+
+  uint64_t page = std::max(begin, kBaseAddr);
+  while (page < end) {
+    const bool intr = DisableInterrupt();
+    // 読み込まれていないページの並びを探して、まとめて読み込む
+    while (page < end && IsResident(page)) {
+      page += kPageSize;
+    }
+    size_t n = 0;
+    while (page + n * kPageSize < end && n < max_pages && !IsResident(page + n * kPageSize)) {
+      ++n;
+    }
+    auto err = n > 0 ? LoadPages(page, n) : MAKE_ERROR(Error::kSuccess);
+    RestoreInterrupt(intr);
+
+    // 先読みに失敗しても、実際にアクセスしたときのページフォールトで改めて読み込まれる
+    if (err) {
+      return;
+    }
+    page += n * kPageSize;
+  }
+}
+
+void BlockCache::PrepareOverwrite(const void* addr, size_t bytes) {
+  const auto begin = (reinterpret_cast<uint64_t>(addr) + kPageSize - 1) & ~(kPageSize - 1);
+  const auto end = std::min((reinterpret_cast<uint64_t>(addr) + bytes) & ~(kPageSize - 1),
+                            kBaseAddr + bytes_);
+
+  for (uint64_t page = std::max(begin, kBaseAddr); page < end; page += kPageSize) {
+    const bool intr = DisableInterrupt();
+    auto err = MAKE_ERROR(Error::kSuccess);
+    if (!IsResident(page)) {
+      if (num_resident_ == resident_.size()) {
+        err = EvictOne();
+      }
+      if (!err) {
+        if (auto frame = memory_manager->Allocate(1); frame.error) {
+          err = frame.error;
+        } else {
+          memset(frame.value.Frame(), 0, kPageSize);
+          if ((err = MapPage(page, frame.value.Frame()))) {
+            memory_manager->Free(frame.value, 1);
+          }
+        }
+      }
+    }
+    RestoreInterrupt(intr);
+
+    // マップできなかったページは、書き込んだときのページフォールトで読み込まれる
+    if (err) {
+      return;
+    }
+  }
+}
+
+Error BlockCache::Preload(void* image, uint64_t bytes) {
+  if (reinterpret_cast<uintptr_t>(image) % kPageSize != 0) {
+    return MAKE_ERROR(Error::kInvalidFormat);
+  }
+
+  // 末尾の端数ページはイメージにない部分を含むので、必要になったときにデバイスから読み込む
+  auto p = reinterpret_cast<uint8_t*>(image);
+  bytes = std::min(bytes, bytes_);
+  for (uint64_t offset = 0; offset + kPageSize <= bytes; offset += kPageSize) {
+    if (num_resident_ == resident_.size()) {
+      if (auto err = EvictOne()) {
+        return err;
+      }
+    }
+    if (auto err = MapPage(kBaseAddr + offset, p + offset)) {
+      return err;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// 割り込み禁止状態で呼び出すこと
+Error BlockCache::WriteBack(uint64_t page, PageMapEntry& pte) {
+  // 書き込み中にページが書き換えられることはないので、先に dirty ビットを落としておく
+  pte.bits.dirty = 0;
+  InvalidateTLB(page);
+
+  const uint64_t offset = page - kBaseAddr;
+  const auto [ lba, count ] = BlockRange(dev_, offset, std::min(kPageSize, bytes_ - offset));
+  if (auto err = dev_.Write(lba, pte.Pointer(), count)) {
+    pte.bits.dirty = 1;
+    return err;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// 古い順に、最近アクセスされていないページを 1 つ追い出す (クロック方式)
+// 追い出したページに再びアクセスすれば、ページフォールトで読み込み直される
+Error BlockCache::EvictOne() {
+  for (size_t i = 0; i < num_resident_; ++i) {
+    const uint64_t page = resident_[resident_head_];
+    auto pte = GetPTE(page, false);
+    if (!pte->bits.accessed) {
+      break;
+    }
+    pte->bits.accessed = 0;
+    InvalidateTLB(page);
+    resident_[(resident_head_ + num_resident_) % resident_.size()] = page;
+    resident_head_ = (resident_head_ + 1) % resident_.size();
+  }
+
+  const uint64_t page = resident_[resident_head_];
+  auto pte = GetPTE(page, false);
+  if (pte->bits.dirty) {
+    if (auto err = WriteBack(page, *pte)) {
+      return err;
+    }
+  }
+
+  const FrameID frame{reinterpret_cast<uintptr_t>(pte->Pointer()) / kBytesPerFrame};
+  pte->data = 0;
+  InvalidateTLB(page);
+  resident_head_ = (resident_head_ + 1) % resident_.size();
+  --num_resident_;
+  return memory_manager->Free(frame, 1);
+}
+
+// page から end の手前までで、page から続く書き換えられたページの並びをまとめて書き戻す. 割り込み禁止状態で呼び出すこと
+// 書き戻したページ数を返す. page が書き換えられていなければ 0
+WithError<size_t> BlockCache::WriteBackRun(uint64_t page, uint64_t end) {
+  PageMapEntry* ptes[kMaxWriteBackPages];
+  const size_t max_pages = write_buf_ ? kMaxWriteBackPages : 1;
+  size_t n = 0;
+  while (n < max_pages && page + n * kPageSize < end) {
+    auto pte = GetPTE(page + n * kPageSize, false);
+    if (pte == nullptr || !pte->bits.present || !pte->bits.dirty) {
+      break;
+    }
+    ptes[n++] = pte;
+  }
+  if (n <= 1) {
+    auto err = n == 1 ? WriteBack(page, *ptes[0]) : MAKE_ERROR(Error::kSuccess);
+    return { err ? 0 : n, err };
+  }
+
+  // ページのフレームは連続していないので、連続した領域に集めてから 1 回で書き込む
+  for (size_t i = 0; i < n; ++i) {
+    memcpy(write_buf_ + i * kPageSize, ptes[i]->Pointer(), kPageSize);
+    ptes[i]->bits.dirty = 0;
+    InvalidateTLB(page + i * kPageSize);
+  }
+  const uint64_t offset = page - kBaseAddr;
+  const auto [ lba, count ] = BlockRange(dev_, offset, std::min(n * kPageSize, bytes_ - offset));
+  if (auto err = dev_.Write(lba, write_buf_, count)) {
+    for (size_t i = 0; i < n; ++i) {
+      ptes[i]->bits.dirty = 1;
+    }
+    return { 0, err };
+  }
+  return { n, MAKE_ERROR(Error::kSuccess) };
+}
+
+WithError<size_t> BlockCache::FlushRange(const void* addr, size_t bytes) {
+  const auto begin = reinterpret_cast<uint64_t>(addr) & ~(kPageSize - 1);
+  const auto end = std::min(reinterpret_cast<uint64_t>(addr) + bytes, kBaseAddr + bytes_);
+
+  size_t written = 0;
+  // ページテーブルは解放しないので、並びごとに割り込み禁止で書き戻せば
+  // 他のタスクの読み書きやページの追い出しと並行して進められる
+  for (uint64_t page = std::max(begin, kBaseAddr); page < end; ) {
+    const bool intr = DisableInterrupt();
+    auto [ n, err ] = WriteBackRun(page, end);
+    RestoreInterrupt(intr);
+
+    if (err) {
+      return { written, err };
+    }
+    written += n;
+    page += std::max<size_t>(n, 1) * kPageSize;
+  }
+  return { written, MAKE_ERROR(Error::kSuccess) };
+}
+
+WithError<size_t> BlockCache::Flush() {
+  // ボリューム全体ではなく、読み込まれているページだけを調べる
+  std::vector<uint64_t> dirty_pages;
+  const bool intr = DisableInterrupt();
+  for (size_t i = 0; i < num_resident_; ++i) {
+    const uint64_t page = resident_[(resident_head_ + i) % resident_.size()];
+    if (GetPTE(page, false)->bits.dirty) {
+      dirty_pages.push_back(page);
+    }
+  }
+  RestoreInterrupt(intr);
+
+  // アドレス順に並べ、連続するページをまとめて書き戻す
+  std::sort(dirty_pages.begin(), dirty_pages.end());
+  size_t written = 0;
+  for (size_t i = 0; i < dirty_pages.size(); ) {
+    size_t n = 1;
+    while (i + n < dirty_pages.size() && dirty_pages[i + n] == dirty_pages[i] + n * kPageSize) {
+      ++n;
+    }
+    auto [ w, err ] = FlushRange(reinterpret_cast<void*>(dirty_pages[i]), n * kPageSize);
+    written += w;
+    if (err) {
+      return { written, err };
+    }
+    i += n;
+  }
+  return { written, MAKE_ERROR(Error::kSuccess) };
+}
+
+namespace {
+  // ローダが読み込んだボリュームと同じ BPB を持つ virtio-blk デバイスを探す
+  // ローダがデバイスの位置を渡していれば、その位置のものだけを候補にする
+  BlockDevice* FindBootVolumeDevice(const BootVolume& boot_volume, const fat::BPB& bpb) {
+    alignas(512) static uint8_t sector[512];
+    for (auto& dev : virtio::FindBlockDevices()) {
+      const auto& pci_dev = dev->PCIDevice();
+      if (boot_volume.has_pci_device &&
+          (pci_dev.bus != boot_volume.pci_bus ||
+           pci_dev.device != boot_volume.pci_device ||
+           pci_dev.function != boot_volume.pci_function)) {
+        continue;
+      }
+      if (dev->BlockSize() != sizeof(sector) || dev->Read(0, sector, 1)) {
+        continue;
+      }
+      const auto& dev_bpb = *reinterpret_cast<const fat::BPB*>(sector);
+      if (dev_bpb.volume_id == bpb.volume_id &&
+          memcmp(dev_bpb.fs_type, bpb.fs_type, sizeof(bpb.fs_type)) == 0) {
+        return dev.release();
+      }
+    }
+    return nullptr;
+  }
+
+  void TaskBlockFlusher(uint64_t task_id, int64_t data) {
+    Task& task = task_manager->CurrentTask();
+    auto add_flush_timer = [task_id]() {
+      __asm__("cli");
+      timer_manager->AddTimer(
+          Timer{timer_manager->CurrentTick() + kFlushPeriod, kFlushTimerValue, task_id});
+      __asm__("sti");
+    };
+    add_flush_timer();
+
+    while (true) {
+      __asm__("cli");
+      auto msg = task.ReceiveMessage();
+      if (!msg) {
+        task.Sleep();
+        __asm__("sti");
+        continue;
+      }
+      __asm__("sti");
+
+      if (msg->type == Message::kTimerTimeout && msg->arg.timer.value == kFlushTimerValue) {
+        if (auto [ written, err ] = fat::Flush(); err) {
+          Log(kError, "failed to flush block cache: %s\n", err.Name());
+        }
+        add_flush_timer();
+      }
+    }
+  }
+}
+
+void* InitializeBlockCache(const BootVolume& boot_volume) {
+  const auto& bpb = *reinterpret_cast<const fat::BPB*>(boot_volume.image);
+  const uint64_t total_sectors = bpb.total_sectors_16 ? bpb.total_sectors_16 : bpb.total_sectors_32;
+  uint64_t bytes = std::min<uint64_t>(total_sectors * bpb.bytes_per_sector, boot_volume.volume_bytes);
+  // ローダが BPB と FAT だけを読み込んだ場合は、デバイスがないと続けられない
+  const bool partial = boot_volume.has_pci_device && boot_volume.image_bytes < bytes;
+
+  BlockDevice* dev = FindBootVolumeDevice(boot_volume, bpb);
+  if (dev) {
+    Log(kInfo, "boot volume: virtio-blk\n");
+  } else if (partial) {
+    Log(kError, "boot volume device %d.%d.%d is not available\n",
+        boot_volume.pci_bus, boot_volume.pci_device, boot_volume.pci_function);
+    exit(1);
+  } else {
+    bytes = std::min(bytes, boot_volume.image_bytes);
+    dev = new RAMBlockDevice(boot_volume.image, bytes);
+    Log(kInfo, "boot volume: RAM image (changes are lost on reboot)\n");
+  }
+  bytes = std::min<uint64_t>(bytes, dev->NumBlocks() * dev->BlockSize());
+
+  const size_t pages = (bytes + BlockCache::kPageSize - 1) / BlockCache::kPageSize;
+  block_cache = new BlockCache{*dev, bytes, std::min(pages, kMaxCachePages)};
+  if (auto err = block_cache->Initialize()) {
+    Log(kError, "failed to initialize block cache: %s\n", err.Name());
+    if (partial) {
+      exit(1);
+    }
+    delete block_cache;
+    block_cache = nullptr;
+    return boot_volume.image;
+  }
+
+  // 読み込み済みの BPB と FAT はデバイスから読み直さずに使う
+  if (partial) {
+    if (auto err = block_cache->Preload(boot_volume.image, boot_volume.image_bytes)) {
+      Log(kWarn, "failed to preload boot volume: %s\n", err.Name());
+    }
+  }
+  return block_cache->Base();
+}
+
+void InitializeBlockFlusher() {
+  if (block_cache == nullptr) {
+    return;
+  }
+  task_manager->NewTask()
+    .InitContext(TaskBlockFlusher, 0)
+    .Wakeup();
+}
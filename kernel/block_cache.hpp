@@ -0,0 +1,90 @@
+/**
+ * @file block_cache.hpp
+ *
+ * ブロックデバイスの内容を仮想アドレス空間に見せる、ページ単位のライトバックキャッシュ
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "block.hpp"
+#include "boot_volume.hpp"
+#include "error.hpp"
+#include "paging.hpp"
+
+// デバイスの先頭からのバイト位置 = kBaseAddr からのオフセットとなる領域を予約し、
+// 触れられたページだけをページフォールトで読み込む
+// 書き換えられたページは PTE の dirty ビットで追跡し、Flush でデバイスに書き戻す
+// 領域はカーネルの PML4 に登録するので、アプリの PML4 からも同じページが見える
+class BlockCache {
+  public:
+    static constexpr uint64_t kBaseAddr = 0x0000'1000'0000'0000;
+    static constexpr uint64_t kPageSize = 4096;
+    // 順にアクセスされているときにまとめて読み込むページ数
+    static constexpr size_t kReadAheadPages = 16;
+    // Prefetch が 1 回の要求で読み込む最大のページ数
+    static constexpr size_t kMaxPrefetchPages = 64;
+    // 1 回の要求でまとめて書き戻す最大のページ数
+    static constexpr size_t kMaxWriteBackPages = 64;
+
+    BlockCache(BlockDevice& dev, uint64_t bytes, size_t max_pages);
+    Error Initialize();
+
+    BlockDevice& Device() const { return dev_; }
+    void* Base() const { return reinterpret_cast<void*>(kBaseAddr); }
+    bool Contains(uint64_t addr) const {
+      return kBaseAddr <= addr && addr < kBaseAddr + bytes_;
+    }
+    size_t NumResidentPages() const { return num_resident_; }
+
+    // addr を含むページを読み込んでマップする. 割り込み禁止状態で呼び出すこと
+    // 直前のページが読み込み済みなら、続くページも kReadAheadPages までまとめて読み込む
+    Error HandlePageFault(uint64_t addr);
+    // [addr, addr + bytes) のうち読み込まれていないページを、連続する並びごとにまとめて読み込む
+    // 大きな範囲を順にコピーする前に呼ぶと、ページフォールトごとに少しずつ読むより要求が少なく済む
+    void Prefetch(const void* addr, size_t bytes);
+    // [addr, addr + bytes) に完全に含まれる読み込まれていないページを、デバイスから読まずに 0 で埋めてマップする
+    // 直後に範囲全体を上書きするときに呼ぶと、捨てられるだけの内容を読み込まずに済む
+    void PrepareOverwrite(const void* addr, size_t bytes);
+    // デバイスの先頭 bytes バイトと同じ内容を持つ、ページ境界から始まる領域 image を、
+    // コピーせずにそのままキャッシュのページとして使う
+    Error Preload(void* image, uint64_t bytes);
+    // [addr, addr + bytes) を含むページのうち書き換えられたものを書き戻し、書き戻したページ数を返す
+    // 書き換えられたページが連続していれば、kMaxWriteBackPages までまとめて 1 回で書き込む
+    WithError<size_t> FlushRange(const void* addr, size_t bytes);
+    // 読み込まれているページのうち書き換えられたものをすべて書き戻し、書き戻したページ数を返す
+    WithError<size_t> Flush();
+
+  private:
+    BlockDevice& dev_;
+    const uint64_t bytes_;
+    PageMapEntry* pdp_table_{nullptr};
+
+    // 読み込んだページの仮想アドレスを読み込んだ順に並べたリングバッファ
+    std::vector<uint64_t> resident_;
+    size_t resident_head_{0}, num_resident_{0};
+    // 連続するページをまとめて書き戻すときに使う、kMaxWriteBackPages ページの物理的に連続した領域
+    uint8_t* write_buf_{nullptr};
+
+    PageMapEntry* GetPTE(uint64_t page, bool create);
+    bool IsResident(uint64_t page);
+    Error MapPage(uint64_t page, void* frame);
+    Error LoadPages(uint64_t page, size_t n);
+    Error WriteBack(uint64_t page, PageMapEntry& pte);
+    WithError<size_t> WriteBackRun(uint64_t page, uint64_t end);
+    Error EvictOne();
+};
+
+extern BlockCache* block_cache;
+
+// ブートボリュームのキャッシュを用意し、fat::Initialize に渡す先頭アドレスを返す
+// ローダが読み込んだものと同じボリュームを virtio-blk デバイスに見つければそれを、
+// なければローダが読み込んだイメージをバックエンドにする
+// ボリュームの一部しか読み込まれていなければ、読み込まれた部分をキャッシュに取り込み、残りをデバイスから読む
+void* InitializeBlockCache(const BootVolume& boot_volume);
+
+// 書き換えられたページを定期的に書き戻すタスクを起動する
+void InitializeBlockFlusher();
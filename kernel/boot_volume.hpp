@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// ローダからカーネルに渡すブートボリュームの情報
+// image_bytes < volume_bytes なら、image にはボリュームの先頭 (BPB と FAT) だけが入っていて、
+// 残りはカーネルが pci_* で示されるデバイスから読み込む. このとき image はページ境界から始まる
+struct BootVolume {
+  void* image;
+  uint64_t image_bytes;
+  uint64_t volume_bytes;
+  uint8_t has_pci_device;  // 1 ならボリュームが PCI デバイス全体を占める
+  uint8_t pci_bus, pci_device, pci_function;
+
+  // ローダの各段階を ReadTSC で計測した値
+  uint64_t loader_start_tsc;
+  uint64_t volume_read_start_tsc;
+  uint64_t volume_read_end_tsc;
+  uint64_t loader_end_tsc;
+};
@@ -1,34 +1,711 @@
 #include "fat.hpp"
 #include <cstring>
 #include <cctype>
+#include <limits>
 #include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "block_cache.hpp"
+#include "interrupt.hpp"
+#include "task.hpp"
 
 namespace{
   // path_elem に最左のパス要素をコピーし、
   // path_elemより後ろの部分を指すポインタ(next_path)とpath_elemの直後にスラッシュがあるかどうかを示すbool値(post_slash)の組を返す
-  std::pair<const char*, bool> NextPathElement(const char* path, char* path_elem) {
+  std::pair<const char*, bool> NextPathElement(const char* path, std::string& path_elem) {
     const char* next_slash = strchr(path, '/'); // path.indexOf('/')
     if (next_slash == nullptr) {
-      strcpy(path_elem, path);
+      path_elem = path;
       return { nullptr, false };
     }
 
-    const auto elem_len = next_slash - path;
-    strncpy(path_elem, path, elem_len);
-    path_elem[elem_len] = '\0';
+    path_elem.assign(path, next_slash - path);
     return { &next_slash[1], true };
   }
 
+  // 名前を比べるためのキー. FAT の名前は大文字小文字を区別しないので、ASCII の英字を大文字にそろえる
+  std::string FoldName(std::string name) {
+    for (auto& c : name) {
+      c = toupper(static_cast<unsigned char>(c));
+    }
+    return name;
+  }
+
+  // UTF-16 の文字列 (0x0000 または末尾まで) を UTF-8 に変換する
+  std::string ToUTF8(const char16_t* s, size_t len) {
+    std::string u8;
+    for (size_t i = 0; i < len && s[i] != 0; ++i) {
+      char32_t c = s[i];
+      if (0xd800 <= c && c < 0xdc00 && i + 1 < len && 0xdc00 <= s[i + 1] && s[i + 1] < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (s[i + 1] - 0xdc00);
+        ++i;
+      }
+
+      if (c < 0x80) {
+        u8 += static_cast<char>(c);
+      } else if (c < 0x800) {
+        u8 += static_cast<char>(0xc0 | (c >> 6));
+        u8 += static_cast<char>(0x80 | (c & 0x3f));
+      } else if (c < 0x10000) {
+        u8 += static_cast<char>(0xe0 | (c >> 12));
+        u8 += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        u8 += static_cast<char>(0x80 | (c & 0x3f));
+      } else {
+        u8 += static_cast<char>(0xf0 | (c >> 18));
+        u8 += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+        u8 += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        u8 += static_cast<char>(0x80 | (c & 0x3f));
+      }
+    }
+    return u8;
+  }
+
+  // UTF-8 の文字列を UTF-16 に変換する. 不正なバイトは '_' に置き換える
+  std::u16string ToUTF16(const char* u8) {
+    std::u16string s;
+    const auto p = reinterpret_cast<const unsigned char*>(u8);
+    for (size_t i = 0; p[i] != 0; ) {
+      char32_t c;
+      int n;
+      if (p[i] < 0x80) {
+        c = p[i]; n = 1;
+      } else if ((p[i] & 0xe0) == 0xc0) {
+        c = p[i] & 0x1f; n = 2;
+      } else if ((p[i] & 0xf0) == 0xe0) {
+        c = p[i] & 0x0f; n = 3;
+      } else if ((p[i] & 0xf8) == 0xf0) {
+        c = p[i] & 0x07; n = 4;
+      } else {
+        c = '_'; n = 1;
+      }
+      for (int j = 1; j < n; ++j) {
+        if ((p[i + j] & 0xc0) != 0x80) {
+          c = '_';
+          n = j;
+          break;
+        }
+        c = (c << 6) | (p[i + j] & 0x3f);
+      }
+      i += n;
+
+      if (c >= 0x10000) {
+        s += static_cast<char16_t>(0xd800 + ((c - 0x10000) >> 10));
+        s += static_cast<char16_t>(0xdc00 + ((c - 0x10000) & 0x3ff));
+      } else {
+        s += static_cast<char16_t>(c);
+      }
+    }
+    return s;
+  }
+
+  // 短名に使える文字か (英小文字は大文字にして使う)
+  bool IsShortNameChar(char c) {
+    return isalnum(static_cast<unsigned char>(c)) || (c != 0 && strchr("!#$%&'()-@^_`{}~", c) != nullptr);
+  }
+
+  // name をそのまま 8.3 形式の短名で表せるか
+  // 短名は大文字で記録されるので、英小文字を含む名前は長い名前のエントリで大小文字を残す
+  bool IsShortName(const char* name) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      return true;
+    }
+    const char* dot_pos = strchr(name, '.');
+    const size_t base_len = dot_pos ? dot_pos - name : strlen(name);
+    const size_t ext_len = dot_pos ? strlen(dot_pos + 1) : 0;
+    if (base_len == 0 || base_len > 8 || ext_len > 3 || (dot_pos && ext_len == 0)) {
+      return false;
+    }
+    for (const char* p = name; *p; ++p) {
+      if (p != dot_pos && (!IsShortNameChar(*p) || islower(static_cast<unsigned char>(*p)))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // 短名のチェックサム. 長い名前のエントリに記録し、短名と組になっているかの確認に使う
+  uint8_t ShortNameChecksum(const unsigned char* name83) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; ++i) {
+      sum = ((sum & 1) << 7) + (sum >> 1) + name83[i];
+    }
+    return sum;
+  }
+
+  void GetLongNameChars(const fat::LongNameEntry& entry, char16_t* chars) {
+    memcpy(&chars[0], entry.name1, sizeof(entry.name1));
+    memcpy(&chars[5], entry.name2, sizeof(entry.name2));
+    memcpy(&chars[11], entry.name3, sizeof(entry.name3));
+  }
+
+  void SetLongNameChars(fat::LongNameEntry& entry, const char16_t* chars) {
+    memcpy(entry.name1, &chars[0], sizeof(entry.name1));
+    memcpy(entry.name2, &chars[5], sizeof(entry.name2));
+    memcpy(entry.name3, &chars[11], sizeof(entry.name3));
+  }
 }
 
 namespace fat {
   BPB* boot_volume_image;
   unsigned long bytes_per_cluster;
-  
+
+  uint32_t* GetFAT();
+  unsigned long ExtendCluster(unsigned long eoc_cluster, size_t n);
+
+  namespace {
+    const uint32_t kFSInfoLeadSignature = 0x41615252;
+    const uint32_t kFSInfoStructSignature = 0x61417272;
+    const uint32_t kFSInfoUnknown = 0xffffffff;
+
+    // FileDescriptor::Read が先読みする量の範囲
+    const size_t kMinReadAheadBytes = 64 * 1024;
+    const size_t kMaxReadAheadBytes = 1024 * 1024;
+    // FileDescriptor::Write が 1 回にコピーする量の上限
+    // 上書きするページをブロックキャッシュに用意してからコピーするので、キャッシュから溢れない大きさにする
+    const size_t kWriteChunkBytes = 256 * 1024;
+
+    // 使用中のクラスタのビットを 1 にしたビットマップ
+    // クラスタ 0, 1 と、num_clusters 以降の余りのビットも使用中として扱う
+    std::vector<uint64_t>* cluster_bitmap;
+    unsigned long num_clusters;    // 最大のクラスタ番号 + 1
+    unsigned long free_clusters;
+    unsigned long next_free_hint;  // 次に空きクラスタを探し始める位置
+
+    // 書き換えたセクタやクラスタを番号で記録するビットマップ
+    class DirtyMap {
+      public:
+        explicit DirtyMap(size_t n) : bits_((n + 63) / 64) {}
+
+        void Mark(size_t begin, size_t end) {
+          for (size_t i = begin; i < end && i / 64 < bits_.size(); ++i) {
+            bits_[i / 64] |= 1ull << (i % 64);
+          }
+        }
+
+        // 記録を消し、記録されていた番号の連続する並び [begin, end) を小さい順に返す
+        std::vector<std::pair<size_t, size_t>> TakeRuns() {
+          std::vector<std::pair<size_t, size_t>> runs;
+          for (size_t w = 0; w < bits_.size(); ++w) {
+            for (uint64_t word = std::exchange(bits_[w], 0); word != 0; word &= word - 1) {
+              const size_t i = w * 64 + __builtin_ctzll(word);
+              if (!runs.empty() && runs.back().second == i) {
+                ++runs.back().second;
+              } else {
+                runs.push_back({i, i + 1});
+              }
+            }
+          }
+          return runs;
+        }
+
+      private:
+        std::vector<uint64_t> bits_;
+    };
+
+    // 前回の Flush 以降に書き換えた場所. FAT は FAT #0 のセクタ番号、データ領域はクラスタ番号で記録する
+    // BPB や FSInfo を含む予約領域は小さいので、書き換えたかどうかだけを持つ
+    DirtyMap* dirty_fat_sectors;
+    DirtyMap* dirty_clusters;
+    bool reserved_dirty;
+
+    bool IsUsed(unsigned long cluster) {
+      return ((*cluster_bitmap)[cluster / 64] >> (cluster % 64)) & 1;
+    }
+
+    void MarkUsed(unsigned long cluster) {
+      (*cluster_bitmap)[cluster / 64] |= 1ull << (cluster % 64);
+    }
+
+    void MarkFree(unsigned long cluster) {
+      (*cluster_bitmap)[cluster / 64] &= ~(1ull << (cluster % 64));
+    }
+
+    // from 以降で最初の空き(used = false)または使用中(used = true)のクラスタ. なければ num_clusters
+    unsigned long FindCluster(unsigned long from, bool used) {
+      unsigned long cluster = from;
+      while (cluster < num_clusters) {
+        uint64_t word = (*cluster_bitmap)[cluster / 64];
+        if (!used) {
+          word = ~word;
+        }
+        word >>= cluster % 64;
+        if (word == 0) {
+          cluster = (cluster / 64 + 1) * 64;
+          continue;
+        }
+        cluster += __builtin_ctzll(word);
+        break;
+      }
+      return std::min(cluster, num_clusters);
+    }
+
+    FSInfo* GetFSInfo() {
+      if (boot_volume_image->fs_info == 0 || boot_volume_image->fs_info == 0xffff) {
+        return nullptr;
+      }
+      auto info = reinterpret_cast<FSInfo*>(
+          reinterpret_cast<uintptr_t>(boot_volume_image) +
+          boot_volume_image->fs_info * boot_volume_image->bytes_per_sector);
+      if (info->lead_signature != kFSInfoLeadSignature ||
+          info->struct_signature != kFSInfoStructSignature) {
+        return nullptr;
+      }
+      return info;
+    }
+
+    // 空きクラスタの数と次の空きクラスタの目安を FSInfo に書き戻す
+    void UpdateFSInfo() {
+      if (auto info = GetFSInfo()) {
+        info->free_count = free_clusters;
+        info->next_free = next_free_hint;
+        MarkDirty(info, sizeof(*info));
+      }
+    }
+
+    void InitializeClusterBitmap() {
+      const auto& bpb = *boot_volume_image;
+      const unsigned long total_sectors = bpb.total_sectors_16 ? bpb.total_sectors_16 : bpb.total_sectors_32;
+      const unsigned long data_sectors =
+        total_sectors - bpb.reserved_sector_count - bpb.num_fats * bpb.fat_size_32;
+      const unsigned long fat_entries =
+        static_cast<unsigned long>(bpb.fat_size_32) * bpb.bytes_per_sector / sizeof(uint32_t);
+      num_clusters = std::min(data_sectors / bpb.sectors_per_cluster + 2, fat_entries);
+
+      cluster_bitmap = new std::vector<uint64_t>((num_clusters + 63) / 64);
+      const uint32_t* fat = GetFAT();
+      free_clusters = 0;
+      for (unsigned long cluster = 0; cluster < cluster_bitmap->size() * 64; ++cluster) {
+        if (cluster < 2 || cluster >= num_clusters || (fat[cluster] & 0x0fffffffu) != 0) {
+          MarkUsed(cluster);
+        } else {
+          ++free_clusters;
+        }
+      }
+
+      next_free_hint = 2;
+      if (auto info = GetFSInfo();
+          info && info->next_free != kFSInfoUnknown && 2 <= info->next_free && info->next_free < num_clusters) {
+        next_free_hint = info->next_free;
+      }
+    }
+
+    // preferred から始まる空きクラスタの並びがあればそれを、なければ n 個以上連続する空きクラスタの並びを
+    // next_free_hint から探して、最大 n 個を使用中にする. n 個連続する並びがなければ最も長い並びを使う
+    // 割り当てた並びの先頭と長さを返す. 空きがなければ長さは 0
+    // 割り込みを禁止して呼び出すこと
+    std::pair<unsigned long, size_t> AllocateRun(unsigned long preferred, size_t n) {
+      if (n == 0 || free_clusters == 0) {
+        return { 0, 0 };
+      }
+
+      unsigned long start = 0;
+      size_t len = 0;
+      if (2 <= preferred && preferred < num_clusters && !IsUsed(preferred)) {
+        start = preferred;
+        len = FindCluster(preferred, true) - preferred;
+      } else {
+        // ヒントから末尾まで、続いて先頭からヒントまでを探す
+        for (auto [ from, to ] : { std::pair{next_free_hint, num_clusters},
+                                   std::pair{2ul, next_free_hint} }) {
+          for (auto c = FindCluster(from, false); c < to; c = FindCluster(c, false)) {
+            const auto run_end = FindCluster(c, true);
+            if (run_end - c > len) {
+              start = c;
+              len = run_end - c;
+            }
+            if (len >= n) {
+              break;
+            }
+            c = run_end;
+          }
+          if (len >= n) {
+            break;
+          }
+        }
+      }
+
+      len = std::min(len, n);
+      for (size_t i = 0; i < len; ++i) {
+        MarkUsed(start + i);
+      }
+      free_clusters -= len;
+      next_free_hint = start + len < num_clusters ? start + len : 2;
+      UpdateFSInfo();
+      return { start, len };
+    }
+  }
+
+  namespace {
+    // 1 つのディレクトリのエントリの索引
+    struct DirectoryIndex {
+      std::vector<DirectoryEntry*> entries;  // 並び順
+      // FoldName した名前 -> エントリ. 長い名前を持つエントリは、長い名前と短名の両方で引ける
+      std::unordered_map<std::string, DirectoryEntry*> by_name;
+    };
+    // ディレクトリの先頭クラスタ番号 -> 索引. 索引は最初に探索したときに作る
+    std::unordered_map<unsigned long, DirectoryIndex>* directory_indices;
+    // 長い名前を持つエントリ -> UTF-8 に変換した長い名前
+    // 索引を作るときに一度だけ変換し、以降の ls や検索ではディレクトリを読み直さない
+    std::unordered_map<const DirectoryEntry*, std::string>* long_names;
+
+    // パスの探索結果のキャッシュ. 見つかったものだけを保持する
+    // ファイルの削除や名前の変更はないので、一度見つかった結果は変わらない
+    struct DentryKey {
+      unsigned long directory_cluster;
+      std::string path;
+
+      bool operator==(const DentryKey& rhs) const {
+        return directory_cluster == rhs.directory_cluster && path == rhs.path;
+      }
+    };
+
+    struct DentryKeyHash {
+      size_t operator()(const DentryKey& key) const {
+        return std::hash<std::string>{}(key.path) ^ key.directory_cluster;
+      }
+    };
+
+    const size_t kMaxDentries = 256;
+    std::unordered_map<DentryKey, std::pair<DirectoryEntry*, bool>, DentryKeyHash>* dentry_cache;
+
+    void AddEntry(DirectoryIndex& index, std::unordered_map<const DirectoryEntry*, std::string>& names,
+                  DirectoryEntry& entry, std::string long_name) {
+      index.entries.push_back(&entry);
+      // 同じ名前のエントリがあれば先にあるものを優先する
+      char short_name[13];
+      FormatName(entry, short_name);
+      index.by_name.emplace(FoldName(short_name), &entry);
+      if (!long_name.empty()) {
+        index.by_name.emplace(FoldName(long_name), &entry);
+        names[&entry] = std::move(long_name);
+      }
+    }
+
+    // ディレクトリのエントリを並び順に読み、長い名前のエントリの列を直後の短名のエントリと組にする
+    // 通し番号かチェックサムが合わない列は、壊れているものとして無視する
+    void ReadDirectory(unsigned long directory_cluster, DirectoryIndex& index,
+                       std::unordered_map<const DirectoryEntry*, std::string>& names) {
+      char16_t lfn[kMaxLongNameLength + kLongNameCharsPerEntry];
+      size_t lfn_len = 0;
+      int lfn_next_ord = 0;  // 次に来るべき通し番号. 0 なら長い名前の列の外
+      bool lfn_complete = false;
+      uint8_t lfn_checksum = 0;
+
+      while (directory_cluster != kEndOfClusterchain) {
+        auto dir = GetSectorByCluster<DirectoryEntry>(directory_cluster);
+        for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
+          if (dir[i].name[0] == 0x00) {
+            return;
+          } else if (dir[i].name[0] == 0xe5) {
+            lfn_next_ord = 0;
+            lfn_complete = false;
+            continue;
+          }
+
+          if (dir[i].attr == Attribute::kLongName) {
+            const auto& l = reinterpret_cast<const LongNameEntry&>(dir[i]);
+            const int ord = l.ord & ~kLastLongNameEntry;
+            if (l.ord & kLastLongNameEntry) {
+              lfn_next_ord = ord;
+              lfn_checksum = l.checksum;
+              lfn_len = ord * kLongNameCharsPerEntry;
+            }
+            lfn_complete = false;
+            if (ord == 0 || ord * kLongNameCharsPerEntry > kMaxLongNameLength + kLongNameCharsPerEntry ||
+                ord != lfn_next_ord || l.checksum != lfn_checksum) {
+              lfn_next_ord = 0;
+              continue;
+            }
+            GetLongNameChars(l, &lfn[(ord - 1) * kLongNameCharsPerEntry]);
+            lfn_complete = --lfn_next_ord == 0;
+            continue;
+          }
+
+          std::string long_name;
+          if (lfn_complete && ShortNameChecksum(dir[i].name) == lfn_checksum) {
+            long_name = ToUTF8(lfn, std::min<size_t>(lfn_len, kMaxLongNameLength));
+          }
+          lfn_next_ord = 0;
+          lfn_complete = false;
+          AddEntry(index, names, dir[i], std::move(long_name));
+        }
+        directory_cluster = NextCluster(directory_cluster);
+      }
+    }
+
+    // ディレクトリの索引を返す. 索引は最初に求められたときに作る
+    // ディレクトリのクラスタはブロックキャッシュから読み込むことがあるので、割り込みを許可して読み、
+    // 作った索引を登録するときだけ割り込みを禁止する. 返した索引は割り込みを禁止して読み書きすること
+    DirectoryIndex& GetDirectoryIndex(unsigned long directory_cluster) {
+      __asm__("cli");
+      if (auto it = directory_indices->find(directory_cluster); it != directory_indices->end()) {
+        __asm__("sti");
+        return it->second;
+      }
+      __asm__("sti");
+
+      DirectoryIndex index;
+      std::unordered_map<const DirectoryEntry*, std::string> names;
+      ReadDirectory(directory_cluster, index, names);
+
+      // 読んでいる間に他のタスクが同じディレクトリの索引を登録していれば、そちらを使う
+      __asm__("cli");
+      auto [ it, inserted ] = directory_indices->try_emplace(directory_cluster, std::move(index));
+      if (inserted) {
+        long_names->merge(names);
+      }
+      __asm__("sti");
+      return it->second;
+    }
+
+    std::pair<DirectoryEntry*, bool> LookupPath(const char* path, unsigned long directory_cluster) {
+      if (path[0] == '/') {
+        directory_cluster = boot_volume_image->root_cluster;
+        ++path;
+      } else if (directory_cluster == 0) {
+        directory_cluster = boot_volume_image->root_cluster;
+      }
+
+      std::string path_elem;
+      const auto [next_path, post_slash] = NextPathElement(path, path_elem);
+      const bool path_last = next_path == nullptr || next_path[0] == '\0';
+
+      const auto& index = GetDirectoryIndex(directory_cluster);
+      __asm__("cli");
+      const auto it = index.by_name.find(FoldName(std::move(path_elem)));
+      DirectoryEntry* entry = it == index.by_name.end() ? nullptr : it->second;
+      __asm__("sti");
+      if (entry == nullptr) {
+        return { nullptr, post_slash };
+      }
+      if (entry->attr == Attribute::kDirectory && !path_last) {
+        // entry が指すのは、パスの次の要素を名前に持つディレクトリ
+        return LookupPath(next_path, entry->FirstCluster());
+      }
+      // entry がディレクトリではないか、パスの末尾に到達したので探索をやめる
+      return { entry, post_slash };
+    }
+
+    // 短名だけでは表せない名前から、ディレクトリ内で重複しない "BASE~N.EXT" 形式の短名を作る
+    std::string MakeShortName(const DirectoryIndex& index, const char* name) {
+      const char* dot_pos = strrchr(name, '.');
+      if (dot_pos == name) {  // ".foo" の '.' は拡張子の区切りとみなさない
+        dot_pos = nullptr;
+      }
+
+      std::string base, ext;
+      for (const char* p = name; *p && p != dot_pos; ++p) {
+        if (*p == '.' || *p == ' ') {
+          continue;
+        }
+        base += IsShortNameChar(*p) ? toupper(*p) : '_';
+      }
+      for (const char* p = dot_pos ? dot_pos + 1 : ""; *p && ext.size() < 3; ++p) {
+        if (*p != ' ') {
+          ext += IsShortNameChar(*p) ? toupper(*p) : '_';
+        }
+      }
+      if (base.empty()) {
+        base = "_";
+      }
+
+      for (int n = 1; ; ++n) {
+        const std::string tail = "~" + std::to_string(n);
+        std::string short_name = base.substr(0, 8 - tail.size()) + tail;
+        if (!ext.empty()) {
+          short_name += "." + ext;
+        }
+        if (index.by_name.count(short_name) == 0) {
+          return short_name;
+        }
+      }
+    }
+
+    // ディレクトリにエントリを作るのは一度に 1 つのタスクだけにする
+    // 空きエントリの確保と書き込みは割り込みを許可して行うので、その間に同じ空きを取り合わないようにする
+    bool creating_entry;
+    std::vector<Task*>* create_waiters;
+
+    void BeginCreateEntry() {
+      __asm__("cli");
+      while (creating_entry) {
+        Task& task = CurrentTaskOnCPU();
+        create_waiters->push_back(&task);
+        task.Sleep();
+        __asm__("cli");
+      }
+      creating_entry = true;
+      __asm__("sti");
+    }
+
+    void EndCreateEntry() {
+      __asm__("cli");
+      creating_entry = false;
+      for (Task* task : *create_waiters) {
+        task_manager->Wakeup(task);
+      }
+      create_waiters->clear();
+      __asm__("sti");
+    }
+
+    // 連続する n 個の空きエントリを探し、足りなければディレクトリを延ばして確保する
+    // 長い名前のエントリの列はクラスタをまたいでもよいので、各エントリを指すポインタの列で返す
+    std::vector<DirectoryEntry*> AllocateEntries(unsigned long dir_cluster, size_t n) {
+      std::vector<DirectoryEntry*> slots;
+      while (true) {
+        auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
+        for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
+          if (dir[i].name[0] == 0 || dir[i].name[0] == 0xe5) {
+            slots.push_back(&dir[i]);
+            if (slots.size() == n) {
+              return slots;
+            }
+          } else {
+            slots.clear();
+          }
+        }
+        auto next = NextCluster(dir_cluster);
+        if (next == kEndOfClusterchain) {
+          break;
+        }
+        dir_cluster = next;
+      }
+
+      // 末尾に空きエントリが続いていれば、それに続けて新しいクラスタを使う
+      while (slots.size() < n) {
+        if (free_clusters == 0) {
+          return {};
+        }
+        dir_cluster = ExtendCluster(dir_cluster, 1);
+        auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
+        if (block_cache) {
+          block_cache->PrepareOverwrite(dir, bytes_per_cluster);
+        }
+        memset(dir, 0, bytes_per_cluster);
+        MarkDirty(dir, bytes_per_cluster);
+        for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry) && slots.size() < n; ++i) {
+          slots.push_back(&dir[i]);
+        }
+      }
+      return slots;
+    }
+  }
+
   void Initialize(void* volume_image) {
     boot_volume_image = reinterpret_cast<fat::BPB*>(volume_image);
     bytes_per_cluster =
       static_cast<unsigned long>(boot_volume_image->bytes_per_sector) * boot_volume_image->sectors_per_cluster;
+    InitializeClusterBitmap();
+    dirty_fat_sectors = new DirtyMap{boot_volume_image->fat_size_32};
+    dirty_clusters = new DirtyMap{num_clusters};
+    reserved_dirty = false;
+    UpdateFSInfo();
+
+    directory_indices = new std::unordered_map<unsigned long, DirectoryIndex>;
+    long_names = new std::unordered_map<const DirectoryEntry*, std::string>;
+    dentry_cache = new std::unordered_map<DentryKey, std::pair<DirectoryEntry*, bool>, DentryKeyHash>;
+    creating_entry = false;
+    create_waiters = new std::vector<Task*>;
+  }
+
+  void MarkDirty(const void* addr, size_t bytes) {
+    const auto& bpb = *boot_volume_image;
+    const uintptr_t bytes_per_sector = bpb.bytes_per_sector;
+    const uintptr_t fat_begin = bpb.reserved_sector_count * bytes_per_sector;
+    const uintptr_t fat_end = fat_begin + bpb.fat_size_32 * bytes_per_sector;
+    const uintptr_t data_begin = fat_begin + bpb.num_fats * bpb.fat_size_32 * bytes_per_sector;
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(boot_volume_image);
+    const uintptr_t end = begin + bytes;
+
+    const bool intr = DisableInterrupt();
+    if (begin < fat_begin) {
+      reserved_dirty = true;
+    }
+    if (begin < fat_end && fat_begin < end) {
+      dirty_fat_sectors->Mark((std::max(begin, fat_begin) - fat_begin) / bytes_per_sector,
+                              (std::min(end, fat_end) - fat_begin + bytes_per_sector - 1) / bytes_per_sector);
+    }
+    if (data_begin < end) {
+      dirty_clusters->Mark(2 + (std::max(begin, data_begin) - data_begin) / bytes_per_cluster,
+                           2 + (end - data_begin + bytes_per_cluster - 1) / bytes_per_cluster);
+    }
+    RestoreInterrupt(intr);
+  }
+
+  WithError<size_t> Flush() {
+    const auto& bpb = *boot_volume_image;
+    const size_t bytes_per_sector = bpb.bytes_per_sector;
+
+    const bool intr = DisableInterrupt();
+    const auto fat_runs = dirty_fat_sectors->TakeRuns();
+    const auto cluster_runs = dirty_clusters->TakeRuns();
+    const bool reserved = std::exchange(reserved_dirty, false);
+    RestoreInterrupt(intr);
+
+    // FAT #0 で書き換えられたセクタを、他の FAT にコピーする
+    auto base = reinterpret_cast<uint8_t*>(boot_volume_image);
+    auto fat_sector = [&](int fat_index, size_t sector) {
+      return base + (bpb.reserved_sector_count + fat_index * bpb.fat_size_32 + sector) * bytes_per_sector;
+    };
+    for (int i = 1; i < bpb.num_fats; ++i) {
+      for (auto [ begin, end ] : fat_runs) {
+        memcpy(fat_sector(i, begin), fat_sector(0, begin), (end - begin) * bytes_per_sector);
+      }
+    }
+
+    // キャッシュがなければ、ボリュームイメージを直接書き換えているので書き戻す先はない
+    if (block_cache == nullptr) {
+      return { 0, MAKE_ERROR(Error::kSuccess) };
+    }
+
+    // 書き戻す範囲をボリューム上の位置の順に並べ、同じページに掛かるか隣り合う範囲をまとめる
+    std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+    auto add_range = [&](const uint8_t* addr, size_t bytes) {
+      const auto begin = reinterpret_cast<uintptr_t>(addr) & ~(BlockCache::kPageSize - 1);
+      const auto end = reinterpret_cast<uintptr_t>(addr) + bytes;
+      if (!ranges.empty() && begin <= ranges.back().second) {
+        ranges.back().second = std::max(ranges.back().second, end);
+      } else {
+        ranges.push_back({begin, end});
+      }
+    };
+    if (reserved) {
+      add_range(base, fat_sector(0, 0) - base);
+    }
+    for (int i = 0; i < bpb.num_fats; ++i) {
+      for (auto [ begin, end ] : fat_runs) {
+        add_range(fat_sector(i, begin), (end - begin) * bytes_per_sector);
+      }
+    }
+    for (auto [ begin, end ] : cluster_runs) {
+      add_range(GetSectorByCluster<uint8_t>(begin), (end - begin) * bytes_per_cluster);
+    }
+
+    size_t written = 0;
+    for (auto [ begin, end ] : ranges) {
+      auto [ n, err ] = block_cache->FlushRange(reinterpret_cast<void*>(begin), end - begin);
+      written += n;
+      if (err) {
+        // 次の Flush ですべてやり直す. 書き戻し済みのページは dirty ビットが落ちているので書き込まれない
+        const bool intr = DisableInterrupt();
+        reserved_dirty |= reserved;
+        for (auto [ begin, end ] : fat_runs) {
+          dirty_fat_sectors->Mark(begin, end);
+        }
+        for (auto [ begin, end ] : cluster_runs) {
+          dirty_clusters->Mark(begin, end);
+        }
+        RestoreInterrupt(intr);
+        return { written, err };
+      }
+    }
+    return { written, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  unsigned long NumFreeClusters() {
+    return free_clusters;
   }
 
   uintptr_t GetClusterAddr(unsigned long cluster) {
@@ -84,49 +761,56 @@ namespace fat {
     } else if (directory_cluster == 0) {
       directory_cluster = boot_volume_image->root_cluster;
     }
-    
-    char path_elem[13];
-    const auto [next_path, post_slash] = NextPathElement(path, path_elem);
-    const bool path_last = next_path == nullptr || next_path[0] == '\0';
-
-    while (directory_cluster != kEndOfClusterchain) {
-      auto dir = GetSectorByCluster<DirectoryEntry>(directory_cluster);
-      for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
-        if (dir[i].name[0] == 0x00) {
-          goto not_found;
-        } else if (!NameIsEqual(dir[i], path_elem)) {
-          continue;
-        }
-        if (dir[i].attr == Attribute::kDirectory && !path_last) {
-          // dir[i]が指すのは、パスの次の要素を名前に持つディレクトリ
-          return FindFile(next_path, dir[i].FirstCluster());
-        } else {
-          // dir[i]がディレクトリではないか、パスの末尾に到達したので探索をやめる
-          return { &dir[i], post_slash };
-        }
+
+    DentryKey key{directory_cluster, path};
+    __asm__("cli");
+    if (auto it = dentry_cache->find(key); it != dentry_cache->end()) {
+      const auto result = it->second;
+      __asm__("sti");
+      return result;
+    }
+    __asm__("sti");
+
+    // 索引を作るためにディレクトリを読むことがあるので、探索は割り込みを許可して行う
+    const auto result = LookupPath(path, directory_cluster);
+    __asm__("cli");
+    if (result.first) {
+      if (dentry_cache->size() >= kMaxDentries) {
+        dentry_cache->clear();
       }
-      directory_cluster = NextCluster(directory_cluster);
+      dentry_cache->emplace(std::move(key), result);
     }
-not_found:
-    return { nullptr, post_slash };
+    __asm__("sti");
+    return result;
   }
 
   bool NameIsEqual(const DirectoryEntry& entry, const char* name) {
-    // name を DirectoryEntry.nameの形式に変換
-    unsigned char name83[11];
-    memset(name83, 0x20, sizeof(name83));
+    char short_name[13];
+    FormatName(entry, short_name);
+    const auto key = FoldName(name);
+    return FoldName(short_name) == key || FoldName(GetName(entry)) == key;
+  }
 
-    int i = 0;
-    int i83 = 0;
-    for(; name[i] != 0 && i83 < sizeof(name83); ++i, ++i83) {
-      if (name[i] == '.') {
-        i83 = 7;
-        continue;
-      }
-      name83[i83] = toupper(name[i]);
+  std::string GetName(const DirectoryEntry& entry) {
+    __asm__("cli");
+    if (auto it = long_names->find(&entry); it != long_names->end()) {
+      std::string name = it->second;
+      __asm__("sti");
+      return name;
     }
+    __asm__("sti");
+
+    char short_name[13];
+    FormatName(entry, short_name);
+    return short_name;
+  }
 
-    return memcmp(entry.name, name83, sizeof(name83)) == 0;
+  std::vector<DirectoryEntry*> ListDirectory(unsigned long directory_cluster) {
+    auto& index = GetDirectoryIndex(directory_cluster);
+    __asm__("cli");
+    auto entries = index.entries;
+    __asm__("sti");
+    return entries;
   }
 
   size_t LoadFile(void* buf, size_t len, DirectoryEntry& entry) {
@@ -146,48 +830,74 @@ not_found:
         reinterpret_cast<uintptr_t>(boot_volume_image) + fat_offset);
   }
 
+  namespace {
+    // FAT #0 の cluster のエントリを書き換える. 他の FAT には Flush でコピーする
+    void SetFAT(unsigned long cluster, uint32_t value) {
+      uint32_t* fat = GetFAT();
+      fat[cluster] = value;
+      MarkDirty(&fat[cluster], sizeof(fat[cluster]));
+    }
+  }
+
   unsigned long ExtendCluster(unsigned long eoc_cluster, size_t n) {
     uint32_t* fat = GetFAT();
     // 指定クラスタが属すクラスタチェーンの末尾クラスタを探す
+    // FAT のページを読み込むのはここで済ませ、割り込み禁止の区間ではたどり直すだけにする
     while (!IsEndOfClusterchain(fat[eoc_cluster])) {
       eoc_cluster = fat[eoc_cluster];
     }
 
-    size_t num_allocated = 0;
-    auto current = eoc_cluster;
+    // 空きクラスタの検索、使用中への変更、チェーンへのつなぎ込みは、他のタスクと同じ並びを取り合わないよう
+    // 割り込み禁止のまま続けて行う
+    const bool intr = DisableInterrupt();
+    while (!IsEndOfClusterchain(fat[eoc_cluster])) {
+      eoc_cluster = fat[eoc_cluster];
+    }
 
-    // 空きクラスタを探してクラスタチェーンの末尾に追加していく
-    for (unsigned long candidate = 2; num_allocated < n; ++candidate) {
-      if (fat[candidate] != 0) {
-        continue;
+    // 末尾クラスタの直後から連続して確保できるだけ確保し、足りなければ別の空きクラスタの並びを追加していく
+    auto current = eoc_cluster;
+    while (n > 0) {
+      const auto [ start, len ] = AllocateRun(current + 1, n);
+      if (len == 0) {
+        break;
       }
-      fat[current] = candidate;
-      current = candidate;
-      ++num_allocated;
+      for (size_t i = 0; i < len; ++i) {
+        SetFAT(current, start + i);
+        current = start + i;
+      }
+      n -= len;
     }
-    fat[current] = kEndOfClusterchain;
+    SetFAT(current, kEndOfClusterchain);
+    RestoreInterrupt(intr);
     return current;
   }
 
-  DirectoryEntry* AllocateEntry(unsigned long dir_cluster) {
-    while(true) {
-      auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
-      for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
-        if (dir[i].name[0] == 0 || dir[i].name[0] == 0xe5) {
-          return &dir[i];
-        }
-      }
-      auto next = NextCluster(dir_cluster);
-      if (next == kEndOfClusterchain) {
-        break;
-      }
-      dir_cluster = next;
+  void TruncateFile(DirectoryEntry& entry) {
+    // 解放するクラスタは先に集めておき、割り込み禁止の区間ではチェーンをたどらない
+    std::vector<unsigned long> clusters;
+    for (auto cluster = entry.FirstCluster();
+         cluster != 0 && cluster != kEndOfClusterchain;
+         cluster = NextCluster(cluster)) {
+      clusters.push_back(cluster);
     }
 
-    dir_cluster = ExtendCluster(dir_cluster, 1);
-    auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
-    memset(dir, 0, bytes_per_cluster);
-    return &dir[0];
+    // 先にエントリからチェーンを切り離す. 開いているディスクリプタのエクステントは、先頭クラスタの変化で作り直される
+    entry.first_cluster_low = 0;
+    entry.first_cluster_high = 0;
+    entry.file_size = 0;
+    MarkDirty(&entry, sizeof(entry));
+    if (clusters.empty()) {
+      return;
+    }
+
+    const bool intr = DisableInterrupt();
+    for (auto cluster : clusters) {
+      SetFAT(cluster, 0);
+      MarkFree(cluster);
+    }
+    free_clusters += clusters.size();
+    UpdateFSInfo();
+    RestoreInterrupt(intr);
   }
 
   void SetFileName(DirectoryEntry& entry, const char* name) {
@@ -230,15 +940,131 @@ not_found:
       }
     }
 
-    auto dir = fat::AllocateEntry(parent_dir_cluster);
-    if (dir == nullptr) {
+    const bool need_long_name = !IsShortName(filename);
+    const std::u16string name16 = need_long_name ? ToUTF16(filename) : std::u16string{};
+    if (name16.size() > kMaxLongNameLength) {
+      return { nullptr, MAKE_ERROR(Error::kInvalidFormat) };
+    }
+    const size_t num_lfn_entries =
+      (name16.size() + kLongNameCharsPerEntry - 1) / kLongNameCharsPerEntry;
+
+    // ディレクトリのクラスタを読み書きする間は割り込みを許可し、索引を引くときと登録するときだけ禁止する
+    BeginCreateEntry();
+    auto& index = GetDirectoryIndex(parent_dir_cluster);
+
+    // 待っている間に他のタスクが同じ名前のエントリを作っていないか確かめる
+    __asm__("cli");
+    if (auto it = index.by_name.find(FoldName(filename)); it != index.by_name.end()) {
+      DirectoryEntry* entry = it->second;
+      __asm__("sti");
+      EndCreateEntry();
+      if (entry->attr == Attribute::kDirectory) {
+        return { nullptr, MAKE_ERROR(Error::kIsDirectory) };
+      }
+      return { entry, MAKE_ERROR(Error::kSuccess) };
+    }
+    const std::string short_name = need_long_name ? MakeShortName(index, filename) : filename;
+    __asm__("sti");
+
+    const auto slots = AllocateEntries(parent_dir_cluster, num_lfn_entries + 1);
+    if (slots.empty()) {
+      EndCreateEntry();
       return { nullptr, MAKE_ERROR(Error::kNoEnoughMemory) };
     }
-    fat::SetFileName(*dir, filename);
-    dir->file_size = 0;
+
+    auto dir = slots.back();
+    memset(dir, 0, sizeof(DirectoryEntry));
+    fat::SetFileName(*dir, short_name.c_str());
+
+    // 長い名前のエントリは、名前の末尾側を先頭に置き、短名のエントリの直前で通し番号 1 になるよう並べる
+    const uint8_t checksum = ShortNameChecksum(dir->name);
+    for (size_t i = 0; i < num_lfn_entries; ++i) {
+      const size_t ord = num_lfn_entries - i;
+      char16_t chars[kLongNameCharsPerEntry];
+      for (int j = 0; j < kLongNameCharsPerEntry; ++j) {
+        const size_t k = (ord - 1) * kLongNameCharsPerEntry + j;
+        chars[j] = k < name16.size() ? name16[k] : k == name16.size() ? 0x0000 : 0xffff;
+      }
+
+      auto& lfn = reinterpret_cast<LongNameEntry&>(*slots[i]);
+      memset(&lfn, 0, sizeof(lfn));
+      lfn.ord = ord | (i == 0 ? kLastLongNameEntry : 0);
+      lfn.attr = Attribute::kLongName;
+      lfn.checksum = checksum;
+      SetLongNameChars(lfn, chars);
+    }
+    for (auto slot : slots) {
+      MarkDirty(slot, sizeof(*slot));
+    }
+
+    __asm__("cli");
+    AddEntry(index, *long_names, *dir, ToUTF8(name16.data(), name16.size()));
+    __asm__("sti");
+    EndCreateEntry();
     return { dir, MAKE_ERROR(Error::kSuccess) };
   }
 
+  /**
+   * ExtentMap
+   */
+  std::pair<unsigned long, size_t> ExtentMap::Find(unsigned long first_cluster, size_t index) {
+    if (first_cluster != first_cluster_) {
+      // 空のファイルに最初の書き込みがあった
+      first_cluster_ = first_cluster;
+      extents_.clear();
+    }
+    if (first_cluster_ == 0 || first_cluster_ == kEndOfClusterchain) {
+      return { kEndOfClusterchain, 0 };
+    }
+
+    if (extents_.empty() || extents_.back().index + extents_.back().length <= index) {
+      Extend(index);
+      if (extents_.back().index + extents_.back().length <= index) {
+        return { kEndOfClusterchain, 0 };
+      }
+    }
+
+    // index を含むエクステントは、先頭が index 以下である最後のもの
+    auto it = std::upper_bound(extents_.begin(), extents_.end(), index,
+        [](size_t i, const Extent& e) { return i < e.index; });
+    --it;
+    const size_t delta = index - it->index;
+    return { it->cluster + delta, it->length - delta };
+  }
+
+  std::pair<size_t, unsigned long> ExtentMap::Tail(unsigned long first_cluster) {
+    Find(first_cluster, std::numeric_limits<size_t>::max());
+    if (first_cluster_ == 0 || first_cluster_ == kEndOfClusterchain || extents_.empty()) {
+      return { 0, 0 };
+    }
+    const auto& last = extents_.back();
+    return { last.index + last.length, last.cluster + last.length - 1 };
+  }
+
+  void ExtentMap::Extend(size_t index) {
+    size_t next_index;
+    unsigned long cluster;
+    if (extents_.empty()) {
+      extents_.push_back({0, first_cluster_, 1});
+      next_index = 1;
+      cluster = NextCluster(first_cluster_);
+    } else {
+      const auto& last = extents_.back();
+      next_index = last.index + last.length;
+      cluster = NextCluster(last.cluster + last.length - 1);
+    }
+
+    for (; next_index <= index && cluster != kEndOfClusterchain; ++next_index) {
+      auto& last = extents_.back();
+      if (cluster == last.cluster + last.length) {
+        ++last.length;
+      } else {
+        extents_.push_back({next_index, cluster, 1});
+      }
+      cluster = NextCluster(cluster);
+    }
+  }
+
   /**
    * FileDescriptor
    */
@@ -246,101 +1072,251 @@ not_found:
       : fat_entry_{fat_entry} {
   }
 
+  void FileDescriptor::Lock() {
+    const bool intr = DisableInterrupt();
+    while (busy_) {
+      Task& task = CurrentTaskOnCPU();
+      waiters_.push_back(&task);
+      task.Sleep();
+      __asm__("cli");
+    }
+    busy_ = true;
+    RestoreInterrupt(intr);
+  }
+
+  bool FileDescriptor::TryLock() {
+    const bool intr = DisableInterrupt();
+    const bool locked = !busy_;
+    busy_ = true;
+    RestoreInterrupt(intr);
+    return locked;
+  }
+
+  void FileDescriptor::Unlock() {
+    const bool intr = DisableInterrupt();
+    busy_ = false;
+    for (Task* task : waiters_) {
+      task_manager->Wakeup(task);
+    }
+    waiters_.clear();
+    RestoreInterrupt(intr);
+  }
+
   size_t FileDescriptor::Read(void* buf, size_t len) {
-    if (rd_cluster_ == 0) {
-      rd_cluster_ = fat_entry_.FirstCluster();
+    Lock();
+    if (off_ >= fat_entry_.file_size) {
+      Unlock();
+      return 0;
     }
-    uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
-    len = std::min(len, fat_entry_.file_size - rd_off_);
+    len = std::min(len, fat_entry_.file_size - off_);
+    ReadAhead(off_ + len);
 
+    size_t total;
+    if (rd_run_begin_ <= off_ && off_ + len <= rd_run_end_) {
+      memcpy(buf, rd_run_addr_ + (off_ - rd_run_begin_), len);
+      total = len;
+    } else {
+      total = CopyRuns(buf, len, off_);
+    }
+
+    off_ += total;
+    Unlock();
+    return total;
+  }
+
+  size_t FileDescriptor::CopyRuns(void* buf, size_t len, size_t offset) {
+    uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
     size_t total = 0;
     while (total < len) {
-      uint8_t* sec = GetSectorByCluster<uint8_t>(rd_cluster_);
-      size_t n = std::min(len - total, bytes_per_cluster - rd_cluster_off_);
-      memcpy(&buf8[total], &sec[rd_cluster_off_], n);
-      total += n;
+      const size_t pos = offset + total;
+      const auto [ cluster, run ] = extents_.Find(fat_entry_.FirstCluster(), pos / bytes_per_cluster);
+      if (cluster == kEndOfClusterchain) {
+        break;
+      }
+
+      // 番号が連続するクラスタはボリューム上でも連続しているので、1 回でコピーできる
+      const size_t cluster_off = pos % bytes_per_cluster;
+      const uint8_t* run_addr = GetSectorByCluster<uint8_t>(cluster);
+      rd_run_begin_ = pos - cluster_off;
+      rd_run_end_ = rd_run_begin_ + run * bytes_per_cluster;
+      rd_run_addr_ = run_addr;
 
-      rd_cluster_off_ += n;
-      if (rd_cluster_off_ == bytes_per_cluster) {
-        rd_cluster_ = NextCluster(rd_cluster_);
-        rd_cluster_off_ = 0;
+      const size_t n = std::min(len - total, run * bytes_per_cluster - cluster_off);
+      if (block_cache) {
+        block_cache->Prefetch(run_addr + cluster_off, n);
       }
+      memcpy(&buf8[total], run_addr + cluster_off, n);
+      total += n;
     }
-
-    rd_off_ += total;
     return total;
   }
 
-  // n個のクラスタからなるクラスタチェーンを作る
-  unsigned long AllocateClusterChain(size_t n) {
-    uint32_t* fat = GetFAT();
-    unsigned long first_cluster;
-    for (first_cluster = 2;; ++first_cluster) {
-      if (fat[first_cluster] == 0) {
-        fat[first_cluster] = kEndOfClusterchain;
+  void FileDescriptor::ReadAhead(size_t end) {
+    // 先読みした範囲の半分を読み進めたら、次の範囲を倍の量だけ先読みする
+    if (block_cache == nullptr || rd_ahead_end_ >= fat_entry_.file_size ||
+        end + rd_ahead_window_ / 2 <= rd_ahead_end_) {
+      return;
+    }
+    rd_ahead_window_ = std::clamp(rd_ahead_window_ * 2, kMinReadAheadBytes, kMaxReadAheadBytes);
+    size_t pos = std::max(rd_ahead_end_, end);
+    rd_ahead_end_ = std::min<size_t>(pos + rd_ahead_window_, fat_entry_.file_size);
+
+    while (pos < rd_ahead_end_) {
+      const auto [ cluster, run ] = extents_.Find(fat_entry_.FirstCluster(), pos / bytes_per_cluster);
+      if (cluster == kEndOfClusterchain) {
         break;
       }
+      const size_t cluster_off = pos % bytes_per_cluster;
+      const size_t n = std::min(rd_ahead_end_ - pos, run * bytes_per_cluster - cluster_off);
+      block_cache->Prefetch(GetSectorByCluster<uint8_t>(cluster) + cluster_off, n);
+      pos += n;
+    }
+  }
+
+  // n個のクラスタからなるクラスタチェーンを作る
+  unsigned long AllocateClusterChain(size_t n) {
+    // 延長するときに直後のクラスタを使えるよう、n 個連続した空きがある場所から始める
+    // 確保した並びをチェーンにつなぎ終えるまでは、割り込みを禁止して他のタスクの確保と重ならないようにする
+    const bool intr = DisableInterrupt();
+    const auto [ first_cluster, len ] = AllocateRun(0, std::max<size_t>(n, 1));
+    if (len == 0) {
+      RestoreInterrupt(intr);
+      return 0;
     }
+    for (size_t i = 0; i + 1 < len; ++i) {
+      SetFAT(first_cluster + i, first_cluster + i + 1);
+    }
+    SetFAT(first_cluster + len - 1, kEndOfClusterchain);
+    RestoreInterrupt(intr);
 
-    if (n > 1) {
-      ExtendCluster(first_cluster, n - 1);
+    if (n > len) {
+      ExtendCluster(first_cluster + len - 1, n - len);
     }
     return first_cluster;
   }
 
+  size_t FileDescriptor::ReserveClusters(size_t num_clusters) {
+    if (fat_entry_.FirstCluster() == 0) {
+      if (num_clusters == 0) {
+        return 0;
+      }
+      const auto first_cluster = AllocateClusterChain(num_clusters);
+      if (first_cluster == 0) {
+        return 0;
+      }
+      fat_entry_.first_cluster_low = first_cluster & 0xffff;
+      fat_entry_.first_cluster_high = (first_cluster >> 16) & 0xffff;
+    }
+
+    // 末尾のクラスタはエクステントから求めるので、延ばすときにチェーンを先頭からたどり直さない
+    auto [ have, last_cluster ] = extents_.Tail(fat_entry_.FirstCluster());
+    if (have < num_clusters) {
+      ExtendCluster(last_cluster, num_clusters - have);
+      have = extents_.Tail(fat_entry_.FirstCluster()).first;
+    }
+    return have;
+  }
+
   size_t FileDescriptor::Write(const void* buf, size_t len) {
-    auto num_cluster = [](size_t bytes) {
-      return (bytes + bytes_per_cluster - 1) / bytes_per_cluster; // ceil(bytes / bytes_per_cluster)
-    };
+    Lock();
+    const size_t total = WriteAt(buf, len, off_);
+    off_ += total;
+    Unlock();
+    return total;
+  }
 
-    if (wr_cluster_ == 0) {
-      if (fat_entry_.FirstCluster() != 0) {
-        wr_cluster_ = fat_entry_.FirstCluster();
-      } else {
-        wr_cluster_ = AllocateClusterChain(num_cluster(len));
-        fat_entry_.first_cluster_low = wr_cluster_ & 0xffff;
-        fat_entry_.first_cluster_high = (wr_cluster_ >> 16) & 0xffff;
-      }
+  size_t FileDescriptor::WriteAt(const void* buf, size_t len, size_t offset) {
+    if (len == 0) {
+      return 0;
     }
 
-    const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
+    // 書き込む範囲の末尾までのクラスタを先にまとめて確保する. 確保できなかった分は書き込まない
+    const size_t num_clusters = (offset + len + bytes_per_cluster - 1) / bytes_per_cluster;
+    const size_t capacity = ReserveClusters(num_clusters) * bytes_per_cluster;
+    if (capacity <= offset) {
+      return 0;
+    }
+    len = std::min(len, capacity - offset);
 
+    const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
     size_t total = 0;
     while (total < len) {
-      if (wr_cluster_off_ == bytes_per_cluster) {
-        const auto next_cluster = NextCluster(wr_cluster_);
-        if (next_cluster == kEndOfClusterchain) {
-          wr_cluster_ = ExtendCluster(wr_cluster_, num_cluster(len - total));
-        } else {
-          wr_cluster_ = next_cluster;
-        }
-        wr_cluster_off_ = 0;
+      const size_t pos = offset + total;
+      const auto [ cluster, run ] = extents_.Find(fat_entry_.FirstCluster(), pos / bytes_per_cluster);
+      if (cluster == kEndOfClusterchain) {
+        break;
       }
 
-      uint8_t* sec = GetSectorByCluster<uint8_t>(wr_cluster_);
-      size_t n = std::min(len, bytes_per_cluster - wr_cluster_off_);
-      memcpy(&sec[wr_cluster_off_], &buf8[total], n);
-
+      // 番号が連続するクラスタには、まとめてコピーできる
+      const size_t cluster_off = pos % bytes_per_cluster;
+      uint8_t* dst = GetSectorByCluster<uint8_t>(cluster) + cluster_off;
+      const size_t n = std::min({len - total, run * bytes_per_cluster - cluster_off, kWriteChunkBytes});
+      if (block_cache) {
+        block_cache->PrepareOverwrite(dst, n);
+      }
+      memcpy(dst, &buf8[total], n);
+      MarkDirty(dst, n);
       total += n;
-      wr_cluster_off_ += n;
     }
-    wr_off_ += total;
-    fat_entry_.file_size = wr_off_;
+
+    // ディレクトリエントリは最後に 1 回だけ更新する
+    fat_entry_.file_size = std::max<size_t>(fat_entry_.file_size, offset + total);
+    MarkDirty(&fat_entry_, sizeof(fat_entry_));
     return total;
   }
 
+  FileType FileDescriptor::Type() const {
+    if (fat_entry_.attr == Attribute::kDirectory) {
+      return FileType::kDirectory;
+    }
+    return FileType::kRegular;
+  }
+
   size_t FileDescriptor::Load(void* buf, size_t len, size_t offset) {
-    FileDescriptor fd{fat_entry_};
-    fd.rd_off_ = offset;
+    Lock();
+    const size_t n = LoadLocked(buf, len, offset);
+    Unlock();
+    return n;
+  }
 
-    unsigned long cluster = fat_entry_.FirstCluster();
-    while (offset >= bytes_per_cluster) {
-      offset -= bytes_per_cluster;
-      cluster = NextCluster(cluster);
+  size_t FileDescriptor::LoadNoWait(void* buf, size_t len, size_t offset) {
+    if (!TryLock()) {
+      // 使用中のディスクリプタのエクステントには触れず、一時的なディスクリプタでクラスタチェーンをたどり直す
+      FileDescriptor fd{fat_entry_};
+      return fd.LoadNoWait(buf, len, offset);
     }
+    const size_t n = LoadLocked(buf, len, offset);
+    Unlock();
+    return n;
+  }
+
+  size_t FileDescriptor::LoadLocked(void* buf, size_t len, size_t offset) {
+    // 読み込み位置を変えないよう、エクステントをたどって直接コピーする
+    if (offset >= fat_entry_.file_size) {
+      return 0;
+    }
+    return CopyRuns(buf, std::min(len, fat_entry_.file_size - offset), offset);
+  }
+
+  size_t FileDescriptor::Store(const void* buf, size_t len, size_t offset) {
+    Lock();
+    const size_t n = WriteAt(buf, len, offset);
+    Unlock();
+    return n;
+  }
+
+  void FileDescriptor::Seek(size_t offset) {
+    // 読み書きする位置のクラスタは、Read() や Write() がエクステントから求める
+    Lock();
+    if (offset != off_) {
+      rd_ahead_end_ = offset;
+      rd_ahead_window_ = 0;
+    }
+    off_ = offset;
+    Unlock();
+  }
 
-    fd.rd_cluster_ = cluster;
-    fd.rd_cluster_off_ = offset;
-    return fd.Read(buf, len);
+  size_t FileDescriptor::Offset() const {
+    return off_;
   }
 } // namespace fat
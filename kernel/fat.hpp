@@ -4,7 +4,11 @@
 #include "error.hpp"
 #include <cstdint>
 #include <cstddef>
+#include <string>
 #include <utility>
+#include <vector>
+
+class Task;
 
 namespace fat {
   // BIOS Parameter Block
@@ -38,6 +42,17 @@ namespace fat {
     char fs_type[8];
   } __attribute__((packed));
 
+  // FSInfo セクタ. 空きクラスタの数と次に割り当てる空きクラスタの目安を保持する
+  struct FSInfo {
+    uint32_t lead_signature;    // 0x41615252
+    uint8_t reserved1[480];
+    uint32_t struct_signature;  // 0x61417272
+    uint32_t free_count;        // 0xffffffff なら不明
+    uint32_t next_free;         // 0xffffffff なら不明
+    uint8_t reserved2[12];
+    uint32_t trail_signature;   // 0xaa550000
+  } __attribute__((packed));
+
   enum class Attribute : uint8_t {
     kReadOnly  = 0x01,
     kHidden    = 0x02,
@@ -68,11 +83,39 @@ namespace fat {
     }
   } __attribute__((packed));
 
+  // 長い名前(LFN)のエントリ. 対応する短名のエントリの直前に、名前の末尾側から順に並ぶ
+  // 1 エントリに UTF-16 で 13 文字を持ち、名前の終わりは 0x0000、その後の余りは 0xffff で埋める
+  struct LongNameEntry {
+    uint8_t ord;             // 1 から始まる通し番号. 最後(= 先頭に置かれる)のエントリは kLastLongNameEntry を立てる
+    uint16_t name1[5];
+    Attribute attr;          // 常に kLongName
+    uint8_t type;
+    uint8_t checksum;        // 短名のチェックサム
+    uint16_t name2[6];
+    uint16_t first_cluster_low;
+    uint16_t name3[2];
+  } __attribute__((packed));
+
+  const uint8_t kLastLongNameEntry = 0x40;
+  const int kLongNameCharsPerEntry = 13;
+  // 長い名前の最大文字数 (UTF-16 の符号単位)
+  const int kMaxLongNameLength = 255;
+
   extern BPB* boot_volume_image;
   extern unsigned long bytes_per_cluster;
 
   void Initialize(void* volume_image);
 
+  // 空きクラスタの数
+  unsigned long NumFreeClusters();
+
+  // ボリュームイメージ上の [addr, addr + bytes) を書き換えたことを記録する
+  // FAT はセクタ単位で、データ領域はクラスタ単位で記録し、Flush で書き戻す
+  void MarkDirty(const void* addr, size_t bytes);
+  // 記録した変更をデバイスに書き戻し、書き戻したページ数を返す
+  // FAT #0 の書き換えられたセクタは、書き戻す前に他の FAT にもコピーする
+  WithError<size_t> Flush();
+
   // 指定されたクラスタの先頭セクタのメモリアドレス
   uintptr_t GetClusterAddr(unsigned long cluster);
 
@@ -97,33 +140,103 @@ namespace fat {
   // クラスタ番号で指定されたディレクトリ内の特定の名前のファイルを指すディレクトリエントリ
   std::pair<DirectoryEntry*, bool> FindFile(const char* name, unsigned long directory_cluster = 0);
 
-  // ファイル名が一致するか
+  // ファイル名が一致するか. 長い名前と短名のどちらとも、ASCII の大文字小文字を区別せずに比べる
   bool NameIsEqual(const DirectoryEntry& entry, const char* name);
 
+  // エントリの名前 (UTF-8). 長い名前があればそれを、なければ短名を整形したものを返す
+  // 長い名前は、エントリを含むディレクトリを FindFile や ListDirectory で調べたときに読み込まれる
+  std::string GetName(const DirectoryEntry& entry);
+
+  // ディレクトリ内のエントリを並び順に返す. 削除済みのエントリと長い名前のエントリは除く
+  std::vector<DirectoryEntry*> ListDirectory(unsigned long directory_cluster);
+
   // buf に entry が指すファイルの内容を読み込む
   size_t LoadFile(void* buf, size_t len, DirectoryEntry& entry);
 
-  // 空のファイルを作成
+  // 空のファイルを作成. 名前が 8.3 形式で表せなければ、長い名前のエントリと短名を作る
   WithError<DirectoryEntry*> CreateFile(const char* path);
 
+  // ファイルを空にする. クラスタチェーンはすべて解放し、先頭クラスタを 0 に戻す
+  void TruncateFile(DirectoryEntry& entry);
+
+  // クラスタチェーンを、番号が連続するクラスタの並び(エクステント)の列として保持する
+  // ファイル中の任意の位置のクラスタを、チェーンを先頭からたどらずに二分探索で求める
+  // クラスタチェーンは延びることはあっても途中が変わることはないので、
+  // 作成済みの部分はそのまま使い、未到達の位置が求められたときに末尾から延ばす
+  // 切り詰めでチェーンが解放されると先頭クラスタが変わるので、そのときは作り直す
+  class ExtentMap {
+    public:
+      // first_cluster から始まるチェーンの index 番目(0 始まり)のクラスタ番号と、
+      // そこから番号が連続するクラスタの数を返す. チェーンがそこまで続いていなければ {kEndOfClusterchain, 0}
+      std::pair<unsigned long, size_t> Find(unsigned long first_cluster, size_t index);
+      // チェーンを末尾までたどり、クラスタの数と末尾のクラスタ番号を返す. チェーンが空なら {0, 0}
+      std::pair<size_t, unsigned long> Tail(unsigned long first_cluster);
+      size_t NumExtents() const { return extents_.size(); }
+
+    private:
+      struct Extent {
+        size_t index;           // ファイル先頭から数えたクラスタの番号
+        unsigned long cluster;  // 先頭のクラスタ番号
+        size_t length;          // 連続するクラスタの数
+      };
+
+      unsigned long first_cluster_ = 0;
+      std::vector<Extent> extents_{};
+
+      // チェーンを index 番目のクラスタまで(または末尾まで)調べて extents_ に加える
+      void Extend(size_t index);
+  };
+
   class FileDescriptor : public ::FileDescriptor {
     public:
       explicit FileDescriptor(DirectoryEntry& fat_entry);
       size_t Read(void* buf, size_t len) override;
       size_t Write(const void* buf, size_t len) override;
       size_t Size() const override { return fat_entry_.file_size; }
+      FileType Type() const override;
       size_t Load(void* buf, size_t len, size_t offset) override;
+      size_t Store(const void* buf, size_t len, size_t offset) override;
+      void Seek(size_t offset) override;
+      size_t Offset() const override;
+      const DirectoryEntry& Entry() const { return fat_entry_; }
+      // ページフォルトの処理中など眠れないときの Load. 使用中でも待たずに読み込む
+      size_t LoadNoWait(void* buf, size_t len, size_t offset);
 
     private:
       DirectoryEntry& fat_entry_;
-      
-      size_t rd_off_ = 0;             // ファイル先頭からの読み込み位置のオフセット
-      unsigned long rd_cluster_ = 0;  // rd_off_が指す位置のクラスタ番号
-      size_t rd_cluster_off_ = 0;     // クラスタ先頭からのオフセット
-
-      size_t wr_off_ = 0;             // 以下、書き込み位置のオフセット
-      unsigned long wr_cluster_ = 0;
-      size_t wr_cluster_off_ = 0;
+      ExtentMap extents_{};
+
+      // io ring のワーカーとアプリのシステムコールが同じディスクリプタを同時に使うことがあるので、
+      // Read, Write, Load, Store, Seek は 1 つずつ行う. 使用中なら空くまで眠って待つ
+      bool busy_ = false;
+      std::vector<Task*> waiters_{};
+      void Lock();
+      bool TryLock();
+      void Unlock();
+
+      size_t LoadLocked(void* buf, size_t len, size_t offset);
+      // ファイルの offset の位置に書き込む. 読み書き位置は変えない
+      size_t WriteAt(const void* buf, size_t len, size_t offset);
+
+      // クラスタチェーンを num_clusters 個まで延ばし、延ばした後のクラスタの数を返す
+      // 足りない分は 1 回でまとめて確保するので、空きが足りなければ要求より少なくなる
+      size_t ReserveClusters(size_t num_clusters);
+      // ファイルの offset から len バイトを、番号が連続するクラスタの並びごとにまとめて buf にコピーする
+      size_t CopyRuns(void* buf, size_t len, size_t offset);
+      // 順に読み込まれているとき、これから読まれる範囲をブロックキャッシュに読み込んでおく
+      void ReadAhead(size_t end);
+
+      // ファイル先頭からの読み書き位置のオフセット. Read, Write, Seek のどれもがこの位置を使って進める
+      size_t off_ = 0;
+
+      // 直前にコピーしたクラスタの並びの範囲(ファイル先頭からのオフセット)と、その先頭のメモリアドレス
+      // 1 バイトずつの読み込みなど、この範囲に収まる読み込みはエクステントを引かずにコピーする
+      size_t rd_run_begin_ = 0, rd_run_end_ = 0;
+      const uint8_t* rd_run_addr_ = nullptr;
+
+      // 先読みを済ませた範囲の末尾と、次に先読みする量. Seek で読み込み位置が変わると 0 からやり直す
+      size_t rd_ahead_end_ = 0;
+      size_t rd_ahead_window_ = 0;
   }; 
 } // namespace fat
 
@@ -2,15 +2,31 @@
 
 #include <cstddef>
 
+// ファイルディスクリプタが指すものの種類
+enum class FileType {
+  kRegular,
+  kDirectory,
+  kTerminal,
+  kPipe,
+};
+
 class FileDescriptor {
   public:
     virtual ~FileDescriptor() = default;
     virtual size_t Read(void *buf, size_t len) = 0;
     virtual size_t Write(const void *buf, size_t len) = 0;
     virtual size_t Size() const = 0;
+    virtual FileType Type() const = 0;
 
     // 内部で管理している読み書きオフセットを変更することなく、バッファにファイルの offset 以降のデータを読み込む
     virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+    // 内部で管理している読み書きオフセットを変更することなく、バッファの内容をファイルの offset の位置に書き込む
+    virtual size_t Store(const void* buf, size_t len, size_t offset) = 0;
+
+    // 読み書きオフセットをファイル先頭から offset バイトの位置に移動する(offset はファイルサイズ以下であること)
+    virtual void Seek(size_t offset) = 0;
+    // 現在の読み書きオフセット
+    virtual size_t Offset() const = 0;
 };
 
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...);
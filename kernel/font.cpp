@@ -6,8 +6,11 @@
 
 #include "font.hpp"
 
+#include <list>
+#include <unordered_map>
 #include <vector>
 #include "fat.hpp"
+#include "interrupt.hpp"
 
 extern const uint8_t _binary_hankaku_bin_start;
 extern const uint8_t _binary_hankaku_bin_end;
@@ -24,17 +27,32 @@ const uint8_t* GetFont(char c) {
   return &_binary_hankaku_bin_start + index;
 }
 
+namespace {
+  // 1 行分のビットマップ(MSB が左端)のうち、ビットが連続して立っている部分ごとにまとめて描く
+  void WriteBitmapRow(PixelWriter& writer, Vector2D<int> pos,
+                      const uint8_t* row, int width, const PixelColor& color) {
+    int dx = 0;
+    while (dx < width) {
+      if ((row[dx >> 3] & (0x80u >> (dx & 0x7))) == 0) {
+        ++dx;
+        continue;
+      }
+      const int start = dx;
+      while (dx < width && (row[dx >> 3] & (0x80u >> (dx & 0x7)))) {
+        ++dx;
+      }
+      writer.FillSpan(pos + Vector2D<int>{start, 0}, dx - start, color);
+    }
+  }
+}
+
 void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor& color) {
   const uint8_t* font = GetFont(c);
   if (font == nullptr) {
     return;
   }
   for (int dy = 0; dy < 16; ++dy) {
-    for (int dx = 0; dx < 8; ++dx) {
-      if ((font[dy] << dx) & 0x80u) {
-        writer.Write(pos + Vector2D<int>{dx, dy}, color);
-      }
-    }
+    WriteBitmapRow(writer, pos + Vector2D<int>{0, dy}, &font[dy], 8, color);
   }
 }
 
@@ -120,12 +138,7 @@ Error WriteUnicode(PixelWriter& writer, Vector2D<int> pos, char32_t c, const Pix
     if (bitmap.pitch < 0) {
       q -= bitmap.pitch * bitmap.rows;
     }
-    for (int dx = 0; dx < bitmap.width; ++dx) {
-      const bool b = q[dx >> 3] & (0x80 >> (dx & 0x7));
-      if (b) {
-        writer.Write(glyph_topleft + Vector2D<int>{dx, dy}, color);
-      }
-    }
+    WriteBitmapRow(writer, glyph_topleft + Vector2D<int>{0, dy}, q, bitmap.width, color);
   }
 
   FT_Done_Face(face);
@@ -142,6 +155,190 @@ void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const Pi
   }
 }
 
+namespace {
+  // 32 ビットのピクセル値の配列に描く PixelWriter. グリフの展開に使う
+  class PixelBlockWriter : public PixelWriter {
+    public:
+      PixelBlockWriter(uint32_t* pixels, int width, int height, PixelFormat format)
+        : pixels_{pixels}, width_{width}, height_{height}, format_{format} {}
+
+      virtual void Write(Vector2D<int> pos, const PixelColor& c) override {
+        if (0 <= pos.x && pos.x < width_ && 0 <= pos.y && pos.y < height_) {
+          pixels_[width_ * pos.y + pos.x] = EncodePixel(format_, c);
+        }
+      }
+      virtual int Width() const override { return width_; }
+      virtual int Height() const override { return height_; }
+
+    private:
+      uint32_t* pixels_;
+      int width_, height_;
+      PixelFormat format_;
+  };
+
+  struct GlyphKey {
+    char32_t c;
+    uint32_t fg, bg;
+
+    bool operator==(const GlyphKey& rhs) const {
+      return c == rhs.c && fg == rhs.fg && bg == rhs.bg;
+    }
+  };
+
+  struct GlyphKeyHash {
+    size_t operator()(const GlyphKey& key) const {
+      return (uint64_t{key.c} * 0x9e3779b97f4a7c15ull) ^ (uint64_t{key.fg} << 24 | key.bg);
+    }
+  };
+
+  uint32_t ToRGB(const PixelColor& c) {
+    return (c.r << 16) | (c.g << 8) | c.b;
+  }
+
+  // 文字 1 つ分の展開済みのピクセル値. 幅は半角 8, 全角 16 で、高さは 16
+  struct Glyph {
+    GlyphKey key;
+    int width;
+    uint32_t pixels[16 * 16];
+  };
+
+  // (文字, 前景色, 背景色) ごとに展開済みのグリフを保持する LRU キャッシュ
+  // メンバの操作は割り込み禁止状態で行う
+  class GlyphCache {
+    public:
+      static const size_t kCapacity = 256;
+
+      GlyphCache(PixelFormat format) : format_{format} {}
+
+      PixelFormat Format() const { return format_; }
+
+      // 見つかれば最近使ったものとして先頭に移して返す
+      const Glyph* Find(const GlyphKey& key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+          ++stat_.misses;
+          return nullptr;
+        }
+        ++stat_.hits;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return &*it->second;
+      }
+
+      // 要素 1 つのリスト node のグリフを先頭に移す. 割り込み禁止中にメモリを確保しなくて済むよう、
+      // 要素は呼び出し側で確保しておく. 容量を超えたら最も長く使われていないものを捨てる
+      const Glyph* Insert(std::list<Glyph>& node) {
+        const GlyphKey key = node.front().key;
+        if (auto it = index_.find(key); it != index_.end()) {
+          // 展開している間に他のタスクが追加していた
+          return &*it->second;
+        }
+        lru_.splice(lru_.begin(), node);
+        index_[key] = lru_.begin();
+        if (lru_.size() > kCapacity) {
+          index_.erase(lru_.back().key);
+          lru_.pop_back();
+          ++stat_.evictions;
+        }
+        return &lru_.front();
+      }
+
+      GlyphCacheStat Stat() const {
+        auto stat = stat_;
+        stat.entries = lru_.size();
+        stat.capacity = kCapacity;
+        return stat;
+      }
+      void ResetStat() { stat_ = {}; }
+
+    private:
+      PixelFormat format_;
+      std::list<Glyph> lru_{};  // 先頭ほど最近使ったもの
+      std::unordered_map<GlyphKey, std::list<Glyph>::iterator, GlyphKeyHash> index_{};
+      GlyphCacheStat stat_{};
+  };
+
+  GlyphCache* glyph_cache;
+
+  void DrawGlyph(PixelWriter& writer, Vector2D<int> pos, const Glyph& glyph, PixelFormat format) {
+    for (int dy = 0; dy < 16; ++dy) {
+      writer.WritePixels(pos + Vector2D<int>{0, dy}, &glyph.pixels[glyph.width * dy], glyph.width, format);
+    }
+  }
+}
+
+void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c,
+                const PixelColor& fg, const PixelColor& bg) {
+  if (GetFont(c) == nullptr) {
+    FillRectangle(writer, pos, {8, 16}, bg);
+    return;
+  }
+  WriteUnicode(writer, pos, static_cast<char32_t>(c), fg, bg);
+}
+
+void WriteUnicode(PixelWriter& writer, Vector2D<int> pos, char32_t c,
+                  const PixelColor& fg, const PixelColor& bg) {
+  const int width = IsHankaku(c) ? 8 : 16;
+  if (glyph_cache == nullptr) {
+    // InitializeFont より前は毎回展開する
+    FillRectangle(writer, pos, {width, 16}, bg);
+    WriteUnicode(writer, pos, c, fg);
+    return;
+  }
+
+  const GlyphKey key{c, ToRGB(fg), ToRGB(bg)};
+  const auto format = glyph_cache->Format();
+  bool intr = DisableInterrupt();
+  if (auto glyph = glyph_cache->Find(key)) {
+    DrawGlyph(writer, pos, *glyph, format);
+    RestoreInterrupt(intr);
+    return;
+  }
+  RestoreInterrupt(intr);
+
+  // FreeType による展開は時間がかかるので、割り込みを許可したまま行う
+  std::list<Glyph> node(1);
+  Glyph& glyph = node.front();
+  glyph.key = key;
+  glyph.width = width;
+  PixelBlockWriter block_writer{glyph.pixels, width, 16, format};
+  FillRectangle(block_writer, {0, 0}, {width, 16}, bg);
+  WriteUnicode(block_writer, {0, 0}, c, fg);
+
+  intr = DisableInterrupt();
+  DrawGlyph(writer, pos, *glyph_cache->Insert(node), format);
+  RestoreInterrupt(intr);
+}
+
+void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s,
+                 const PixelColor& fg, const PixelColor& bg) {
+  int x = 0;
+  while (*s) {
+    const auto [ u32, bytes ] = ConvertUTF8To32(s);
+    WriteUnicode(writer, pos + Vector2D<int>{8*x, 0}, u32, fg, bg);
+    s += bytes;
+    x += IsHankaku(u32) ? 1 : 2;
+  }
+}
+
+GlyphCacheStat GetGlyphCacheStat() {
+  if (glyph_cache == nullptr) {
+    return {};
+  }
+  const bool intr = DisableInterrupt();
+  const auto stat = glyph_cache->Stat();
+  RestoreInterrupt(intr);
+  return stat;
+}
+
+void ResetGlyphCacheStat() {
+  if (glyph_cache == nullptr) {
+    return;
+  }
+  const bool intr = DisableInterrupt();
+  glyph_cache->ResetStat();
+  RestoreInterrupt(intr);
+}
+
 bool IsHankaku(char32_t c) {
   return c <= 0x7f;
 }
@@ -165,6 +362,9 @@ void InitializeFont() {
     delete nihongo_buf;
     exit(1);
   }
+
+  // ウィンドウのシャドウバッファは画面と同じピクセル形式なので、その形式で展開しておく
+  glyph_cache = new GlyphCache{screen_config.pixel_format};
 }
 
 WithError<FT_Face> NewFTFace() {
@@ -13,6 +13,24 @@ void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor
 Error WriteUnicode(PixelWriter& writer, Vector2D<int> pos, char32_t c, const PixelColor& color);
 void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const PixelColor& color);
 
+// 文字の範囲を背景色 bg で塗ったうえで前景色 fg で文字を描く
+// 展開したグリフはグリフキャッシュに保持し、2 回目以降は行ごとのコピーで描く
+void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c,
+                const PixelColor& fg, const PixelColor& bg);
+void WriteUnicode(PixelWriter& writer, Vector2D<int> pos, char32_t c,
+                  const PixelColor& fg, const PixelColor& bg);
+void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s,
+                 const PixelColor& fg, const PixelColor& bg);
+
+// グリフキャッシュの統計
+struct GlyphCacheStat {
+  uint64_t hits, misses, evictions;
+  size_t entries, capacity;
+};
+
+GlyphCacheStat GetGlyphCacheStat();
+void ResetGlyphCacheStat();
+
 int CountUTF8Size(uint8_t c);
 std::pair<char32_t, int> ConvertUTF8To32(const char* u8);
 bool IsHankaku(char32_t c);
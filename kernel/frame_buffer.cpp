@@ -1,6 +1,9 @@
 #include "frame_buffer.hpp"
 #include "error.hpp"
 
+#include <cpuid.h>
+#include <emmintrin.h>
+
 namespace {
   int BytesPerPixel(PixelFormat format) {
     switch (format) {
@@ -22,6 +25,57 @@ namespace {
   Vector2D<int> FrameBufferSize(const FrameBufferConfig& config) {
     return {static_cast<int>(config.horizontal_resolution), static_cast<int>(config.vertical_resolution)};
   }
+
+  // 予約バイトを除いた色の部分
+  const uint32_t kColorMask = 0x00ffffff;
+
+  // 透過色付きで 1 行分のピクセルをコピーする関数の型
+  using TransparentRowFunc = void (uint32_t* dst, const uint32_t* src, int n, uint32_t key);
+
+  void CopyTransparentRowScalar(uint32_t* dst, const uint32_t* src, int n, uint32_t key) {
+    for (int i = 0; i < n; ++i) {
+      if ((src[i] & kColorMask) != key) {
+        dst[i] = src[i];
+      }
+    }
+  }
+
+  // 4 ピクセルずつ透過色と比較し、透過色でないピクセルだけを書き込む
+  __attribute__((target("sse2")))
+  void CopyTransparentRowSSE2(uint32_t* dst, const uint32_t* src, int n, uint32_t key) {
+    const __m128i key4 = _mm_set1_epi32(key);
+    const __m128i color_mask4 = _mm_set1_epi32(kColorMask);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+      const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+      const __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(s, color_mask4), key4);
+      const int bits = _mm_movemask_epi8(transparent);
+      if (bits == 0xffff) {
+        continue;  // すべて透過色
+      }
+      auto d = reinterpret_cast<__m128i*>(dst + i);
+      if (bits == 0) {
+        _mm_storeu_si128(d, s);  // すべて不透明
+        continue;
+      }
+      const __m128i old = _mm_loadu_si128(d);
+      _mm_storeu_si128(d, _mm_or_si128(_mm_and_si128(transparent, old),
+                                       _mm_andnot_si128(transparent, s)));
+    }
+    CopyTransparentRowScalar(dst + i, src + i, n - i, key);
+  }
+
+  // CPU が対応している最速の実装を選ぶ
+  // AVX2 は OS が YMM レジスタを保存しない(タスク切り替えは fxsave)ので使わない
+  TransparentRowFunc* SelectCopyTransparentRow() {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2)) {
+      return CopyTransparentRowSSE2;
+    }
+    return CopyTransparentRowScalar;
+  }
+
+  TransparentRowFunc* copy_transparent_row = nullptr;
 }
 
 // フレームバッファの初期化
@@ -89,6 +143,41 @@ Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rec
   return MAKE_ERROR(Error::kSuccess);
 }
 
+Error FrameBuffer::CopyTransparent(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+                                   const PixelColor& key) {
+  if (config_.pixel_format != src.config_.pixel_format) {
+    return MAKE_ERROR(Error::kUnknownPixelFormat);
+  }
+  if (BytesPerPixel(config_.pixel_format) != 4) {
+    return MAKE_ERROR(Error::kUnknownPixelFormat);
+  }
+  if (!copy_transparent_row) {
+    copy_transparent_row = SelectCopyTransparentRow();
+  }
+
+  // はみ出る部分を落とす範囲の計算は Copy と同じ
+  const Rectangle<int> src_area_shifted{dst_pos, src_area.size};
+  const Rectangle<int> src_outline{dst_pos - src_area.pos, FrameBufferSize(src.config_)};
+  const Rectangle<int> dst_outline{{0, 0}, FrameBufferSize(config_)};
+
+  const auto copy_area = dst_outline & src_outline & src_area_shifted;
+  const auto src_start_pos = copy_area.pos - (dst_pos - src_area.pos);
+
+  uint8_t* dst_buf = FrameAddrAt(copy_area.pos, config_);
+  const uint8_t* src_buf = FrameAddrAt(src_start_pos, src.config_);
+  const uint32_t key_value = EncodePixel(config_.pixel_format, key);
+
+  for (int dy = 0; dy < copy_area.size.y; ++dy) {
+    copy_transparent_row(reinterpret_cast<uint32_t*>(dst_buf),
+                         reinterpret_cast<const uint32_t*>(src_buf),
+                         copy_area.size.x, key_value);
+    dst_buf += BytesPerScanLine(config_);
+    src_buf += BytesPerScanLine(src.config_);
+  }
+
+  return MAKE_ERROR(Error::kSuccess);
+}
+
 void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
   const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
   const auto bytes_per_scan_line = BytesPerScanLine(config_);
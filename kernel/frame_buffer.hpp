@@ -11,6 +11,9 @@ class FrameBuffer {
   public:
     Error Initialize(const FrameBufferConfig& config);
     Error Copy(Vector2D<int> pos, const FrameBuffer& src, const Rectangle<int>& src_area);
+    // Copy と同様だが、src のうち透過色 key のピクセルはコピーしない
+    Error CopyTransparent(Vector2D<int> pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+                          const PixelColor& key);
     void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
 
     FrameBufferWriter& Writer() { return *writer_; }
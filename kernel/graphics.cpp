@@ -1,5 +1,9 @@
 #include "graphics.hpp"
 
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
 void RGBResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& c) {
   auto p = PixelAt(pos);
   p[0] = c.r;
@@ -14,25 +18,226 @@ void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor&
   p[2] = c.r;
 }
 
+namespace {
+  // [pos.x, pos.x + n) のうちバッファの範囲に入る部分に切り詰める. 残らなければ false
+  bool ClipSpan(Vector2D<int>& pos, int& n, int* skip, int width, int height) {
+    if (pos.y < 0 || height <= pos.y) {
+      return false;
+    }
+    const int x0 = std::max(pos.x, 0);
+    const int x1 = std::min(pos.x + n, width);
+    if (x1 <= x0) {
+      return false;
+    }
+    if (skip) {
+      *skip = x0 - pos.x;
+    }
+    pos.x = x0;
+    n = x1 - x0;
+    return true;
+  }
+}
+
+void FrameBufferWriter::FillSpan(Vector2D<int> pos, int n, const PixelColor& c) {
+  if (!ClipSpan(pos, n, nullptr, Width(), Height())) {
+    return;
+  }
+  // 同じ値を連続して書くだけのループなので、コンパイラが SIMD のストアにまとめる
+  const uint32_t v = EncodePixel(config_.pixel_format, c);
+  std::fill_n(reinterpret_cast<uint32_t*>(PixelAt(pos)), n, v);
+}
+
+void FrameBufferWriter::WriteSpan(Vector2D<int> pos, const PixelColor* colors, int n) {
+  int skip;
+  if (!ClipSpan(pos, n, &skip, Width(), Height())) {
+    return;
+  }
+  auto p = reinterpret_cast<uint32_t*>(PixelAt(pos));
+  for (int i = 0; i < n; ++i) {
+    p[i] = EncodePixel(config_.pixel_format, colors[skip + i]);
+  }
+}
+
+void FrameBufferWriter::WritePixels(Vector2D<int> pos, const uint32_t* pixels, int n, PixelFormat format) {
+  int skip;
+  if (!ClipSpan(pos, n, &skip, Width(), Height())) {
+    return;
+  }
+  auto p = reinterpret_cast<uint32_t*>(PixelAt(pos));
+  if (format == config_.pixel_format) {
+    memcpy(p, pixels + skip, 4 * n);
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    p[i] = EncodePixel(config_.pixel_format, DecodePixel(format, pixels[skip + i]));
+  }
+}
+
 void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& c) {
+  // 行ごとに 1 回だけ仮想呼び出しを行い、範囲の切り詰めもその中で 1 回だけ行う
   for (int dy = 0; dy < size.y; ++dy) {
-    for (int dx = 0; dx < size.x; ++dx) {
-      writer.Write(pos + Vector2D<int>{dx, dy}, c);
-    }
+    writer.FillSpan(pos + Vector2D<int>{0, dy}, size.x, c);
   }
 }
 
 void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& c) {
-  for (int dx = 0; dx < size.x; ++dx) {
-    writer.Write(pos + Vector2D<int>{dx, 0}, c);
-    writer.Write(pos + Vector2D<int>{dx, size.y - 1}, c);
+  if (size.x <= 0 || size.y <= 0) {
+    return;
   }
+  writer.FillSpan(pos, size.x, c);
+  writer.FillSpan(pos + Vector2D<int>{0, size.y - 1}, size.x, c);
   for (int dy = 1; dy < size.y - 1; ++dy) {
     writer.Write(pos + Vector2D<int>{0, dy}, c);
     writer.Write(pos + Vector2D<int>{size.x - 1, dy}, c);
   }
 } 
 
+namespace {
+  // Cohen-Sutherland 法の領域コード
+  enum OutCode {
+    kInside = 0,
+    kLeft   = 1,
+    kRight  = 2,
+    kTop    = 4,
+    kBottom = 8,
+  };
+
+  int ComputeOutCode(Vector2D<int> p, int xmax, int ymax) {
+    int code = kInside;
+    if (p.x < 0) {
+      code |= kLeft;
+    } else if (p.x > xmax) {
+      code |= kRight;
+    }
+    if (p.y < 0) {
+      code |= kTop;
+    } else if (p.y > ymax) {
+      code |= kBottom;
+    }
+    return code;
+  }
+
+  // 直線 p0-p1 を [0, xmax] x [0, ymax] に切り詰める. 範囲と重ならなければ false
+  bool ClipLine(Vector2D<int>& p0, Vector2D<int>& p1, int xmax, int ymax) {
+    int code0 = ComputeOutCode(p0, xmax, ymax);
+    int code1 = ComputeOutCode(p1, xmax, ymax);
+    while (true) {
+      if ((code0 | code1) == 0) {
+        return true;
+      }
+      if (code0 & code1) {
+        return false;
+      }
+
+      // 範囲外にある方の端点を、範囲の境界との交点に移す
+      const int code = code0 ? code0 : code1;
+      const int64_t dx = p1.x - p0.x, dy = p1.y - p0.y;
+      Vector2D<int> p;
+      if (code & kTop) {
+        p = {static_cast<int>(p0.x + dx * (0 - p0.y) / dy), 0};
+      } else if (code & kBottom) {
+        p = {static_cast<int>(p0.x + dx * (ymax - p0.y) / dy), ymax};
+      } else if (code & kLeft) {
+        p = {0, static_cast<int>(p0.y + dy * (0 - p0.x) / dx)};
+      } else {
+        p = {xmax, static_cast<int>(p0.y + dy * (xmax - p0.x) / dx)};
+      }
+
+      if (code == code0) {
+        p0 = p;
+        code0 = ComputeOutCode(p0, xmax, ymax);
+      } else {
+        p1 = p;
+        code1 = ComputeOutCode(p1, xmax, ymax);
+      }
+    }
+  }
+}
+
+void DrawLine(PixelWriter& writer, Vector2D<int> p0, Vector2D<int> p1, const PixelColor& c) {
+  if (!ClipLine(p0, p1, writer.Width() - 1, writer.Height() - 1)) {
+    return;
+  }
+
+  // 水平線・垂直線は行単位の塗りつぶしで済ませる
+  if (p0.y == p1.y) {
+    writer.FillSpan({std::min(p0.x, p1.x), p0.y}, std::abs(p1.x - p0.x) + 1, c);
+    return;
+  }
+  if (p0.x == p1.x) {
+    FillRectangle(writer, {p0.x, std::min(p0.y, p1.y)}, {1, std::abs(p1.y - p0.y) + 1}, c);
+    return;
+  }
+
+  // Bresenham のアルゴリズム
+  const int dx = std::abs(p1.x - p0.x), sx = p0.x < p1.x ? 1 : -1;
+  const int dy = -std::abs(p1.y - p0.y), sy = p0.y < p1.y ? 1 : -1;
+  int err = dx + dy;
+  while (true) {
+    writer.Write(p0, c);
+    if (p0.x == p1.x && p0.y == p1.y) {
+      break;
+    }
+    const int e2 = 2 * err;
+    if (e2 >= dy) {
+      err += dy;
+      p0.x += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      p0.y += sy;
+    }
+  }
+}
+
+void DrawPolyline(PixelWriter& writer, const Vector2D<int>* points, int n, const PixelColor& c) {
+  if (n == 1) {
+    DrawLine(writer, points[0], points[0], c);
+  }
+  for (int i = 0; i + 1 < n; ++i) {
+    DrawLine(writer, points[i], points[i + 1], c);
+  }
+}
+
+void FillPolygon(PixelWriter& writer, const Vector2D<int>* points, int n, const PixelColor& c) {
+  if (n < 3) {
+    return;
+  }
+
+  int ymin = points[0].y, ymax = points[0].y;
+  for (int i = 1; i < n; ++i) {
+    ymin = std::min(ymin, points[i].y);
+    ymax = std::max(ymax, points[i].y);
+  }
+  ymin = std::max(ymin, 0);
+  ymax = std::min(ymax, writer.Height());
+
+  // 各行について、辺と交わる X 座標を求めて左から 2 つずつ組にして塗る
+  // 辺は上端を含み下端を含まないものとし、頂点で交点が重複しないようにする
+  std::vector<int> xs;
+  xs.reserve(n);
+  for (int y = ymin; y < ymax; ++y) {
+    xs.clear();
+    for (int i = 0; i < n; ++i) {
+      auto a = points[i], b = points[(i + 1) % n];
+      if (a.y == b.y) {
+        continue;
+      }
+      if (a.y > b.y) {
+        std::swap(a, b);
+      }
+      if (y < a.y || b.y <= y) {
+        continue;
+      }
+      xs.push_back(a.x + static_cast<int64_t>(b.x - a.x) * (y - a.y) / (b.y - a.y));
+    }
+    std::sort(xs.begin(), xs.end());
+    for (size_t i = 0; i + 1 < xs.size(); i += 2) {
+      writer.FillSpan({xs[i], y}, xs[i + 1] - xs[i], c);
+    }
+  }
+}
+
 void DrawDesktop(PixelWriter& writer) {
   const auto width = writer.Width();
   const auto height = writer.Height();
@@ -23,6 +23,29 @@ constexpr PixelColor ToColor(uint32_t c) {
   };
 }
 
+// 色を、指定したピクセル形式の 32 ビットのピクセル値に変換する(予約バイトは 0)
+inline uint32_t EncodePixel(PixelFormat format, const PixelColor& c) {
+  switch (format) {
+    case kPixelRGBResv8BitPerColor:
+      return c.r | (c.g << 8) | (c.b << 16);
+    case kPixelBGRResv8BitPerColor:
+      return c.b | (c.g << 8) | (c.r << 16);
+  }
+  return 0;
+}
+
+// 指定したピクセル形式の 32 ビットのピクセル値を色に変換する
+inline PixelColor DecodePixel(PixelFormat format, uint32_t v) {
+  const uint8_t b0 = v & 0xff, b1 = (v >> 8) & 0xff, b2 = (v >> 16) & 0xff;
+  switch (format) {
+    case kPixelRGBResv8BitPerColor:
+      return {b0, b1, b2};
+    case kPixelBGRResv8BitPerColor:
+      return {b2, b1, b0};
+  }
+  return {0, 0, 0};
+}
+
 template <typename T>
 struct Vector2D {
   T x, y;
@@ -93,6 +116,26 @@ class PixelWriter {
     virtual void Write(Vector2D<int>pos, const PixelColor& c) = 0;
     virtual int Width() const = 0;
     virtual int Height() const = 0;
+
+    // pos から右に n ピクセルを色 c で塗る
+    // 既定の実装は Write を繰り返す. バッファに直接書けるサブクラスは行単位で上書きする
+    virtual void FillSpan(Vector2D<int> pos, int n, const PixelColor& c) {
+      for (int i = 0; i < n; ++i) {
+        Write(pos + Vector2D<int>{i, 0}, c);
+      }
+    }
+    // pos から右に n ピクセルを colors の色で描く
+    virtual void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int n) {
+      for (int i = 0; i < n; ++i) {
+        Write(pos + Vector2D<int>{i, 0}, colors[i]);
+      }
+    }
+    // pos から右に n ピクセルを、format 形式の 32 ビットのピクセル値 pixels で描く
+    virtual void WritePixels(Vector2D<int> pos, const uint32_t* pixels, int n, PixelFormat format) {
+      for (int i = 0; i < n; ++i) {
+        Write(pos + Vector2D<int>{i, 0}, DecodePixel(format, pixels[i]));
+      }
+    }
 };
 
 class FrameBufferWriter : public PixelWriter {
@@ -102,6 +145,11 @@ class FrameBufferWriter : public PixelWriter {
     virtual ~FrameBufferWriter() = default;
     virtual int Width() const override { return config_.horizontal_resolution; }
     virtual int Height() const override { return config_.vertical_resolution; }
+    // バッファの範囲に切り詰めたうえで、32 ビットのピクセル値をまとめて書き込む
+    virtual void FillSpan(Vector2D<int> pos, int n, const PixelColor& c) override;
+    virtual void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int n) override;
+    // ピクセル形式が同じならそのままコピーする
+    virtual void WritePixels(Vector2D<int> pos, const uint32_t* pixels, int n, PixelFormat format) override;
 
   protected:
     uint8_t* PixelAt(Vector2D<int> pos) {
@@ -128,6 +176,14 @@ void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos, const Vector2D
 
 void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& c);
 
+// p0 から p1 までの直線を描く(両端を含む). writer の範囲外の部分は描かない
+void DrawLine(PixelWriter& writer, Vector2D<int> p0, Vector2D<int> p1, const PixelColor& c);
+// points の n 個の頂点を順につないだ折れ線を描く
+void DrawPolyline(PixelWriter& writer, const Vector2D<int>* points, int n, const PixelColor& c);
+// points の n 個の頂点からなる多角形の内部を塗る(偶奇規則)
+// FillRectangle と同様に、右端と下端の辺上のピクセルは塗らない
+void FillPolygon(PixelWriter& writer, const Vector2D<int>* points, int n, const PixelColor& c);
+
 const PixelColor kDesktopBGColor{45, 118, 237};
 const PixelColor kDesktopFGColor{255, 255, 255};
 
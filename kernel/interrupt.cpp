@@ -114,7 +114,14 @@ namespace {
   __attribute__((interrupt))
   void IntHandlerPF(InterruptFrame* frame, uint64_t error_code) {
     uint64_t cr2 = GetCR2();  // PFの原因となったメモリアドレス
-    if (auto err = HandlePageFault(error_code, cr2); !err) {
+
+    // ファイルマップのページを用意する間に、ブロックキャッシュのページで再びページフォルトが起きることがある.
+    // 同じ IST の位置にフレームを積むと外側のフレームを壊すので、処理中は IST を 1 段分下にずらしておく
+    const uint64_t ist = GetIST(kISTForPageFault);
+    SetIST(kISTForPageFault, ist - kPageFaultStackFrames * 4096);
+    auto err = HandlePageFault(error_code, cr2);
+    SetIST(kISTForPageFault, ist);
+    if (!err) {
       return;
     }
     KillApp(frame);
@@ -146,7 +153,11 @@ void InitializeInterrupt() {
   set_idt_entry(11, IntHandlerNP);
   set_idt_entry(12, IntHandlerSS);
   set_idt_entry(13, IntHandlerGP);  // 一般保護例外
-  set_idt_entry(14, IntHandlerPF);  // ページフォルト
+  // ページフォルトは入れ子になりうるので、タイマ割り込みと共用のISTは使わない
+  SetIDTEntry(idt[14],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForPageFault),
+              reinterpret_cast<uint64_t>(IntHandlerPF),
+              kKernelCS);
   set_idt_entry(16, IntHandlerMF);
   set_idt_entry(17, IntHandlerAC);
   set_idt_entry(18, IntHandlerMC);
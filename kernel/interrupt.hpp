@@ -47,6 +47,11 @@ constexpr InterruptDescriptorAttribute MakeIDTAttr(
 
 // タイマ割り込みが使うスタック領域を指すISTのインデックス
 const int kISTForTimer = 1;
+// ページフォルトが使うスタック領域を指すISTのインデックス
+const int kISTForPageFault = 2;
+// ページフォルト 1 段あたりのスタックのフレーム数.
+// ファイルマップの処理中にブロックキャッシュのページで再びページフォルトが起きるので、2 段分を確保する
+const int kPageFaultStackFrames = 8;
 
 void SetIDTEntry(InterruptDescriptor& desc,
                  InterruptDescriptorAttribute attr,
@@ -72,3 +77,17 @@ struct InterruptFrame {
 void NotifyEndOfInterrupt();
 
 void InitializeInterrupt();
+
+// 割り込みを禁止し、禁止前に割り込みが許可されていたかを返す
+// 割り込み禁止中にも呼ばれうる処理で、cli/sti の代わりに状態を保存して戻すために使う
+inline bool DisableInterrupt() {
+  uint64_t rflags;
+  __asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags) :: "memory");
+  return rflags & 0x200;  // IF
+}
+
+inline void RestoreInterrupt(bool enabled) {
+  if (enabled) {
+    __asm__ volatile("sti" ::: "memory");
+  }
+}
@@ -0,0 +1,388 @@
+#include "io_ring.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <vector>
+
+#include "task.hpp"
+#include "timer.hpp"
+#include "paging.hpp"
+#include "memory_manager.hpp"
+#include "syscall.hpp"
+#include "logger.hpp"
+
+namespace {
+  const uint32_t kMaxSQEntries = 256;
+  const uint32_t kMaxBufBytes = 1024 * 1024;
+  // kIORingWinWriteString で描画できる文字列の最大長
+  const uint32_t kMaxStringLen = 255;
+
+  Task* worker_task;
+  // 作成済みの io ring の一覧
+  std::vector<std::shared_ptr<IORing>>* io_rings;
+
+  // タイマ待ちの操作. ワーカータスクのタイマの値から引く
+  struct PendingTimeout {
+    std::weak_ptr<IORing> ring;
+    uint64_t user_data;
+  };
+  std::map<int, PendingTimeout>* pending_timeouts;
+  int last_timer_value = 0;
+
+  uint32_t AlignUp(uint32_t value, uint32_t align) {
+    return (value + align - 1) & ~(align - 1);
+  }
+
+  bool IsAppEventMessage(const Message& msg) {
+    AppEvent event;
+    return syscall::MessageToAppEvent(msg, event);
+  }
+
+  // タイマの値を払い出す. kTaskTimerValue などカーネルが予約している値とは重ならないようにする
+  int NextTimerValue() {
+    if (last_timer_value >= std::numeric_limits<int>::max() / 2) {
+      last_timer_value = 0;
+    }
+    return ++last_timer_value;
+  }
+
+  void TaskIORingWorker(uint64_t task_id, int64_t data) {
+    Task& task = CurrentTaskOnCPU();
+
+    while (true) {
+      __asm__("cli");
+      auto msg = task.ReceiveMessage();
+      if (!msg) {
+        bool has_work = false;
+        for (auto& ring : *io_rings) {
+          has_work |= ring->HasWork();
+        }
+        if (!has_work) {
+          task.Sleep();
+          continue;
+        }
+      }
+
+      if (msg && msg->type == Message::kTimerTimeout) {
+        if (auto it = pending_timeouts->find(msg->arg.timer.value);
+            it != pending_timeouts->end()) {
+          auto ring = it->second.ring.lock();
+          const auto user_data = it->second.user_data;
+          pending_timeouts->erase(it);
+          if (ring) {
+            ring->CompleteTimeout(user_data);
+          }
+        }
+      }
+
+      // 処理中に io ring が破棄されても共有領域に触らないよう、一覧の複製に対して処理する
+      auto rings = *io_rings;
+      __asm__("sti");
+
+      for (auto& ring : rings) {
+        ring->Process();
+      }
+    }
+  }
+}
+
+IORing::IORing(Task& owner, IORingHeader* header)
+    : owner_{owner}, header_{header},
+      sq_entries_{header->sq_entries}, cq_entries_{header->cq_entries},
+      buf_size_{header->buf_size} {
+  auto base = reinterpret_cast<uint8_t*>(header);
+  sq_ = reinterpret_cast<IORingSQE*>(base + header->sq_offset);
+  cq_ = reinterpret_cast<IORingCQE*>(base + header->cq_offset);
+  buf_ = base + header->buf_offset;
+}
+
+uint32_t IORing::Completions() const {
+  const uint32_t n = header_->cq_tail - __atomic_load_n(&header_->cq_head, __ATOMIC_ACQUIRE);
+  // アプリが cq_head を壊しても CQ の要素数を超えないようにする
+  return n > cq_entries_ ? cq_entries_ : n;
+}
+
+bool IORing::Idle() const {
+  return closed_ || (inflight_ == 0 &&
+      header_->sq_head == __atomic_load_n(&header_->sq_tail, __ATOMIC_ACQUIRE));
+}
+
+bool IORing::HasWork() const {
+  if (closed_) {
+    return false;
+  }
+  const bool sq_ready = header_->sq_head != __atomic_load_n(&header_->sq_tail, __ATOMIC_ACQUIRE);
+  if (sq_ready && inflight_ + Completions() < cq_entries_) {
+    return true;
+  }
+  return !event_waits_.empty() && owner_.HasMessageIf(IsAppEventMessage);
+}
+
+bool IORing::Process() {
+  bool progress = false;
+
+  while (true) {
+    __asm__("cli");
+    if (closed_) {
+      __asm__("sti");
+      break;
+    }
+    const uint32_t head = header_->sq_head;
+    // CQ があふれないよう、完了待ちと回収待ちの合計が CQ の要素数未満のときだけ受け付ける
+    if (head == __atomic_load_n(&header_->sq_tail, __ATOMIC_ACQUIRE) ||
+        inflight_ + Completions() >= cq_entries_) {
+      __asm__("sti");
+      break;
+    }
+    const IORingSQE sqe = sq_[head & (sq_entries_ - 1)];
+    __atomic_store_n(&header_->sq_head, head + 1, __ATOMIC_RELEASE);
+    ++inflight_;
+    __asm__("sti");
+
+    Execute(sqe);
+    progress = true;
+  }
+
+  // イベント待ちの操作に、届いているイベントを古い順に割り当てる
+  while (true) {
+    __asm__("cli");
+    if (closed_ || event_waits_.empty()) {
+      __asm__("sti");
+      break;
+    }
+    auto msg = owner_.ReceiveMessageIf(IsAppEventMessage);
+    if (!msg) {
+      __asm__("sti");
+      break;
+    }
+    const auto user_data = event_waits_.front();
+    event_waits_.pop_front();
+    __asm__("sti");
+
+    AppEvent event;
+    syscall::MessageToAppEvent(*msg, event);
+    Post(user_data, 0, &event);
+    progress = true;
+  }
+
+  return progress;
+}
+
+void IORing::CompleteTimeout(uint64_t user_data) {
+  Post(user_data, 0);
+}
+
+void IORing::Execute(const IORingSQE& sqe) {
+  switch (sqe.op) {
+  case kIORingNop:
+    Post(sqe.user_data, 0);
+    break;
+  case kIORingRead:
+  case kIORingWrite:
+    Post(sqe.user_data, ReadWrite(sqe));
+    break;
+  case kIORingTimeout: {
+    const unsigned long timeout =
+      timer_manager->CurrentTick() + sqe.offset * kTimerFreq / 1000;
+    __asm__("cli");
+    const int value = NextTimerValue();
+    (*pending_timeouts)[value] = PendingTimeout{weak_from_this(), sqe.user_data};
+    timer_manager->AddTimer(Timer{timeout, value, worker_task->ID()});
+    __asm__("sti");
+    break;
+  }
+  case kIORingReadEvent:
+    __asm__("cli");
+    event_waits_.push_back(sqe.user_data);
+    __asm__("sti");
+    break;
+  case kIORingWinFillRectangle: {
+    const auto res = syscall::WinFillRectangle(
+        sqe.layer_id_flags, sqe.x, sqe.y, sqe.w, sqe.h, sqe.color);
+    Post(sqe.user_data, res.error ? -res.error : res.value);
+    break;
+  }
+  case kIORingWinWriteString: {
+    if (sqe.buf > buf_size_ || sqe.len > buf_size_ - sqe.buf || sqe.len > kMaxStringLen) {
+      Post(sqe.user_data, -EINVAL);
+      break;
+    }
+    // 描画中に共有領域が解放されてもよいように、文字列をコピーしておく
+    char s[kMaxStringLen + 1];
+    __asm__("cli");
+    if (closed_) {
+      __asm__("sti");
+      break;
+    }
+    memcpy(s, buf_ + sqe.buf, sqe.len);
+    __asm__("sti");
+    s[sqe.len] = '\0';
+
+    const auto res = syscall::WinWriteString(
+        sqe.layer_id_flags, sqe.x, sqe.y, sqe.color, reinterpret_cast<uint64_t>(s), 0);
+    Post(sqe.user_data, res.error ? -res.error : res.value);
+    break;
+  }
+  case kIORingWinRedraw: {
+    const auto res = syscall::WinRedraw(sqe.layer_id_flags, 0, 0, 0, 0, 0);
+    Post(sqe.user_data, res.error ? -res.error : res.value);
+    break;
+  }
+  default:
+    Post(sqe.user_data, -EINVAL);
+  }
+}
+
+// ファイルの読み書きを行う
+// ワーカータスクを止めないよう、ブロックしうるターミナルやパイプは対象外とする
+int64_t IORing::ReadWrite(const IORingSQE& sqe) {
+  if (sqe.buf > buf_size_ || sqe.len > buf_size_ - sqe.buf) {
+    return -EFAULT;
+  }
+
+  // 割り込み禁止で確かめるのは、io ring が閉じられていないことと fd だけにする
+  // ファイルディスクリプタは参照を複製して保持し、読み書き自体は割り込みを許可して行う
+  // 同じディスクリプタへのアプリのシステムコールとは、fat::FileDescriptor が 1 つずつ順に行わせる
+  __asm__("cli");
+  if (closed_) {
+    __asm__("sti");
+    return 0;
+  }
+  auto& files = owner_.Files();
+  if (sqe.fd < 0 || files.size() <= sqe.fd || !files[sqe.fd]) {
+    __asm__("sti");
+    return -EBADF;
+  }
+  const std::shared_ptr<FileDescriptor> file = files[sqe.fd];
+  // 読み書きを終えるまで、ReleaseIORing は共有領域を解放させずに待つ
+  ++io_in_progress_;
+  __asm__("sti");
+
+  uint8_t* buf = buf_ + sqe.buf;
+  int64_t result;
+  if (file->Type() != FileType::kRegular) {
+    result = -EBADF;
+  } else if (sqe.op == kIORingRead) {
+    result = sqe.offset == IORING_CURRENT_OFFSET
+      ? file->Read(buf, sqe.len)
+      : file->Load(buf, sqe.len, sqe.offset);
+  } else if (sqe.offset == IORING_CURRENT_OFFSET) {
+    result = file->Write(buf, sqe.len);
+  } else if (sqe.offset > file->Size()) {
+    result = -EINVAL;
+  } else {
+    result = file->Store(buf, sqe.len, sqe.offset);
+  }
+
+  __asm__("cli");
+  if (--io_in_progress_ == 0 && closed_) {
+    task_manager->Wakeup(&owner_);  // ReleaseIORing で待っている
+  }
+  __asm__("sti");
+  return result;
+}
+
+// CQE を書き込み、完了を待っているかもしれないアプリを起こす
+void IORing::Post(uint64_t user_data, int64_t result, const AppEvent* event) {
+  __asm__("cli");
+  if (closed_) {
+    __asm__("sti");
+    return;
+  }
+  const uint32_t tail = header_->cq_tail;
+  auto& cqe = cq_[tail & (cq_entries_ - 1)];
+  cqe.user_data = user_data;
+  cqe.result = result;
+  if (event) {
+    cqe.event = *event;
+  } else {
+    memset(&cqe.event, 0, sizeof(cqe.event));
+  }
+  __atomic_store_n(&header_->cq_tail, tail + 1, __ATOMIC_RELEASE);
+  --inflight_;
+  task_manager->Wakeup(&owner_);
+  __asm__("sti");
+}
+
+void InitializeIORing() {
+  io_rings = new std::vector<std::shared_ptr<IORing>>;
+  pending_timeouts = new std::map<int, PendingTimeout>;
+
+  worker_task = &task_manager->NewTask().InitContext(TaskIORingWorker, 0);
+  // アプリより高い優先度で動かし、投入された操作をすぐに処理する
+  task_manager->Wakeup(worker_task, 2);
+}
+
+WithError<uint64_t> SetupIORing(Task& task, uint32_t sq_entries, uint32_t buf_bytes) {
+  if (task.Ring()) {
+    return { 0, MAKE_ERROR(Error::kAlreadyAllocated) };
+  }
+  if (sq_entries == 0 || sq_entries > kMaxSQEntries ||
+      (sq_entries & (sq_entries - 1)) != 0 || buf_bytes > kMaxBufBytes) {
+    return { 0, MAKE_ERROR(Error::kIndexOutOfRange) };
+  }
+
+  // 共有領域のレイアウト: ヘッダ, SQ, CQ, データ領域
+  const uint32_t cq_entries = sq_entries * 2;
+  const uint32_t sq_offset = AlignUp(sizeof(IORingHeader), 64);
+  const uint32_t cq_offset = AlignUp(sq_offset + sizeof(IORingSQE) * sq_entries, 64);
+  const uint32_t buf_offset = AlignUp(cq_offset + sizeof(IORingCQE) * cq_entries, 64);
+  const size_t num_pages = (buf_offset + buf_bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+
+  auto [ frame, err ] = memory_manager->Allocate(num_pages);
+  if (err) {
+    return { 0, err };
+  }
+  memset(frame.Frame(), 0, num_pages * kBytesPerFrame);
+
+  auto header = reinterpret_cast<IORingHeader*>(frame.Frame());
+  header->sq_entries = sq_entries;
+  header->cq_entries = cq_entries;
+  header->sq_offset = sq_offset;
+  header->cq_offset = cq_offset;
+  header->buf_offset = buf_offset;
+  header->buf_size = buf_bytes;
+
+  // メモリマップトファイルと同じく、アドレス空間の上の方から割り当てる
+  const uint64_t vaddr_begin = (task.FileMapEnd() - num_pages * kBytesPerFrame) & 0xffff'ffff'ffff'f000;
+  if (auto err = MapFrames(LinearAddress4Level{vaddr_begin}, frame, num_pages)) {
+    // マップ済みのフレームはアプリ終了時に CleanPageMaps で解放される
+    return { 0, err };
+  }
+  task.SetFileMapEnd(vaddr_begin);
+
+  auto ring = std::make_shared<IORing>(task, header);
+  __asm__("cli");
+  task.Ring() = ring;
+  io_rings->push_back(ring);
+  __asm__("sti");
+
+  return { vaddr_begin, MAKE_ERROR(Error::kSuccess) };
+}
+
+void ReleaseIORing(Task& task) {
+  __asm__("cli");
+  if (auto ring = task.Ring()) {
+    ring->Close();
+    for (auto it = io_rings->begin(); it != io_rings->end(); ++it) {
+      if (*it == ring) {
+        io_rings->erase(it);
+        break;
+      }
+    }
+    task.Ring().reset();
+
+    // ワーカーが割り込みを許可して共有領域に読み書きしている最中なら、終わるまで待つ
+    while (ring->Busy()) {
+      task.Sleep();
+      __asm__("cli");
+    }
+  }
+  __asm__("sti");
+}
+
+void WakeupIORingWorker() {
+  task_manager->Wakeup(worker_task, 2);
+}
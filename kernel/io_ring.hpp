@@ -0,0 +1,73 @@
+/**
+ * @file io_ring.hpp
+ *
+ * アプリとカーネルが共有するサブミッションキュー・コンプリーションキューによる非同期 I/O
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <memory>
+
+#include "app_event.hpp"
+#include "app_io_ring.hpp"
+#include "error.hpp"
+
+class Task;
+
+// アプリ 1 つ分のサブミッションキュー(SQ)とコンプリーションキュー(CQ)の組
+// 共有領域は物理的に連続したフレームで、カーネルからはアイデンティティマッピング経由でアクセスする
+// メンバの操作は割り込み禁止状態で行う
+class IORing : public std::enable_shared_from_this<IORing> {
+  public:
+    IORing(Task& owner, IORingHeader* header);
+
+    Task& Owner() const { return owner_; }
+    uint32_t CQEntries() const { return cq_entries_; }
+    // SQ に積まれた操作を受け付け、届いているイベントを待ち中の操作に割り当てる
+    // 何らかの操作を受け付けたか完了させたら true を返す
+    bool Process();
+    // ワーカータスクが処理すべきものが残っているか
+    bool HasWork() const;
+    // 完了済みでアプリがまだ回収していない CQE の数
+    uint32_t Completions() const;
+    // 受け付け待ちの SQE も完了待ちの操作もない
+    bool Idle() const;
+    // タイマ待ちの操作を完了させる
+    void CompleteTimeout(uint64_t user_data);
+    // 以後共有領域に触らないようにする
+    void Close() { closed_ = true; }
+    // 割り込みを許可して共有領域に読み書きしている操作があるか
+    bool Busy() const { return io_in_progress_ > 0; }
+
+  private:
+    Task& owner_;
+    IORingHeader* header_;
+    // アプリが書き換えられる共有領域の値は信用せず、作成時の値を保持しておく
+    IORingSQE* sq_;
+    IORingCQE* cq_;
+    uint8_t* buf_;
+    uint32_t sq_entries_, cq_entries_, buf_size_;
+
+    bool closed_{false};
+    uint32_t inflight_{0};               // 受け付けたが未完了の操作の数
+    uint32_t io_in_progress_{0};         // 共有領域のデータ領域を使ってファイルを読み書き中の操作の数
+    std::deque<uint64_t> event_waits_{}; // イベントを待っている操作の user_data
+
+    void Execute(const IORingSQE& sqe);
+    int64_t ReadWrite(const IORingSQE& sqe);
+    void Post(uint64_t user_data, int64_t result, const AppEvent* event = nullptr);
+};
+
+void InitializeIORing();
+
+// 実行中のタスクに io ring を作成し、共有領域の先頭アドレスを返す
+// sq_entries は 2 のべき乗. CQ の要素数は SQ の 2 倍になる
+WithError<uint64_t> SetupIORing(Task& task, uint32_t sq_entries, uint32_t buf_bytes);
+// タスクの io ring を破棄する. 共有領域のフレームは CleanPageMaps で解放される
+// ワーカーが共有領域に読み書き中なら終わるまで待つので、io ring を持つタスク自身から呼び出すこと
+void ReleaseIORing(Task& task);
+// ワーカータスクを起こす. 割り込み禁止状態で呼び出すこと
+void WakeupIORingWorker();
@@ -1,9 +1,13 @@
 #include "layer.hpp"
 
 #include <algorithm>
+#include <limits>
 #include "console.hpp"
 #include "logger.hpp"
 #include "task.hpp"
+#include "timer.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
 
 Layer::Layer(unsigned int id) : id_{id} {
 }
@@ -119,41 +123,239 @@ void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
   Draw(id);
 }
 
-void LayerManager::DrawAll() const {
+void LayerManager::DrawAll() {
   Draw({{0, 0}, ScreenSize()});
 }
 
-void LayerManager::Draw(const Rectangle<int>& area) const {
-  // layer_stack_ には、最背面 -> 最前面 の順でレイヤーが並んでいる
-  for (auto layer: layer_stack_) {
-    layer->DrawTo(back_buffer_, area);
+void LayerManager::Draw(const Rectangle<int>& area) {
+  AddDamage(area);
+  if (!deferred_) {
+    Flush();
   }
-  screen_->Copy(area.pos, back_buffer_, area);
 }
 
-void LayerManager::Draw(unsigned int id) const {
+void LayerManager::Draw(unsigned int id) {
   // 指定レイヤにあるウィンドウ全体を範囲として指定
   Draw(id, {{0, 0}, {-1, -1}});
 }
 
-void LayerManager::Draw(unsigned int id, Rectangle<int> area) const {
-  bool draw = false;
-  Rectangle<int> window_area;
-  for (auto layer: layer_stack_) {
-    if (layer->ID() == id) {
-      window_area.size = layer->GetWindow()->Size();
-      window_area.pos = layer->GetPosition();
-      if (area.size.x >= 0 || area.size.y >= 0) {
-        area.pos = area.pos + window_area.pos;
-        window_area = window_area & area;
+void LayerManager::Draw(unsigned int id, Rectangle<int> area) {
+  const Layer* layer = FindLayer(id);
+  if (layer == nullptr || std::find(layer_stack_.begin(), layer_stack_.end(), layer) == layer_stack_.end()) {
+    return;
+  }
+
+  Rectangle<int> window_area{layer->GetPosition(), layer->GetWindow()->Size()};
+  if (area.size.x >= 0 || area.size.y >= 0) {
+    area.pos = area.pos + window_area.pos;
+    window_area = window_area & area;
+  }
+  Draw(window_area);
+}
+
+namespace {
+  // 同時に保持する再描画範囲の最大数. 超えたら全体を囲む1つの矩形にまとめる
+  const size_t kMaxDamageRects = 32;
+
+  bool IsEmpty(const Rectangle<int>& r) {
+    return r.size.x <= 0 || r.size.y <= 0;
+  }
+
+  long AreaOf(const Rectangle<int>& r) {
+    return static_cast<long>(r.size.x) * r.size.y;
+  }
+
+  // 2つの矩形を囲む最小の矩形
+  Rectangle<int> BoundingBox(const Rectangle<int>& a, const Rectangle<int>& b) {
+    const auto pos = ElementMin(a.pos, b.pos);
+    const auto end = ElementMax(a.pos + a.size, b.pos + b.size);
+    return {pos, end - pos};
+  }
+
+  // r から hole を除いた部分を最大4つの矩形に分けて out に追加する
+  void SubtractRect(const Rectangle<int>& r, const Rectangle<int>& hole,
+                    std::vector<Rectangle<int>>& out) {
+    const auto inter = r & hole;
+    if (IsEmpty(inter)) {
+      out.push_back(r);
+      return;
+    }
+
+    const auto r_end = r.pos + r.size;
+    const auto inter_end = inter.pos + inter.size;
+    if (r.pos.y < inter.pos.y) {  // 上
+      out.push_back({r.pos, {r.size.x, inter.pos.y - r.pos.y}});
+    }
+    if (inter_end.y < r_end.y) {  // 下
+      out.push_back({{r.pos.x, inter_end.y}, {r.size.x, r_end.y - inter_end.y}});
+    }
+    if (r.pos.x < inter.pos.x) {  // 左
+      out.push_back({{r.pos.x, inter.pos.y}, {inter.pos.x - r.pos.x, inter.size.y}});
+    }
+    if (inter_end.x < r_end.x) {  // 右
+      out.push_back({{inter_end.x, inter.pos.y}, {r_end.x - inter_end.x, inter.size.y}});
+    }
+  }
+}
+
+void LayerManager::AddDamage(Rectangle<int> area) {
+  area = area & Rectangle<int>{{0, 0}, ScreenSize()};
+  if (IsEmpty(area)) {
+    return;
+  }
+  // メインタスクとアプリのタスクの両方から呼ばれるので、damage_ は割り込み禁止で操作する
+  const bool intr = DisableInterrupt();
+  ++frame_stat_.damage_adds;
+
+  // 囲む矩形にまとめても描画量が増えない範囲同士は1つにまとめる
+  for (size_t i = 0; i < damage_.size(); ) {
+    const auto merged = BoundingBox(area, damage_[i]);
+    if (AreaOf(merged) <= AreaOf(area) + AreaOf(damage_[i])) {
+      area = merged;
+      damage_[i] = damage_.back();
+      damage_.pop_back();
+      i = 0;  // 大きくなった範囲で改めて調べる
+    } else {
+      ++i;
+    }
+  }
+  damage_.push_back(area);
+
+  if (damage_.size() > kMaxDamageRects) {
+    auto all = damage_[0];
+    for (const auto& r : damage_) {
+      all = BoundingBox(all, r);
+    }
+    damage_.clear();
+    damage_.push_back(all);
+  }
+  RestoreInterrupt(intr);
+}
+
+void LayerManager::Flush() {
+  // アプリのタスクが割り込み禁止で AddDamage を呼ぶので、範囲の一覧は割り込み禁止で取り出す
+  // 描画中に追加された範囲は damage_ に残り、次の Flush で描画される
+  const bool intr = DisableInterrupt();
+  flushing_.swap(damage_);
+  RestoreInterrupt(intr);
+  if (flushing_.empty()) {
+    return;
+  }
+
+  const auto start = ReadTSC();
+  for (const auto& r : flushing_) {
+    Composite(r);
+  }
+  const auto cycles = ReadTSC() - start;
+
+  frame_stat_.frames++;
+  frame_stat_.rects += flushing_.size();
+  frame_stat_.total_cycles += cycles;
+  frame_stat_.max_cycles = std::max(frame_stat_.max_cycles, cycles);
+  if (cycles > tsc_freq / kFrameRate) {
+    frame_stat_.over_budget++;
+  }
+  flushing_.clear();
+}
+
+void LayerManager::Composite(Rectangle<int> area) const {
+  area = area & Rectangle<int>{{0, 0}, ScreenSize()};
+  if (IsEmpty(area)) {
+    return;
+  }
+
+  // 最前面から順に、まだ不透明なレイヤに覆われていない範囲とレイヤの重なりを求める
+  // 不透明なレイヤはその範囲を覆い隠すので、以降(背面)のレイヤでは描画しない
+  uncovered_.clear();
+  uncovered_.push_back(area);
+  visible_parts_.clear();
+  for (size_t h = layer_stack_.size(); h-- > 0 && !uncovered_.empty(); ) {
+    const Layer* layer = layer_stack_[h];
+    const auto& window = layer->GetWindow();
+    if (!window) {
+      continue;
+    }
+    const Rectangle<int> layer_area{layer->GetPosition(), window->Size()};
+
+    uncovered_next_.clear();
+    for (const auto& r : uncovered_) {
+      const auto visible = r & layer_area;
+      if (IsEmpty(visible)) {
+        uncovered_next_.push_back(r);
+        continue;
+      }
+      visible_parts_.emplace_back(layer, visible);
+      if (window->IsOpaque()) {
+        SubtractRect(r, layer_area, uncovered_next_);
+      } else {
+        uncovered_next_.push_back(r);
       }
-      draw = true;
     }
-    if (draw) {
-      layer->DrawTo(back_buffer_, window_area);
+    uncovered_.swap(uncovered_next_);
+  }
+
+  // 透過色のあるレイヤが正しく重なるよう、背面から順に描画する
+  for (auto it = visible_parts_.rbegin(); it != visible_parts_.rend(); ++it) {
+    it->first->DrawTo(back_buffer_, it->second);
+  }
+  screen_->Copy(area.pos, back_buffer_, area);
+
+  // 転送でカーソルを上書きしたら描き直す
+  if (cursor_visible_ && !IsEmpty(area & Rectangle<int>{cursor_pos_, cursor_size_})) {
+    DrawCursor();
+  }
+}
+
+void LayerManager::SetCursor(Window& image, const PixelColor& transparent) {
+  cursor_size_ = image.Size();
+
+  FrameBufferConfig config = screen_->Config();
+  config.frame_buffer = nullptr;
+  config.horizontal_resolution = cursor_size_.x;
+  config.vertical_resolution = cursor_size_.y;
+  if (auto err = cursor_image_.Initialize(config)) {
+    Log(kError, "failed to initialize cursor image: %s at %s:%d\n",
+        err.Name(), err.File(), err.Line());
+    return;
+  }
+  image.DrawTo(cursor_image_, {0, 0});
+
+  // 不透明なピクセルの並びを行ごとに求めておき、描画時は並びごとにまとめて転送する
+  cursor_runs_.clear();
+  for (int y = 0; y < cursor_size_.y; ++y) {
+    int x = 0;
+    while (x < cursor_size_.x) {
+      if (image.At({x, y}) == transparent) {
+        ++x;
+        continue;
+      }
+      const int begin = x;
+      while (x < cursor_size_.x && image.At({x, y}) != transparent) {
+        ++x;
+      }
+      cursor_runs_.push_back({y, begin, x - begin});
     }
   }
-  screen_->Copy(window_area.pos, back_buffer_, window_area);
+  cursor_visible_ = true;
+  DrawCursor();
+}
+
+void LayerManager::MoveCursor(Vector2D<int> pos) {
+  if (cursor_visible_) {
+    // 元の位置のカーソルを消す
+    screen_->Copy(cursor_pos_, back_buffer_, {cursor_pos_, cursor_size_});
+  }
+  cursor_pos_ = pos;
+  if (cursor_visible_) {
+    DrawCursor();
+  }
+}
+
+void LayerManager::DrawCursor() const {
+  for (const auto& run : cursor_runs_) {
+    screen_->Copy(cursor_pos_ + Vector2D<int>{run.x, run.y},
+                  cursor_image_, {{run.x, run.y}, {run.len, 1}});
+  }
 }
 
 void LayerManager::Hide(unsigned int id) {
@@ -239,10 +441,6 @@ namespace{
 ActiveLayer::ActiveLayer(LayerManager& manager) : manager_{manager} {
 }
 
-void ActiveLayer::SetMouseLayer(unsigned int mouse_layer_id) {
-  mouse_layer_id_ = mouse_layer_id;
-}
-
 void ActiveLayer::Activate(unsigned int layer_id) {
   if (active_layer_id_ == layer_id) {
     return;
@@ -261,8 +459,7 @@ void ActiveLayer::Activate(unsigned int layer_id) {
   if (active_layer_id_ > 0) {
     Layer* layer = manager_.FindLayer(active_layer_id_);
     layer->GetWindow()->Activate();
-    manager_.UpDown(active_layer_id_, 0);
-    manager_.UpDown(active_layer_id_, manager_.GetHeight(mouse_layer_id_) - 1);
+    manager_.UpDown(active_layer_id_, std::numeric_limits<int>::max());
     manager_.Draw(active_layer_id_);
     SendWindowActiveMessage(active_layer_id_, 1);
   }
@@ -64,14 +64,32 @@ class LayerManager {
     // 指定したレイヤを削除
     void RemoveLayer(unsigned int id);
 
+    // 以下の Draw 系の関数は再描画が必要な範囲を登録するだけで、
+    // 遅延描画が有効なら実際の描画は Flush でまとめて行う
     // 画面全体を再描画
-    void DrawAll() const;
+    void DrawAll();
     // 指定領域を再描画
-    void Draw(const Rectangle<int>& area) const;
-    // 指定したレイヤとそれより前面にあるレイヤのみ再描画
-    void Draw(unsigned int id) const;
-    // 指定したレイヤより前面のレイヤの、指定範囲のみ再描画
-    void Draw(unsigned int id, Rectangle<int> area) const;
+    void Draw(const Rectangle<int>& area);
+    // 指定したレイヤのウィンドウ全体を再描画
+    void Draw(unsigned int id);
+    // 指定したレイヤのウィンドウの、指定範囲のみ再描画
+    void Draw(unsigned int id, Rectangle<int> area);
+
+    // 登録された範囲を合成して画面に転送する. フレームタイマごとに呼び出す
+    void Flush();
+    // 遅延描画を有効にする. 無効なら Draw のたびに Flush する
+    void SetDeferred(bool deferred) { deferred_ = deferred; }
+
+    // フレームごとの描画の統計
+    struct FrameStat {
+      uint64_t frames;        // 描画を行ったフレーム数
+      uint64_t rects;         // 合成した矩形の数
+      uint64_t damage_adds;   // 登録された範囲の数(まとめる前)
+      uint64_t total_cycles, max_cycles;  // Flush にかかった TSC のサイクル数
+      uint64_t over_budget;   // 1フレームの時間に収まらなかったフレーム数
+    };
+    const FrameStat& GetFrameStat() const { return frame_stat_; }
+    void ResetFrameStat() { frame_stat_ = {}; }
 
     // 指定したレイヤを指定座標に移動
     void Move(unsigned int id, Vector2D<int> new_pos);
@@ -87,6 +105,12 @@ class LayerManager {
     // レイヤを非表示にする
     void Hide(unsigned int id);
 
+    // マウスカーソルを設定する. image のうち transparent 色のピクセルは描画しない
+    // カーソルはレイヤとは別に画面へ直接描画するので、カーソルを動かしてもレイヤの合成は起きない
+    void SetCursor(Window& image, const PixelColor& transparent);
+    // マウスカーソルを指定座標に移動して描画する
+    void MoveCursor(Vector2D<int> pos);
+
     // 指定位置にある最前面のレイヤを取得
     Layer* FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const;
     // 指定IDのレイヤを取得
@@ -103,6 +127,33 @@ class LayerManager {
     std::vector<Layer*> layer_stack_{};             // レイヤの重なり(奥行き方向の位置関係)を表現する
     unsigned int latest_id_{0};
 
+    // マウスカーソル
+    // 画面はカーソルの部分を除いて back_buffer_ と同じ内容になっているので、
+    // カーソルの下に隠れたピクセルは back_buffer_ から復元できる
+    struct CursorRun {
+      int y, x, len;  // カーソル画像の y 行目の [x, x + len) が不透明
+    };
+    bool cursor_visible_{false};
+    Vector2D<int> cursor_pos_{}, cursor_size_{};
+    FrameBuffer cursor_image_{};  // 画面と同じピクセル形式のカーソル画像
+    std::vector<CursorRun> cursor_runs_{};
+    void DrawCursor() const;
+
+    bool deferred_{false};
+    std::vector<Rectangle<int>> damage_{};  // 次の Flush で再描画する範囲
+    // Flush が再描画中の範囲. damage_ と入れ替えて使い、確保済みの領域を使い回す
+    std::vector<Rectangle<int>> flushing_{};
+    FrameStat frame_stat_{};
+    void AddDamage(Rectangle<int> area);
+
+    // Composite の作業用. 描画のたびにメモリを確保しないよう保持しておく
+    mutable std::vector<Rectangle<int>> uncovered_{}, uncovered_next_{};
+    mutable std::vector<std::pair<const Layer*, Rectangle<int>>> visible_parts_{};
+
+    // area の範囲のレイヤを合成して画面に転送する
+    // 不透明なレイヤに覆われた部分は描画しない
+    void Composite(Rectangle<int> area) const;
+
 };
 
 extern LayerManager* layer_manager;
@@ -127,14 +178,12 @@ constexpr Message MakeLayerMessage(
 class ActiveLayer {
   public:
     ActiveLayer(LayerManager& manager);
-    void SetMouseLayer(unsigned int mouse_layer_id);
     void Activate(unsigned int layer_id);
     unsigned int GetActive() const { return active_layer_id_; }
 
   private:
     LayerManager& manager_;
     unsigned int active_layer_id_{0};
-    unsigned int mouse_layer_id_{0};
 };
 
 extern ActiveLayer* active_layer;
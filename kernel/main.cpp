@@ -37,6 +37,9 @@
 #include "terminal.hpp"
 #include "fat.hpp"
 #include "syscall.hpp"
+#include "io_ring.hpp"
+#include "block_cache.hpp"
+#include "boot_volume.hpp"
 
 int printk(const char* format, ...) {
   va_list ap;
@@ -122,8 +125,10 @@ extern "C" void KernelMainNewStack(
     const FrameBufferConfig& frame_buffer_config_ref,
     const MemoryMap& memory_map_ref,
     const acpi::RSDP& acpi_table,
-    void* volume_image) {
+    const BootVolume& boot_volume_ref) {
+  const uint64_t kernel_start_tsc = ReadTSC();
   MemoryMap memory_map{memory_map_ref};
+  BootVolume boot_volume{boot_volume_ref};
 
   InitializeGraphics(frame_buffer_config_ref);
   InitializeConsole();
@@ -133,13 +138,23 @@ extern "C" void KernelMainNewStack(
 
   InitializeSegmentation();
   InitializePaging();
+  // 画面のフレームバッファは書き込むだけなので write-combining にする
+  if (auto err = SetWriteCombining(
+        reinterpret_cast<uint64_t>(frame_buffer_config_ref.frame_buffer),
+        4 * frame_buffer_config_ref.pixels_per_scan_line * frame_buffer_config_ref.vertical_resolution,
+        true)) {
+    Log(kWarn, "failed to map frame buffer as write-combining: %s\n", err.Name());
+  }
   InitializeMemoryManager(memory_map);
   InitializeTSS();
   InitializeInterrupt();
 
-  fat::Initialize(volume_image);
-  InitializeFont();
+  // ブートボリュームを virtio-blk から読み書きできるよう、PCI デバイスを先に探す
   InitializePCI();
+  const uint64_t fat_start_tsc = ReadTSC();
+  fat::Initialize(InitializeBlockCache(boot_volume));
+  const uint64_t fat_end_tsc = ReadTSC();
+  InitializeFont();
 
   InitializeLayer();
   InitializeMainWindow();
@@ -158,6 +173,15 @@ extern "C" void KernelMainNewStack(
 
   InitializeTask();
   Task& main_task = task_manager->CurrentTask();
+  InitializeIORing();
+  InitializeBlockFlusher();
+
+  // 以降の描画はフレームタイマごとにまとめて行う
+  __asm__("cli");
+  timer_manager->AddTimer(
+      Timer{timer_manager->CurrentTick() + kFrameTimerPeriod, kFrameTimerValue, main_task.ID()});
+  __asm__("sti");
+  layer_manager->SetDeferred(true);
 
   usb::xhci::Initialize();
   InitializeKeyboard();
@@ -168,6 +192,16 @@ extern "C" void KernelMainNewStack(
     .InitContext(TaskTerminal, 0)
     .Wakeup();
 
+  // 起動にかかった時間の内訳. ローダとカーネルは同じ TSC で計測している
+  const auto ms = [](uint64_t cycles) { return cycles * 1000 / tsc_freq; };
+  const uint64_t kernel_end_tsc = ReadTSC();
+  printk("boot: loader %lu ms (volume read %lu ms, %lu/%lu KiB), kernel init %lu ms (fs %lu ms)\n",
+      ms(boot_volume.loader_end_tsc - boot_volume.loader_start_tsc),
+      ms(boot_volume.volume_read_end_tsc - boot_volume.volume_read_start_tsc),
+      boot_volume.image_bytes / 1024, boot_volume.volume_bytes / 1024,
+      ms(kernel_end_tsc - kernel_start_tsc),
+      ms(fat_end_tsc - fat_start_tsc));
+
   char str[128];
 
   while (true) {
@@ -195,7 +229,9 @@ extern "C" void KernelMainNewStack(
       usb::xhci::ProcessEvents();
       break;
     case Message::kTimerTimeout:
-      if (msg->arg.timer.value == kTextboxCursorTimer) {
+      if (msg->arg.timer.value == kFrameTimerValue) {
+        layer_manager->Flush();
+      } else if (msg->arg.timer.value == kTextboxCursorTimer) {
         __asm__("cli");
         timer_manager->AddTimer(
             Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer, 1});
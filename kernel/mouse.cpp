@@ -109,12 +109,9 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
   }
 }
 
-Mouse::Mouse(unsigned int layer_id) : layer_id_{layer_id} {
-}
-
 void Mouse::SetPosition(Vector2D<int> position) {
   position_ = position;
-  layer_manager->Move(layer_id_, position_);
+  layer_manager->MoveCursor(position_);
 }
 
 void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
@@ -125,7 +122,7 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
 
   const auto posdiff = position_ - oldpos;
 
-  layer_manager->Move(layer_id_, position_);
+  layer_manager->MoveCursor(position_);
 
   // クリック・ドラッグを検出し、
   // ・ウィンドウの閉じるボタンが押されたらウィンドウを閉じる
@@ -136,7 +133,7 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
   const bool left_pressed = (buttons & 0x01);
   if (!prev_left_pressed && left_pressed) {
     // ドラッグ開始
-    auto layer = layer_manager->FindLayerByPosition(position_, layer_id_);
+    auto layer = layer_manager->FindLayerByPosition(position_, 0);
     if (layer && layer->IsDraggable()) {
       const auto pos_layer = position_ - layer->GetPosition();
       switch (layer->GetWindow()->GetWindowRegion(pos_layer)) {
@@ -177,23 +174,16 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
 }
 
 void InitializeMouse() {
-  
-  auto mouse_window = std::make_shared<Window>(kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
-  mouse_window->SetTransparentColor(kMouseTransparentColor);
-  DrawMouseCursor(mouse_window->Writer(), {0, 0});
-
-  auto mouse_layer_id = layer_manager->NewLayer()
-    .SetWindow(mouse_window)
-    .ID();
+  // 透過色で塗った部分はカーソルの描画時に除かれる
+  auto cursor_image = std::make_shared<Window>(kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
+  DrawMouseCursor(cursor_image->Writer(), {0, 0});
+  layer_manager->SetCursor(*cursor_image, kMouseTransparentColor);
 
-  auto mouse = std::make_shared<Mouse>(mouse_layer_id);
+  auto mouse = std::make_shared<Mouse>();
   mouse->SetPosition({200, 200});
-  layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
-  
+
   usb::HIDMouseDriver::default_observer =
     [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
       mouse->OnInterrupt(buttons, displacement_x, displacement_y);
     };
-
-  active_layer->SetMouseLayer(mouse_layer_id);
 }
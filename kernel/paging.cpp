@@ -1,9 +1,13 @@
 #include "paging.hpp"
 
 #include <array>
+#include <cpuid.h>
 
 #include "asmfunc.h"
+#include "block_cache.hpp"
+#include "fat.hpp"
 #include "memory_manager.hpp"
+#include "msr.hpp"
 
 namespace {
   const uint64_t kPageSize4K = 4096;
@@ -29,8 +33,53 @@ void SetupIdentityPageTable() {
   SetCR0(GetCR0() & 0xfffeffff);  // clear WP (CPL < 3 のとき writable でないページに書き込めるようにする)
 }
 
+namespace {
+  // PAT のエントリ 1 (PWT=1, PCD=0, PAT=0 のページが使う) に設定するメモリタイプ
+  // 既定値は write-through (0x04) で、このカーネルでは使っていない
+  const uint64_t kPATTypeWC = 0x01;
+  const uint64_t kPDEWriteThrough = 1u << 3;  // PWT
+  const uint64_t kPDECacheDisable = 1u << 4;  // PCD
+  const uint64_t kPDEPAT2M = 1u << 12;        // 2MiB ページの PAT ビット
+  const unsigned int kCPUIDEdxPAT = 1u << 16;  // CPUID.01H:EDX.PAT
+
+  bool pat_supported;
+
+  void InitializePAT() {
+    unsigned int eax, ebx, ecx, edx;
+    pat_supported = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & kCPUIDEdxPAT);
+    if (!pat_supported) {
+      return;
+    }
+    const uint64_t pat = ReadMSR(kIA32_PAT);
+    WriteMSR(kIA32_PAT, (pat & ~(0xffull << 8)) | kPATTypeWC << 8);
+  }
+}
+
 void InitializePaging() {
   SetupIdentityPageTable();
+  InitializePAT();
+}
+
+Error SetWriteCombining(uint64_t addr, uint64_t bytes, bool write_combining) {
+  if (!pat_supported) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+  const uint64_t end = addr + bytes;
+  if (end > kPageDirectoryCount * kPageSize1G) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  for (uint64_t page = addr / kPageSize2M; page * kPageSize2M < end; ++page) {
+    auto& pde = page_directory[page / 512][page % 512];
+    pde &= ~(kPDEWriteThrough | kPDECacheDisable | kPDEPAT2M);
+    if (write_combining) {
+      pde |= kPDEWriteThrough;
+    }
+  }
+  // キャッシュ上の古い内容を書き戻してから TLB を捨てる
+  __asm__ volatile("wbinvd" ::: "memory");
+  SetCR3(GetCR3());
+  return MAKE_ERROR(Error::kSuccess);
 }
 
 void ResetCR3() {
@@ -138,7 +187,12 @@ Error PreparePageCache(FileDescriptor& fd, const FileMapping& m, uint64_t causal
 
   const long file_offset = page_vaddr.value - m.vaddr_begin;
   void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
-  fd.Load(page_cache, 4096, file_offset);
+  if (fd.Type() == FileType::kRegular || fd.Type() == FileType::kDirectory) {
+    // ページフォルトの処理中は眠れないので、ディスクリプタが使用中でも待たない
+    static_cast<fat::FileDescriptor&>(fd).LoadNoWait(page_cache, 4096, file_offset);
+  } else {
+    fd.Load(page_cache, 4096, file_offset);
+  }
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -199,6 +253,37 @@ Error CleanPageMaps(LinearAddress4Level addr) {
 }
 
 // ページテーブルの、 part で指定された階層のstart番目のエントリ以降を、srcからdestにコピー
+Error MapFrames(LinearAddress4Level addr, FrameID frame, size_t num_4kpages) {
+  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  const auto frame_addr = reinterpret_cast<uintptr_t>(frame.Frame());
+
+  for (size_t i = 0; i < num_4kpages; ++i) {
+    // PT までのテーブルを用意する
+    PageMapEntry* page_map = pml4_table;
+    for (int level = 4; level > 1; --level) {
+      auto& entry = page_map[addr.Part(level)];
+      auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+      if (err) {
+        return err;
+      }
+      entry.bits.user = 1;
+      entry.bits.writable = 1;
+      page_map = child_map;
+    }
+
+    // writable なので CleanPageMaps でフレームが解放される
+    auto& pte = page_map[addr.Part(1)];
+    pte.data = 0;
+    pte.SetPointer(reinterpret_cast<PageMapEntry*>(frame_addr + i * kPageSize4K));
+    pte.bits.present = 1;
+    pte.bits.writable = 1;
+    pte.bits.user = 1;
+
+    addr.value += kPageSize4K;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
   if (part == 1) {
     for (int i = start; i < 512; ++i) {
@@ -228,13 +313,19 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
   return MAKE_ERROR(Error::kSuccess);
 }
 
-// ページフォールト時にデマンドページング・メモリマップトファイル・コピーオンライトの処理を行う
+// ページフォールト時にブロックキャッシュ・デマンドページング・メモリマップトファイル・コピーオンライトの処理を行う
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
-  auto& task = task_manager->CurrentTask();
   const bool present = (error_code >> 0) & 1;
   const bool rw      = (error_code >> 1) & 1;
   const bool user    = (error_code >> 2) & 1;
 
+  // ブロックキャッシュの領域へのカーネルからのアクセス. タスクの初期化前にも起こる
+  if (!present && !user && block_cache && block_cache->Contains(causal_addr)) {
+    return block_cache->HandlePageFault(causal_addr);
+  }
+
+  auto& task = task_manager->CurrentTask();
+
   if (present && rw && user) {  // 読み込み専用のページへのアプリからの書き込み => コピーオンライト
     return CopyOnePage(causal_addr);
   }
@@ -10,6 +10,7 @@
 #include <cstdint>
 #include "error.hpp"
 #include "task.hpp"
+#include "memory_manager.hpp"
 
 /** @brief 静的に確保するページディレクトリの個数
  *
@@ -26,6 +27,14 @@ void SetupIdentityPageTable();
 
 void InitializePaging();
 
+/** @brief 物理アドレス [addr, addr + bytes) を含むアイデンティティマップの 2MiB ページのメモリタイプを設定する．
+ *
+ * write_combining が true なら write-combining に，false なら通常の write-back にする．
+ * フレームバッファのように，書き込むだけで読み出さない領域を速く書き換えるために使う．
+ * CPU が PAT に対応していなければ kNotImplemented を返す．
+ */
+Error SetWriteCombining(uint64_t addr, uint64_t bytes, bool write_combining);
+
 // OS用のページテーブルに戻す
 void ResetCR3();
 
@@ -99,5 +108,7 @@ WithError<PageMapEntry*> NewPageMap();
 Error FreePageMap(PageMapEntry* table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable = true);
 Error CleanPageMaps(LinearAddress4Level addr);
+// 物理的に連続したフレームを、addr から始まる仮想アドレス範囲に書き込み可能なページとしてマップする
+Error MapFrames(LinearAddress4Level addr, FrameID frame, size_t num_4kpages);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
@@ -91,6 +91,7 @@ void InitializeSegmentation() {
 void InitializeTSS() {
   SetTSS(1, AllocateStackArea(8));                    // RSP0: アプリ実行中に割り込み発生時、割り込みハンドラが使用するスタック
   SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8)); // IST1: システムコール実行中に割り込み発生時、割り込みハンドラが使用するスタック
+  SetTSS(7 + 2 * kISTForPageFault, AllocateStackArea(2 * kPageFaultStackFrames)); // IST2: ページフォルトのハンドラが使用するスタック
 
 	uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
 	SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(tss) - 1);
@@ -98,3 +99,12 @@ void InitializeTSS() {
 
 	LoadTR(kTSS);
 }
+
+uint64_t GetIST(int ist) {
+  const int index = 7 + 2 * ist;
+  return tss[index] | static_cast<uint64_t>(tss[index + 1]) << 32;
+}
+
+void SetIST(int ist, uint64_t value) {
+  SetTSS(7 + 2 * ist, value);
+}
@@ -50,3 +50,7 @@ void SetupSegments();
 
 void InitializeSegmentation();
 void InitializeTSS();
+
+// TSS の IST の値を読み書きする
+uint64_t GetIST(int ist);
+void SetIST(int ist, uint64_t value);
@@ -4,8 +4,10 @@
 #include <array>
 #include <cerrno>
 #include <memory>
-#include <cmath>
+#include <vector>
+#include <cstdio>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include "asmfunc.h"
 #include "msr.hpp"
@@ -18,8 +20,11 @@
 #include "font.hpp"
 #include "timer.hpp"
 #include "app_event.hpp"
+#include "app_file.hpp"
+#include "app_graphics.hpp"
 #include "keyboard.hpp"
 #include "fat.hpp"
+#include "io_ring.hpp"
 
 void InitializeSyscall() {
   WriteMSR(kIA32_EFER, 0x0501u);  // syscall有効化
@@ -30,10 +35,6 @@ void InitializeSyscall() {
 }
 
 namespace syscall {
-  struct Result {
-    uint64_t value;
-    int error;
-  };
 
 #define SYSCALL(name) \
   Result name( \
@@ -64,26 +65,23 @@ SYSCALL(PutString) {
   const auto fd = arg1;
   const char* s = reinterpret_cast<const char*>(arg2);
   const auto len = arg3;
-  if (len > 1024) {
-    return { 0, E2BIG };
-  }
 
-  __asm__("cli");
-  auto& task= task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = CurrentTaskOnCPU();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return {0, EBADF };
   }
+  // ターミナルへの出力は描画に時間がかかるので、1回の呼び出しで書ける量を制限する
+  if (len > 1024 && task.Files()[fd]->Type() == FileType::kTerminal) {
+    return { 0, E2BIG };
+  }
   return { task.Files()[fd]->Write(s, len), 0 };
 }
 
 // アプリを終了する
 // arg1: 終了コード
 SYSCALL(Exit) {
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = CurrentTaskOnCPU();
   return { task.OSStackPointer(), static_cast<int>(arg1) }; // RAX: OS用スタックポインタ, RDX: 終了コード
 }
 
@@ -104,7 +102,7 @@ SYSCALL(OpenWindow) {
     .ID();
   active_layer->Activate(layer_id);
 
-  const auto task_id = task_manager->CurrentTask().ID();
+  const auto task_id = CurrentTaskOnCPU().ID();
   layer_task_map->insert(std::make_pair(layer_id, task_id));
   __asm__("sti");
 
@@ -129,10 +127,13 @@ namespace {
       return res;
     }
 
-    // 再描画抑止フラグが0なら再描画
+    // 再描画抑止フラグが0なら、前回の再描画以降に書き換えられた範囲だけを再描画
     if ((layer_flags & 1) == 0) {
       __asm__("cli");
-      layer_manager->Draw(layer_id);
+      const auto dirty = layer->GetWindow()->TakeDirty();
+      if (dirty.size.x > 0 && dirty.size.y > 0) {
+        layer_manager->Draw(layer_id, dirty);
+      }
       __asm__("sti");
     }
 
@@ -191,48 +192,62 @@ SYSCALL(WinDrawLine) {
   return DoWinFunc(
       [](Window& win,
          int x0, int y0, int x1, int y1, uint32_t color) {
-        auto sign = [](int x) { 
-          return (x > 0) ? 1 :
-                 (x < 0) ? -1 : 0;
-        };
-        const int dx = x1 - x0 + sign(x1 - x0);
-        const int dy = y1 - y0 + sign(y1 - y0);
-
-        if (dx == 0 && dy == 0) {
-          win.Writer()->Write({x0, y0}, ToColor(color));
-          return Result{ 0, 0 };
+        DrawLine(*win.Writer(), {x0, y0}, {x1, y1}, ToColor(color));
+        return Result{ 0, 0 };
+      }, arg1, arg2, arg3, arg4, arg5, arg6);
+}
+
+namespace {
+  // 1 回の呼び出しで受け付ける頂点の最大数
+  const size_t kMaxPolygonPoints = 1024;
+
+  // アプリから渡された頂点列をカーネル側に写す
+  WithError<std::vector<Vector2D<int>>> CopyPoints(const AppPoint* points, size_t n) {
+    if (n > kMaxPolygonPoints) {
+      return { {}, MAKE_ERROR(Error::kIndexOutOfRange) };
+    }
+    std::vector<Vector2D<int>> v(n);
+    for (size_t i = 0; i < n; ++i) {
+      v[i] = {points[i].x, points[i].y};
+    }
+    return { std::move(v), MAKE_ERROR(Error::kSuccess) };
+  }
+}
+
+// ウィンドウに折れ線を描画
+// arg1: [0:31]: レイヤID, [32]: 再描画抑止フラグ
+// arg2: 頂点の配列(AppPoint)
+// arg3: 頂点の数
+// arg4: 色
+SYSCALL(WinDrawPolyline) {
+  return DoWinFunc(
+      [](Window& win,
+         const AppPoint* points, size_t n, uint32_t color) {
+        const auto [ v, err ] = CopyPoints(points, n);
+        if (err) {
+          return Result{ 0, EINVAL };
         }
+        DrawPolyline(*win.Writer(), v.data(), v.size(), ToColor(color));
+        return Result{ 0, 0 };
+      }, arg1, reinterpret_cast<const AppPoint*>(arg2), arg3, arg4);
+}
 
-        const auto floord = static_cast<double(*)(double)>(floor);
-        const auto ceild = static_cast<double(*)(double)>(ceil);
-        
-        if (abs(dx) >= abs(dy)) {
-          // 傾き <= 1
-          if (dx < 0) {
-            std::swap(x0, x1);
-            std::swap(y0, y1);
-          }
-          const auto roundish = y1 >= y0 ? floord : ceild;
-          const double m = static_cast<double>(dy) / dx;
-          for (int x = x0; x <= x1; ++x) {
-            const int y = roundish(m * (x - x0) + y0);
-            win.Writer()->Write({x, y}, ToColor(color));
-          }
-        } else {
-          // 傾き > 1
-          if (dy < 0) {
-            std::swap(x0, x1);
-            std::swap(y0, y1);
-          }
-          const auto roundish = x1 >= x0 ? floord : ceild;
-          const double m = static_cast<double>(dx) / dy;
-          for (int y = y0; y <= y1; ++y) {
-            const int x = roundish(m * (y - y0) + x0);
-            win.Writer()->Write({x, y}, ToColor(color));
-          }
+// ウィンドウに塗りつぶした多角形を描画
+// arg1: [0:31]: レイヤID, [32]: 再描画抑止フラグ
+// arg2: 頂点の配列(AppPoint)
+// arg3: 頂点の数
+// arg4: 色
+SYSCALL(WinFillPolygon) {
+  return DoWinFunc(
+      [](Window& win,
+         const AppPoint* points, size_t n, uint32_t color) {
+        const auto [ v, err ] = CopyPoints(points, n);
+        if (err) {
+          return Result{ 0, EINVAL };
         }
+        FillPolygon(*win.Writer(), v.data(), v.size(), ToColor(color));
         return Result{ 0, 0 };
-      }, arg1, arg2, arg3, arg4, arg5, arg6);
+      }, arg1, reinterpret_cast<const AppPoint*>(arg2), arg3, arg4);
 }
 
 // ウィンドウを閉じる
@@ -246,6 +261,53 @@ SYSCALL(CloseWindow) {
   return { 0, 0 };
 }
 
+bool MessageToAppEvent(const Message& msg, AppEvent& event) {
+  switch (msg.type) {
+  case Message::kKeyPush:
+    if (msg.arg.keyboard.keycode == 20 /* Q key */ &&
+        msg.arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
+      event.type = AppEvent::kQuit;
+      return true;
+    } else {
+      event.type = AppEvent::kKeyPush;
+      event.arg.keypush.modifier = msg.arg.keyboard.modifier;
+      event.arg.keypush.keycode = msg.arg.keyboard.keycode;
+      event.arg.keypush.ascii = msg.arg.keyboard.ascii;
+      event.arg.keypush.press = msg.arg.keyboard.press;
+      return true;
+    }
+  case Message::kMouseMove:
+    event.type = AppEvent::kMouseMove;
+    event.arg.mouse_move.x = msg.arg.mouse_move.x;
+    event.arg.mouse_move.y = msg.arg.mouse_move.y;
+    event.arg.mouse_move.dx = msg.arg.mouse_move.dx;
+    event.arg.mouse_move.dy = msg.arg.mouse_move.dy;
+    event.arg.mouse_move.buttons = msg.arg.mouse_move.buttons;
+    return true;
+  case Message::kMouseButton:
+    event.type = AppEvent::kMouseButton;
+    event.arg.mouse_button.x = msg.arg.mouse_button.x;
+    event.arg.mouse_button.y = msg.arg.mouse_button.y;
+    event.arg.mouse_button.press = msg.arg.mouse_button.press;
+    event.arg.mouse_button.button = msg.arg.mouse_button.button;
+    return true;
+  case Message::kTimerTimeout:
+    if (msg.arg.timer.value < 0) {
+      event.type = AppEvent::kTimerTimeout;
+      event.arg.timer.timeout = msg.arg.timer.timeout;
+      event.arg.timer.value = -msg.arg.timer.value;
+      return true;
+    }
+    break;
+  case Message::kWindowClose:
+    event.type = AppEvent::kQuit;
+    return true;
+  default:
+    break;
+  }
+  return false;
+}
+
 // アプリに送信されたイベントを取得
 // arg1: イベントデータ配列のポインタ
 // arg2: イベントデータ配列の長さ
@@ -256,9 +318,7 @@ SYSCALL(ReadEvent) {
   const auto app_events = reinterpret_cast<AppEvent*>(arg1);
   const size_t len = arg2;
 
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = CurrentTaskOnCPU();
   size_t i = 0;
 
   while (i < len) {
@@ -275,51 +335,9 @@ SYSCALL(ReadEvent) {
       break;
     }
 
-    switch (msg->type) {
-    case Message::kKeyPush:
-      if (msg->arg.keyboard.keycode == 20 /* Q key */ &&
-          msg->arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
-        app_events[i].type = AppEvent::kQuit;
-        ++i;
-      } else {
-        app_events[i].type = AppEvent::kKeyPush;
-        app_events[i].arg.keypush.modifier = msg->arg.keyboard.modifier;
-        app_events[i].arg.keypush.keycode = msg->arg.keyboard.keycode;
-        app_events[i].arg.keypush.ascii = msg->arg.keyboard.ascii;
-        app_events[i].arg.keypush.press = msg->arg.keyboard.press;
-        ++i;
-      }
-      break;
-    case Message::kMouseMove:
-      app_events[i].type = AppEvent::kMouseMove;
-      app_events[i].arg.mouse_move.x = msg->arg.mouse_move.x;
-      app_events[i].arg.mouse_move.y = msg->arg.mouse_move.y;
-      app_events[i].arg.mouse_move.dx = msg->arg.mouse_move.dx;
-      app_events[i].arg.mouse_move.dy = msg->arg.mouse_move.dy;
-      app_events[i].arg.mouse_move.buttons = msg->arg.mouse_move.buttons;
+    if (MessageToAppEvent(*msg, app_events[i])) {
       ++i;
-      break;
-    case Message::kMouseButton:
-      app_events[i].type = AppEvent::kMouseButton;
-      app_events[i].arg.mouse_button.x = msg->arg.mouse_button.x;
-      app_events[i].arg.mouse_button.y = msg->arg.mouse_button.y;
-      app_events[i].arg.mouse_button.press = msg->arg.mouse_button.press;
-      app_events[i].arg.mouse_button.button = msg->arg.mouse_button.button;
-      ++i;
-      break;
-    case Message::kTimerTimeout:
-      if (msg->arg.timer.value < 0) {
-        app_events[i].type = AppEvent::kTimerTimeout;
-        app_events[i].arg.timer.timeout = msg->arg.timer.timeout;
-        app_events[i].arg.timer.value = -msg->arg.timer.value;
-        ++i;
-      }
-      break;
-    case Message::kWindowClose:
-      app_events[i].type = AppEvent::kQuit;
-      ++i;
-      break;
-    default:
+    } else if (msg->type != Message::kTimerTimeout) {
       Log(kInfo, "uncaught event type: %u\n", msg->type);
     }
   }
@@ -338,9 +356,7 @@ SYSCALL(CreateTimer) {
     return { 0, EINVAL };
   }
 
-  __asm__("cli");
-  const uint64_t task_id = task_manager->CurrentTask().ID();
-  __asm__("sti");
+  const uint64_t task_id = CurrentTaskOnCPU().ID();
 
   unsigned long timeout = arg3 * kTimerFreq / 1000;
   if (mode & 1) { // relative
@@ -382,9 +398,7 @@ namespace {
 SYSCALL(OpenFile) {
   const char* path = reinterpret_cast<const char*>(arg1);
   const int flags = arg2;
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = CurrentTaskOnCPU();
 
   // @stdin が指定された場合は標準入力(fd = 0)を返す
   if (strcmp(path, "@stdin") == 0) {
@@ -403,6 +417,8 @@ SYSCALL(OpenFile) {
     file = new_file;
   } else if (file->attr != fat::Attribute::kDirectory && post_slash) {
     return { 0, ENOENT };
+  } else if ((flags & O_TRUNC) && file->attr != fat::Attribute::kDirectory) {
+    fat::TruncateFile(*file);
   }
 
   size_t fd = AllocateFD(task);
@@ -419,9 +435,7 @@ SYSCALL(ReadFile) {
   void* buf = reinterpret_cast<void*>(arg2);
   size_t count = arg3;
 
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = CurrentTaskOnCPU();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return { 0, EBADF };
@@ -434,9 +448,7 @@ SYSCALL(ReadFile) {
 SYSCALL(DemandPages) {
   const size_t num_pages = arg1;
   // const int flags = arg2;
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = CurrentTaskOnCPU();
 
   const uint64_t dp_end = task.DPagingEnd();
   task.SetDPagingEnd(dp_end + 4096 * num_pages);
@@ -451,9 +463,7 @@ SYSCALL(MapFile) {
   const int fd = arg1;
   size_t* file_size = reinterpret_cast<size_t*>(arg2);
   // const int flags = arg3;
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = CurrentTaskOnCPU();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return { 0, EBADF };
@@ -467,13 +477,320 @@ SYSCALL(MapFile) {
   return { vaddr_begin, 0 };
 }
 
+namespace {
+  // 開いているファイルディスクリプタを取得する. 無効な番号なら nullptr を返す
+  ::FileDescriptor* GetFD(Task& task, int fd) {
+    if (fd < 0 || task.Files().size() <= fd) {
+      return nullptr;
+    }
+    return task.Files()[fd].get();
+  }
+
+  // アプリが渡したバッファが、アプリ用のアドレス範囲に収まっているか
+  bool IsAppBuffer(uint64_t addr, size_t len) {
+    return addr >= 0x8000'0000'0000'0000 && addr + len >= addr;
+  }
+}
+
+// ファイルの読み書きオフセットを変更し、変更後のオフセットを返す
+// arg1: ファイルディスクリプタ番号
+// arg2: オフセット
+// arg3: オフセットの基準(SEEK_SET, SEEK_CUR, SEEK_END)
+SYSCALL(LSeek) {
+  const int fd = arg1;
+  const int64_t offset = arg2;
+  const int whence = arg3;
+
+  auto file = GetFD(CurrentTaskOnCPU(), fd);
+  if (file == nullptr) {
+    return { 0, EBADF };
+  }
+  if (file->Type() != FileType::kRegular && file->Type() != FileType::kDirectory) {
+    return { 0, ESPIPE };
+  }
+
+  int64_t base;
+  switch (whence) {
+  case SEEK_SET: base = 0;              break;
+  case SEEK_CUR: base = file->Offset(); break;
+  case SEEK_END: base = file->Size();   break;
+  default:
+    return { 0, EINVAL };
+  }
+
+  // ファイル末尾より後ろへの移動(穴の作成)には対応しない
+  const int64_t new_offset = base + offset;
+  if (new_offset < 0 || new_offset > file->Size()) {
+    return { 0, EINVAL };
+  }
+  file->Seek(new_offset);
+  return { static_cast<uint64_t>(new_offset), 0 };
+}
+
+// オフセットを変更せずに、ファイルの指定位置から読み込む
+// arg1: ファイルディスクリプタ番号
+// arg2: 読み込みバッファ
+// arg3: 読み込むバイト数
+// arg4: 読み込み開始位置のオフセット
+SYSCALL(PRead) {
+  const int fd = arg1;
+  void* buf = reinterpret_cast<void*>(arg2);
+  const size_t count = arg3;
+  const size_t offset = arg4;
+  if (!IsAppBuffer(arg2, count)) {
+    return { 0, EFAULT };
+  }
+
+  auto file = GetFD(CurrentTaskOnCPU(), fd);
+  if (file == nullptr) {
+    return { 0, EBADF };
+  }
+  if (file->Type() != FileType::kRegular) {
+    return { 0, ESPIPE };
+  }
+  return { file->Load(buf, count, offset), 0 };
+}
+
+// オフセットを変更せずに、ファイルの指定位置に書き込む
+// arg1: ファイルディスクリプタ番号
+// arg2: 書き込むデータ
+// arg3: 書き込むバイト数
+// arg4: 書き込み開始位置のオフセット(ファイルサイズ以下)
+SYSCALL(PWrite) {
+  const int fd = arg1;
+  const void* buf = reinterpret_cast<const void*>(arg2);
+  const size_t count = arg3;
+  const size_t offset = arg4;
+  if (!IsAppBuffer(arg2, count)) {
+    return { 0, EFAULT };
+  }
+
+  auto file = GetFD(CurrentTaskOnCPU(), fd);
+  if (file == nullptr) {
+    return { 0, EBADF };
+  }
+  if (file->Type() != FileType::kRegular) {
+    return { 0, ESPIPE };
+  }
+  if (offset > file->Size()) {
+    return { 0, EINVAL };
+  }
+  return { file->Store(buf, count, offset), 0 };
+}
+
+namespace {
+  const int kIOVecMax = 1024;
+
+  template <class Func>
+  Result DoIOVec(uint64_t fd_arg, uint64_t iov_arg, uint64_t iovcnt_arg, Func f) {
+    const int fd = fd_arg;
+    const auto iov = reinterpret_cast<const AppIOVec*>(iov_arg);
+    const int iovcnt = iovcnt_arg;
+    if (iov_arg < 0x8000'0000'0000'0000) {
+      return { 0, EFAULT };
+    }
+    if (iovcnt < 0 || iovcnt > kIOVecMax) {
+      return { 0, EINVAL };
+    }
+    // 読み書きを始める前に、すべてのバッファを確かめる
+    for (int i = 0; i < iovcnt; ++i) {
+      if (!IsAppBuffer(reinterpret_cast<uint64_t>(iov[i].base), iov[i].len)) {
+        return { 0, EFAULT };
+      }
+    }
+
+    auto file = GetFD(CurrentTaskOnCPU(), fd);
+    if (file == nullptr) {
+      return { 0, EBADF };
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      const size_t n = f(*file, iov[i]);
+      total += n;
+      if (n < iov[i].len) {
+        break;
+      }
+    }
+    return { total, 0 };
+  }
+}
+
+// 複数のバッファに順に読み込む
+// arg1: ファイルディスクリプタ番号
+// arg2: AppIOVec の配列
+// arg3: 配列の要素数
+SYSCALL(ReadV) {
+  return DoIOVec(arg1, arg2, arg3, [](::FileDescriptor& file, const AppIOVec& v) {
+    return file.Read(v.base, v.len);
+  });
+}
+
+// 複数のバッファの内容を順に書き込む
+// arg1: ファイルディスクリプタ番号
+// arg2: AppIOVec の配列
+// arg3: 配列の要素数
+SYSCALL(WriteV) {
+  return DoIOVec(arg1, arg2, arg3, [](::FileDescriptor& file, const AppIOVec& v) {
+    return file.Write(v.base, v.len);
+  });
+}
+
+namespace {
+  // FAT の日付と時刻を 1970-01-01 からの秒数にする. 日付が記録されていなければ 0
+  int64_t FATTimeToUnixTime(uint16_t date, uint16_t time) {
+    if (date == 0) {
+      return 0;
+    }
+    int y = 1980 + (date >> 9);
+    const int m = (date >> 5) & 0xf, d = date & 0x1f;
+    // 3 月始まりの暦で 0000-03-01 からの日数を求め、1970-01-01 の日数を引く
+    y -= m <= 2;
+    const int era = y / 400;
+    const int yoe = y - era * 400;
+    const int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const int64_t days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    return days * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3f) * 60 + (time & 0x1f) * 2;
+  }
+}
+
+// ファイルの情報を取得する
+// arg1: ファイルディスクリプタ番号
+// arg2: 情報を書き込む struct stat へのポインタ
+SYSCALL(FStat) {
+  const int fd = arg1;
+  auto st = reinterpret_cast<struct stat*>(arg2);
+  if (arg2 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+
+  auto file = GetFD(CurrentTaskOnCPU(), fd);
+  if (file == nullptr) {
+    return { 0, EBADF };
+  }
+
+  memset(st, 0, sizeof(*st));
+  st->st_nlink = 1;
+  st->st_size = file->Size();
+  st->st_blocks = (file->Size() + 511) / 512;
+  switch (file->Type()) {
+  case FileType::kRegular:
+  case FileType::kDirectory: {
+    // 通常のファイルとディレクトリは FAT 上のファイルなので、エントリの情報も返す
+    const auto& entry = static_cast<fat::FileDescriptor*>(file)->Entry();
+    st->st_mode = file->Type() == FileType::kRegular ? S_IFREG | 0644 : S_IFDIR | 0755;
+    st->st_blksize = fat::bytes_per_cluster;
+    st->st_ino = entry.FirstCluster();
+    st->st_ctime = FATTimeToUnixTime(entry.create_date, entry.create_time);
+    st->st_mtime = FATTimeToUnixTime(entry.write_date, entry.write_time);
+    st->st_atime = FATTimeToUnixTime(entry.last_access_date, 0);
+    break;
+  }
+  case FileType::kTerminal:
+    st->st_mode = S_IFCHR | 0620;
+    st->st_blksize = 1024;
+    break;
+  case FileType::kPipe:
+    st->st_mode = S_IFIFO | 0600;
+    st->st_blksize = 1024;
+    break;
+  }
+  return { 0, 0 };
+}
+
+// io ring を作成し、共有領域の先頭アドレスを返す
+// arg1: サブミッションキューの要素数(2 のべき乗)
+// arg2: 読み書きに使うデータ領域のバイト数
+SYSCALL(IORingSetup) {
+  auto [ addr, err ] = SetupIORing(CurrentTaskOnCPU(), arg1, arg2);
+  switch (err.Cause()) {
+    case Error::kSuccess: return { addr, 0 };
+    case Error::kAlreadyAllocated: return { 0, EEXIST };
+    case Error::kIndexOutOfRange: return { 0, EINVAL };
+    default: return { 0, ENOMEM };
+  }
+}
+
+// io ring に積んだ操作の処理をワーカーに依頼し、指定数の完了を待つ
+// arg1: 待つ完了の数(CQ 上の未回収の CQE の数)
+// 完了しうる操作が残っていなければ、指定数に満たなくても戻る
+// 未回収の CQE の数を返す
+SYSCALL(IORingEnter) {
+  auto& task = CurrentTaskOnCPU();
+  const auto ring = task.Ring();
+  if (!ring) {
+    return { 0, EBADF };
+  }
+  // CQ が満杯になると処理が進まないので、CQ の要素数より多くは待たない
+  const uint32_t min_complete = std::min<uint64_t>(arg1, ring->CQEntries());
+
+  __asm__("cli");
+  WakeupIORingWorker();
+  while (ring->Completions() < min_complete && !ring->Idle()) {
+    task.Sleep();
+    __asm__("cli");
+  }
+  const auto n = ring->Completions();
+  __asm__("sti");
+  return { n, 0 };
+}
+
+// ディレクトリ内のエントリの情報を、1 回の呼び出しでまとめて取得する
+// arg1: ディレクトリのパス. "/" または空文字列ならルートディレクトリ
+// arg2: 情報を書き込む AppDirEntry の配列
+// arg3: 配列の要素数
+// arg4: 何番目のエントリから取得するか. 前回までに取得した数を渡すと続きが得られる
+// 取得したエントリの数を返す. 0 ならディレクトリの末尾に達している
+// "." と ".." のエントリも含む
+SYSCALL(ReadDir) {
+  const char* path = reinterpret_cast<const char*>(arg1);
+  auto entries = reinterpret_cast<AppDirEntry*>(arg2);
+  const size_t count = arg3;
+  const size_t offset = arg4;
+  if (arg1 < 0x8000'0000'0000'0000 || arg2 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+
+  unsigned long dir_cluster = fat::boot_volume_image->root_cluster;
+  if (path[0] != '\0' && strcmp(path, "/") != 0) {
+    auto [ dir, post_slash ] = fat::FindFile(path);
+    if (dir == nullptr) {
+      return { 0, ENOENT };
+    } else if (dir->attr != fat::Attribute::kDirectory) {
+      return { 0, ENOTDIR };
+    }
+    // ".." がルートディレクトリを指すときは、クラスタ番号が 0 になっている
+    if (dir->FirstCluster() != 0) {
+      dir_cluster = dir->FirstCluster();
+    }
+  }
+
+  // エントリの並びと名前はディレクトリの索引から取るので、ディレクトリを読み直さない
+  const auto list = fat::ListDirectory(dir_cluster);
+  size_t n = 0;
+  for (size_t i = offset; i < list.size() && n < count; ++i, ++n) {
+    const auto& entry = *list[i];
+    auto& dest = entries[n];
+    memset(&dest, 0, sizeof(dest));
+    const auto name = fat::GetName(entry);
+    strncpy(dest.name, name.c_str(), sizeof(dest.name) - 1);
+    dest.size = entry.file_size;
+    dest.first_cluster = entry.FirstCluster();
+    dest.attr = static_cast<uint8_t>(entry.attr);
+    dest.create_time = FATTimeToUnixTime(entry.create_date, entry.create_time);
+    dest.write_time = FATTimeToUnixTime(entry.write_date, entry.write_time);
+    dest.access_time = FATTimeToUnixTime(entry.last_access_date, 0);
+  }
+  return { n, 0 };
+}
+
 #undef SYSCALL
 
 } // namespace syscall
 
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t,
                                  uint64_t, uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType*, 16> syscall_table{
+extern "C" std::array<SyscallFuncType*, 0x1b> syscall_table{
   /* 0x00 */ syscall::LogString,
   /* 0x01 */ syscall::PutString,
   /* 0x02 */ syscall::Exit,
@@ -490,5 +807,147 @@ extern "C" std::array<SyscallFuncType*, 16> syscall_table{
   /* 0x0d */ syscall::ReadFile,
   /* 0x0e */ syscall::DemandPages,
   /* 0x0f */ syscall::MapFile,
+  /* 0x10 */ syscall::LSeek,
+  /* 0x11 */ syscall::PRead,
+  /* 0x12 */ syscall::PWrite,
+  /* 0x13 */ syscall::ReadV,
+  /* 0x14 */ syscall::WriteV,
+  /* 0x15 */ syscall::FStat,
+  /* 0x16 */ syscall::IORingSetup,
+  /* 0x17 */ syscall::IORingEnter,
+  /* 0x18 */ syscall::WinDrawPolyline,
+  /* 0x19 */ syscall::WinFillPolygon,
+  /* 0x1a */ syscall::ReadDir,
 };
 
+
+namespace {
+  const std::array<const char*, syscall_table.size()> kSyscallNames{
+    "LogString", "PutString", "Exit", "OpenWindow",
+    "WinWriteString", "WinFillRectangle", "GetCurrentTick", "WinRedraw",
+    "WinDrawLine", "CloseWindow", "ReadEvent", "CreateTimer",
+    "OpenFile", "ReadFile", "DemandPages", "MapFile",
+    "LSeek", "PRead", "PWrite", "ReadV",
+    "WriteV", "FStat", "IORingSetup", "IORingEnter",
+    "WinDrawPolyline", "WinFillPolygon", "ReadDir",
+  };
+
+  syscall::TraceBuffer* trace_buffer;
+  // トレース中のタスクごとの、システムコール番号別の集計
+  std::map<uint64_t, std::map<uint64_t, syscall::TraceStat>>* trace_stats;
+
+  int TraceBucket(uint64_t cycles) {
+    if (cycles < 4) {
+      return cycles;
+    }
+    const int msb = 63 - __builtin_clzll(cycles);
+    return (msb - 1) * 4 + ((cycles >> (msb - 2)) & 3);
+  }
+
+  uint64_t TraceBucketUpperBound(int bucket) {
+    if (bucket < 4) {
+      return bucket;
+    }
+    const int msb = bucket / 4 + 1;
+    const uint64_t width = uint64_t{1} << (msb - 2);
+    return (4 + bucket % 4) * width + width - 1;
+  }
+}
+
+namespace syscall {
+  void TraceBuffer::Push(const TraceRecord& record) {
+    records_[head_] = record;
+    head_ = (head_ + 1) % kCapacity;
+    if (size_ < kCapacity) {
+      ++size_;
+    }
+  }
+
+  void TraceStat::Add(uint64_t cycles, bool error) {
+    ++calls;
+    if (error) {
+      ++errors;
+    }
+    total_cycles += cycles;
+    max_cycles = std::max(max_cycles, cycles);
+    ++histogram[TraceBucket(cycles)];
+  }
+
+  uint64_t TraceStat::Percentile(int p) const {
+    const uint64_t threshold = (calls * p + 99) / 100;
+    uint64_t count = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      count += histogram[i];
+      if (count >= threshold && count > 0) {
+        return std::min(TraceBucketUpperBound(i), max_cycles);
+      }
+    }
+    return max_cycles;
+  }
+
+  void StartTrace(uint64_t task_id) {
+    __asm__("cli");
+    if (trace_buffer == nullptr) {
+      trace_buffer = new TraceBuffer;
+      trace_stats = new std::map<uint64_t, std::map<uint64_t, TraceStat>>;
+    }
+    (*trace_stats)[task_id].clear();
+    per_cpu_data.syscall_trace = trace_buffer;
+    __asm__("sti");
+  }
+
+  std::map<uint64_t, TraceStat> StopTrace(uint64_t task_id) {
+    std::map<uint64_t, TraceStat> stats;
+    __asm__("cli");
+    if (auto it = trace_stats->find(task_id); it != trace_stats->end()) {
+      stats = std::move(it->second);
+      trace_stats->erase(it);
+    }
+    if (trace_stats->empty()) {
+      per_cpu_data.syscall_trace = nullptr;
+    }
+    __asm__("sti");
+    return stats;
+  }
+
+  std::vector<TraceRecord> RecentErrors(uint64_t task_id, size_t max) {
+    if (trace_buffer == nullptr) {
+      return {};
+    }
+    __asm__("cli");
+    auto records = trace_buffer->Recent(
+        task_id, max, [](const TraceRecord& rec) { return rec.error != 0; });
+    __asm__("sti");
+    return records;
+  }
+
+  const char* Name(uint64_t number) {
+    if (number >= kSyscallNames.size()) {
+      return "(unknown)";
+    }
+    return kSyscallNames[number];
+  }
+}
+
+// トレースが有効なときに SyscallEntry から呼び出される
+// システムコールの所要時間と結果を per-CPU のトレースバッファと集計に記録する
+extern "C" syscall::Result SyscallTraced(
+    uint64_t arg1, uint64_t arg2, uint64_t arg3,
+    uint64_t arg4, uint64_t arg5, uint64_t arg6, uint64_t number) {
+  const uint64_t task_id = CurrentTaskOnCPU().ID();
+  const uint64_t begin = ReadTSC();
+  const auto res = syscall_table[number](arg1, arg2, arg3, arg4, arg5, arg6);
+  const uint64_t cycles = ReadTSC() - begin;
+
+  __asm__("cli");
+  auto trace = per_cpu_data.syscall_trace;
+  auto it = trace_stats->find(task_id);
+  if (trace && it != trace_stats->end()) {
+    trace->Push(syscall::TraceRecord{
+        task_id, number, {arg1, arg2, arg3, arg4, arg5, arg6},
+        cycles, res.value, res.error});
+    it->second[number].Add(cycles, res.error != 0);
+  }
+  __asm__("sti");
+  return res;
+}
@@ -1,3 +1,88 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include "message.hpp"
+#include "app_event.hpp"
+
 void InitializeSyscall();
+
+namespace syscall {
+  struct Result {
+    uint64_t value;
+    int error;
+  };
+
+  // io ring のワーカータスクからも利用するシステムコール
+  Result WinWriteString(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                        uint64_t arg4, uint64_t arg5, uint64_t arg6);
+  Result WinFillRectangle(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                          uint64_t arg4, uint64_t arg5, uint64_t arg6);
+  Result WinRedraw(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                   uint64_t arg4, uint64_t arg5, uint64_t arg6);
+
+  // アプリに通知すべきメッセージなら AppEvent に変換して true を返す
+  bool MessageToAppEvent(const Message& msg, AppEvent& event);
+
+  // システムコール1回分のトレース記録
+  struct TraceRecord {
+    uint64_t task_id;
+    uint64_t number;
+    std::array<uint64_t, 6> args;
+    uint64_t cycles;  // 所要時間(TSC のサイクル数)
+    uint64_t value;
+    int error;
+  };
+
+  // CPU ごとに持つトレース記録のリングバッファ
+  // 満杯になったら古い記録から上書きする
+  class TraceBuffer {
+    public:
+      static const size_t kCapacity = 1024;
+
+      void Push(const TraceRecord& record);
+      // 指定タスクの記録のうち、条件を満たす新しいものから最大 max 件を古い順に返す
+      template <class Pred>
+      std::vector<TraceRecord> Recent(uint64_t task_id, size_t max, Pred pred) const {
+        std::vector<TraceRecord> result;
+        for (size_t i = 0; i < size_ && result.size() < max; ++i) {
+          const auto& rec = records_[(head_ + kCapacity - 1 - i) % kCapacity];
+          if (rec.task_id == task_id && pred(rec)) {
+            result.insert(result.begin(), rec);
+          }
+        }
+        return result;
+      }
+
+    private:
+      std::array<TraceRecord, kCapacity> records_;
+      size_t head_{0}, size_{0};
+  };
+
+  // システムコール番号ごとの集計結果
+  struct TraceStat {
+    // 所要サイクル数のヒストグラムの区間数
+    // 2 のべき乗ごとの区間をさらに 4 等分する
+    static const int kNumBuckets = 256;
+
+    uint64_t calls, errors, total_cycles, max_cycles;
+    std::array<uint32_t, kNumBuckets> histogram;
+
+    void Add(uint64_t cycles, bool error);
+    // 所要サイクル数の p パーセンタイル値(の上限)を返す
+    uint64_t Percentile(int p) const;
+  };
+
+  // 指定タスクのシステムコールのトレースを開始する
+  void StartTrace(uint64_t task_id);
+  // 指定タスクのトレースを終了し、システムコール番号ごとの集計を返す
+  std::map<uint64_t, TraceStat> StopTrace(uint64_t task_id);
+  // 指定タスクの直近のエラーになったシステムコールを返す
+  std::vector<TraceRecord> RecentErrors(uint64_t task_id, size_t max);
+  // システムコール番号から名前を得る
+  const char* Name(uint64_t number);
+}
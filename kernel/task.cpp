@@ -2,6 +2,7 @@
 #include "timer.hpp"
 #include "asmfunc.h"
 #include "segment.hpp"
+#include "io_ring.hpp"
 
 /**
  * Task
@@ -56,6 +57,10 @@ uint64_t& Task::OSStackPointer() {
 void Task::SendMessage(const Message& msg) {
   msgs_.push_back(msg);
   Wakeup();
+  if (io_ring_) {
+    // io ring でイベントを待っている操作があるかもしれない
+    WakeupIORingWorker();
+  }
 }
 
 std::optional<Message> Task::ReceiveMessage() {
@@ -115,6 +120,7 @@ TaskManager::TaskManager() {
     .SetLevel(current_level_)
     .SetRunning(true);
   running_[current_level_].push_back(&task);
+  SetCurrentTaskOnCPU();
 
   // 全タスクがスリープ中になる状況を防ぐため、アイドルタスクを入れておく
   Task& idle = NewTask()
@@ -134,6 +140,7 @@ void TaskManager::SwitchTask(const TaskContext& current_ctx) {
   memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
   Task* current_task = RotateCurrentRunQueue(false);
   if (&CurrentTask() != current_task) {
+    SetCurrentTaskOnCPU();
     RestoreContext(&CurrentTask().Context());
   }
 }
@@ -159,6 +166,7 @@ void TaskManager::Sleep(Task* task) {
   
   if (task == running_[current_level_].front()) {
     Task* current_task = RotateCurrentRunQueue(true);
+    SetCurrentTaskOnCPU();
     SwitchContext(&CurrentTask().Context(), &current_task->Context());
     return;
   }
@@ -301,10 +309,20 @@ void TaskManager::Finish(int exit_code) {
     Wakeup(waiter);
   }
 
+  SetCurrentTaskOnCPU();
   RestoreContext(&CurrentTask().Context());
 }
 
+// 実行キューの先頭のタスクを per-CPU 領域に書き込む
+// コンテキストを切り替える直前に、割り込み禁止状態で呼び出すこと
+void TaskManager::SetCurrentTaskOnCPU() {
+  Task* task = running_[current_level_].front();
+  per_cpu_data.current_task = task;
+  per_cpu_data.os_stack_ptr = &task->OSStackPointer();
+}
+
 TaskManager* task_manager;
+PerCPUData per_cpu_data;
 
 void InitializeTask() {
   task_manager = new TaskManager;
@@ -313,8 +331,3 @@ void InitializeTask() {
   timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1});
   __asm__("sti");
 }
-
-__attribute__((no_caller_saved_registers))
-extern "C" uint64_t GetCurrentTaskOSStackPointer() {
-  return task_manager->CurrentTask().OSStackPointer();
-}
@@ -11,6 +11,7 @@
 #include <cstdint>
 #include <cstddef>
 #include <map>
+#include <algorithm>
 
 // タスクコンテキストの保存先
 struct TaskContext {
@@ -29,6 +30,7 @@ using TaskFunc = void (uint64_t, int64_t);
 
 struct FileMapping;
 class TaskManager;
+class IORing;
 
 // タスクを表すクラス
 class Task {
@@ -46,6 +48,21 @@ class Task {
 
     void SendMessage(const Message& msg);
     std::optional<Message> ReceiveMessage();
+    // 条件を満たす最初のメッセージを取り出す. 他のメッセージの順序は保たれる
+    template <class Pred>
+    std::optional<Message> ReceiveMessageIf(Pred pred) {
+      auto it = std::find_if(msgs_.begin(), msgs_.end(), pred);
+      if (it == msgs_.end()) {
+        return std::nullopt;
+      }
+      auto m = *it;
+      msgs_.erase(it);
+      return m;
+    }
+    template <class Pred>
+    bool HasMessageIf(Pred pred) const {
+      return std::any_of(msgs_.begin(), msgs_.end(), pred);
+    }
 
     int Level() const { return level_; }
     bool Running() const { return running_; }
@@ -61,6 +78,9 @@ class Task {
     void SetFileMapEnd(uint64_t v);
     std::vector<FileMapping>& FileMaps();
 
+    // アプリが作成した io ring (作成していなければ nullptr)
+    std::shared_ptr<::IORing>& Ring() { return io_ring_; }
+
   private:
     uint64_t id_;
     std::vector<uint64_t> stack_;
@@ -75,6 +95,7 @@ class Task {
     uint64_t dpaging_begin_{0}, dpaging_end_{0};
     uint64_t file_map_end_{0};
     std::vector<FileMapping> file_maps_{};
+    std::shared_ptr<::IORing> io_ring_{};
 
     Task& SetLevel(int level) { level_ = level; return *this; }
     Task& SetRunning(bool running) { running_ = running; return *this; }
@@ -113,10 +134,32 @@ class TaskManager {
 
     void ChangeLevelRunning(Task* task, int level);
     Task* RotateCurrentRunQueue(bool current_sleep);
+    void SetCurrentTaskOnCPU();
 };
 
 extern TaskManager* task_manager;
 
+namespace syscall {
+  class TraceBuffer;
+}
+
+// CPU ごとのデータを置く領域. CPU は 1 つなので、グローバル変数として置く
+// GS ベースはアプリが GS セレクタをロードすると書き換わるので、この領域の参照には使わない
+// asmfunc.asm からオフセットを直接指定して参照しているので、メンバの並びを変えるときは注意
+struct PerCPUData {
+  Task* current_task;     // 0x00 実行中のタスク
+  uint64_t* os_stack_ptr; // 0x08 実行中のタスクのOS用スタックポインタの保存先
+  syscall::TraceBuffer* syscall_trace; // 0x10 システムコールのトレース先(トレースしないときは nullptr)
+} __attribute__((packed));
+
+extern PerCPUData per_cpu_data;
+
+// 実行中のタスクを per-CPU 領域から取得する
+// 1命令で読み出せるので、CurrentTask() と違って割り込みを禁止しなくてよい
+inline Task& CurrentTaskOnCPU() {
+  return *per_cpu_data.current_task;
+}
+
 // ファイルマッピングを表現する
 // ファイルが仮想アドレスのどの範囲にマップされているかの情報を持つ
 struct FileMapping {
@@ -1,5 +1,6 @@
 #include "terminal.hpp"
 
+#include <cstdlib>
 #include <cstring>
 #include <limits>
 
@@ -11,6 +12,9 @@
 #include "logger.hpp"
 #include "timer.hpp"
 #include "keyboard.hpp"
+#include "syscall.hpp"
+#include "io_ring.hpp"
+#include "block_cache.hpp"
 
 namespace {
   // コマンドライン引数の列を argv が指す場所に構築
@@ -151,25 +155,9 @@ namespace {
   }
 
   void ListAllEntries(FileDescriptor& fd, uint32_t dir_cluster) {
-    const auto kEntriesPerCluster = fat::bytes_per_cluster / sizeof(fat::DirectoryEntry);
-
-    while (dir_cluster != fat::kEndOfClusterchain) {
-      auto dir = fat::GetSectorByCluster<fat::DirectoryEntry>(dir_cluster);
-
-      for (int i = 0; i < kEntriesPerCluster; ++i) {
-        if (dir[i].name[0] == 0x00) {
-          return;
-        } else if (static_cast<uint8_t>(dir[i].name[0]) == 0xe5) {
-          continue;
-        } else if (dir[i].attr == fat::Attribute::kLongName) {
-          continue;
-        }
-
-        char name[13];
-        fat::FormatName(dir[i], name);
-        PrintToFD(fd, "%s\n", name);
-      }
-      dir_cluster = fat::NextCluster(dir_cluster);
+    // 名前はディレクトリの索引にキャッシュされたものを使う
+    for (auto entry : fat::ListDirectory(dir_cluster)) {
+      PrintToFD(fd, "%s\n", fat::GetName(*entry).c_str());
     }
   }
 
@@ -191,6 +179,31 @@ namespace {
   }
 }
 
+namespace {
+  // trace コマンドの結果を表形式で出力する
+  void PrintSyscallTrace(FileDescriptor& fd,
+                         const std::map<uint64_t, syscall::TraceStat>& stats,
+                         const std::vector<syscall::TraceRecord>& errors) {
+    PrintToFD(fd, "%-16s %7s %6s %12s %8s %8s\n",
+              "syscall", "calls", "errors", "total(cyc)", "mean", "p99");
+    uint64_t calls = 0, total_errors = 0, total_cycles = 0;
+    for (const auto& [number, stat] : stats) {
+      PrintToFD(fd, "%-16s %7lu %6lu %12lu %8lu %8lu\n",
+                syscall::Name(number), stat.calls, stat.errors, stat.total_cycles,
+                stat.total_cycles / stat.calls, stat.Percentile(99));
+      calls += stat.calls;
+      total_errors += stat.errors;
+      total_cycles += stat.total_cycles;
+    }
+    PrintToFD(fd, "%-16s %7lu %6lu %12lu\n", "total", calls, total_errors, total_cycles);
+
+    for (const auto& rec : errors) {
+      PrintToFD(fd, "%s(%#lx, %#lx, %#lx) -> error %d\n",
+                syscall::Name(rec.number), rec.args[0], rec.args[1], rec.args[2], rec.error);
+    }
+  }
+}
+
 Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc)
     : task_{task} {
   if (term_desc) {
@@ -287,7 +300,7 @@ Rectangle<int> Terminal::InputKey(uint8_t modifier, uint8_t keycode, char ascii)
       linebuf_[linebuf_index_] = ascii;
       ++linebuf_index_;
       if (show_window_) {
-        WriteAscii(*window_->Writer(), CalcCursorPos(), ascii, {255, 255, 255});
+        WriteAscii(*window_->Writer(), CalcCursorPos(), ascii, {255, 255, 255}, {0, 0, 0});
       }
       ++cursor_.x;
     }
@@ -317,13 +330,13 @@ void Terminal::Print(char32_t c) {
     if (cursor_.x == kColumns) {
       newline();
     }
-    WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
+    WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255}, {0, 0, 0});
     ++cursor_.x;
   } else {
     if (cursor_.x >= kColumns - 1) {
       newline();
     }
-    WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
+    WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255}, {0, 0, 0});
     cursor_.x += 2;
   }
 }
@@ -366,6 +379,16 @@ void Terminal::Redraw() {
 }
 
 void Terminal::ExecuteLine() {
+  // "time <コマンドライン>" なら、コマンドラインの実行にかかった時間を表示する
+  if (strncmp(&linebuf_[0], "time ", 5) == 0) {
+    memmove(&linebuf_[0], &linebuf_[5], kLineMax - 5);
+    const auto start = timer_manager->CurrentTick();
+    ExecuteLine();
+    const auto elapsed = timer_manager->CurrentTick() - start;
+    PrintToFD(*files_[2], "real %lu ms\n", elapsed * 1000 / kTimerFreq);
+    return;
+  }
+
   char* command = &linebuf_[0];
   char* first_arg = strchr(&linebuf_[0], ' ');
   char* redir_char = strchr(&linebuf_[0], '>');
@@ -400,6 +423,8 @@ void Terminal::ExecuteLine() {
     } else if (file->attr == fat::Attribute::kDirectory || post_slash) {
       PrintToFD(*files_[2], "cannot redirect to a direcory\n");
       return;
+    } else {
+      fat::TruncateFile(*file); // 既存のファイルへのリダイレクトでは、内容を切り詰めてから書き込む
     }
     files_[1] = std::make_shared<fat::FileDescriptor>(*file);
   }
@@ -468,14 +493,13 @@ void Terminal::ExecuteLine() {
       } else if (dir->attr == fat::Attribute::kDirectory) {
         ListAllEntries(*files_[1], dir->FirstCluster());
       } else {
-        char name[13];
-        fat::FormatName(*dir, name);
+        const auto name = fat::GetName(*dir);
         if (post_slash) {
           // ファイルなのにディレクトリとして検索された場合
-          PrintToFD(*files_[2], "%s is not a directory\n", name);
+          PrintToFD(*files_[2], "%s is not a directory\n", name.c_str());
           exit_code = 1;
         } else {
-          PrintToFD(*files_[1], "%s\n", name);
+          PrintToFD(*files_[1], "%s\n", name.c_str());
         }
       }
     }
@@ -490,9 +514,8 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[2], "no such file: %s\n", first_arg);
         exit_code = 1;
       } else if (file_entry->attr != fat::Attribute::kDirectory && post_slash) {
-        char name[13];
-        fat::FormatName(*file_entry, name);
-        PrintToFD(*files_[2], "%s is not a directory\n", name);
+        PrintToFD(*files_[2], "%s is not a directory\n",
+                  fat::GetName(*file_entry).c_str());
         exit_code = 1;
       } else {
         fd = std::make_shared<fat::FileDescriptor>(*file_entry);
@@ -505,7 +528,11 @@ void Terminal::ExecuteLine() {
         if (ReadDelim(*fd, '\n', u8buf, sizeof(u8buf)) == 0) {
           break;
         }
-        PrintToFD(*files_[1], "%s", u8buf);
+        // パイプの読み込み側が閉じられて書き込めなくなったらやめる
+        const size_t len = strlen(u8buf);
+        if (files_[1]->Write(u8buf, len) < len) {
+          break;
+        }
       }
       DrawCursor(true);
     }
@@ -518,6 +545,22 @@ void Terminal::ExecuteLine() {
       .InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
       .Wakeup();
   }
+  else if (strcmp(command, "sync") == 0) {
+    // ファイルシステムが記録した変更を書き戻した後、ブロックキャッシュ上の残りの書き換えも書き戻す
+    if (block_cache == nullptr) {
+      PrintToFD(*files_[2], "block cache is not available\n");
+      exit_code = 1;
+    } else if (auto [ fs_written, fs_err ] = fat::Flush(); fs_err) {
+      PrintToFD(*files_[2], "sync failed: %s\n", fs_err.Name());
+      exit_code = 1;
+    } else if (auto [ written, err ] = block_cache->Flush(); err) {
+      PrintToFD(*files_[2], "sync failed: %s\n", err.Name());
+      exit_code = 1;
+    } else {
+      PrintToFD(*files_[1], "%lu pages written (%lu pages cached)\n",
+          fs_written + written, block_cache->NumResidentPages());
+    }
+  }
   else if (strcmp(command, "memstat") == 0 ) {
     const auto p_stat = memory_manager->Stat();
 
@@ -527,6 +570,130 @@ void Terminal::ExecuteLine() {
     PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n",
         p_stat.total_frames,
         p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+
+    // ウィンドウのピクセルはシャドウバッファだけに持つ
+    // 以前は PixelColor の2次元配列(行ごとに vector 1つ)にも同じ内容を持っていた
+    __asm__("cli");
+    const auto w_stat = GetWindowStat();
+    __asm__("sti");
+    const size_t saved_bytes =
+      w_stat.pixels * sizeof(PixelColor) + w_stat.rows * sizeof(std::vector<PixelColor>);
+    PrintToFD(*files_[1], "Windows   : %lu windows, %lu KiB in shadow buffers\n",
+        w_stat.windows, w_stat.pixels * 4 / 1024);
+    PrintToFD(*files_[1], "Saved     : %lu KiB (%lu KiB per window)\n",
+        saved_bytes / 1024,
+        w_stat.windows ? saved_bytes / w_stat.windows / 1024 : 0);
+  }
+  else if (strcmp(command, "framestat") == 0) {
+    // 画面描画の統計を表示. "framestat reset" で統計をリセットする
+    __asm__("cli");
+    const auto stat = layer_manager->GetFrameStat();
+    if (first_arg && strcmp(first_arg, "reset") == 0) {
+      layer_manager->ResetFrameStat();
+    }
+    __asm__("sti");
+
+    const auto us = [](uint64_t cycles) { return cycles * 1000'000 / tsc_freq; };
+    PrintToFD(*files_[1], "frames     : %lu (budget %lu us)\n",
+        stat.frames, us(tsc_freq / kFrameRate));
+    PrintToFD(*files_[1], "rects      : %lu (%lu damaged areas)\n",
+        stat.rects, stat.damage_adds);
+    if (stat.frames > 0) {
+      PrintToFD(*files_[1], "flush avg  : %lu us\n", us(stat.total_cycles / stat.frames));
+      PrintToFD(*files_[1], "flush max  : %lu us\n", us(stat.max_cycles));
+    }
+    PrintToFD(*files_[1], "over budget: %lu frames\n", stat.over_budget);
+  }
+  else if (strcmp(command, "fbbench") == 0) {
+    // 画面全体のコピーの速度を、フレームバッファを write-back にした場合と
+    // write-combining にした場合とで測る. "fbbench N" でコピーの回数を指定する
+    int count = first_arg ? atoi(first_arg) : 0;
+    if (count <= 0) {
+      count = 30;
+    }
+
+    FrameBuffer screen, src;
+    FrameBufferConfig src_config = screen_config;
+    src_config.frame_buffer = nullptr;
+    if (auto err = screen.Initialize(screen_config)) {
+      PrintToFD(*files_[2], "failed to initialize screen: %s\n", err.Name());
+      return;
+    }
+    if (auto err = src.Initialize(src_config)) {
+      PrintToFD(*files_[2], "failed to initialize buffer: %s\n", err.Name());
+      return;
+    }
+
+    const auto fb_addr = reinterpret_cast<uint64_t>(screen_config.frame_buffer);
+    const uint64_t fb_bytes = 4ull * screen_config.pixels_per_scan_line * screen_config.vertical_resolution;
+    const Rectangle<int> screen_area{{0, 0}, ScreenSize()};
+    const uint64_t copy_bytes = 4ull * screen_area.size.x * screen_area.size.y * count;
+
+    for (bool wc : {false, true}) {
+      if (auto err = SetWriteCombining(fb_addr, fb_bytes, wc)) {
+        PrintToFD(*files_[2], "cannot change memory type: %s\n", err.Name());
+        break;
+      }
+      const auto start = ReadTSC();
+      for (int i = 0; i < count; ++i) {
+        screen.Copy({0, 0}, src, screen_area);
+      }
+      const auto us = std::max<uint64_t>((ReadTSC() - start) * 1000'000 / tsc_freq, 1);
+      PrintToFD(*files_[1], "%-15s: %lu MB/s (%d copies in %lu us)\n",
+          wc ? "write-combining" : "write-back", copy_bytes / us, count, us);
+    }
+
+    // 測定中に上書きした画面を描き直す
+    __asm__("cli");
+    layer_manager->DrawAll();
+    __asm__("sti");
+  }
+  else if (strcmp(command, "glyphstat") == 0) {
+    // グリフキャッシュの統計を表示. "glyphstat reset" で統計をリセットする
+    const auto stat = GetGlyphCacheStat();
+    if (first_arg && strcmp(first_arg, "reset") == 0) {
+      ResetGlyphCacheStat();
+    }
+
+    const uint64_t lookups = stat.hits + stat.misses;
+    PrintToFD(*files_[1], "entries  : %lu / %lu\n", stat.entries, stat.capacity);
+    PrintToFD(*files_[1], "hits     : %lu\n", stat.hits);
+    PrintToFD(*files_[1], "misses   : %lu\n", stat.misses);
+    PrintToFD(*files_[1], "evictions: %lu\n", stat.evictions);
+    if (lookups > 0) {
+      PrintToFD(*files_[1], "hit rate : %lu.%lu %%\n",
+          stat.hits * 100 / lookups, stat.hits * 1000 / lookups % 10);
+    }
+  }
+  else if (strcmp(command, "trace") == 0) {
+    char* sub_command = first_arg;
+    char* sub_arg = sub_command ? strchr(sub_command, ' ') : nullptr;
+    if (sub_arg) {
+      *sub_arg = 0;
+      do {
+        ++sub_arg;
+      } while (isspace(*sub_arg));
+    }
+
+    fat::DirectoryEntry* file_entry = nullptr;
+    if (!sub_command || sub_command[0] == 0) {
+      PrintToFD(*files_[2], "Usage: trace <command> [args...]\n");
+      exit_code = 1;
+    } else if (file_entry = FindCommand(sub_command); !file_entry) {
+      PrintToFD(*files_[2], "no such command: %s\n", sub_command);
+      exit_code = 1;
+    } else {
+      syscall::StartTrace(task_.ID());
+      auto [ ec, err ] = ExecuteFile(*file_entry, sub_command, sub_arg);
+      const auto stats = syscall::StopTrace(task_.ID());
+      if (err) {
+        PrintToFD(*files_[2], "failed to exec file: %s\n", err.Name());
+        exit_code = -ec;
+      } else {
+        exit_code = ec;
+      }
+      PrintSyscallTrace(*files_[2], stats, syscall::RecentErrors(task_.ID(), 5));
+    }
   }
   else if (command[0] != 0) {
     auto file_entry = FindCommand(command);
@@ -651,6 +818,8 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
   auto entry_addr = app_load.entry;
   int ret = CallApp(argc.value,  argv, 3 << 3 | 3, entry_addr, stack_frame_addr.value + stack_size - 8, &task.OSStackPointer()); 
 
+  // io ring の共有領域は CleanPageMaps で解放されるので、先にワーカーから切り離す
+  ReleaseIORing(task);
   task.Files().clear();
   task.FileMaps().clear();
 
@@ -704,7 +873,7 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
   strcpy(&linebuf_[0], history);
   linebuf_index_ = strlen(history);
 
-  WriteString(*window_->Writer(), first_pos, history, {255, 255, 255});
+  WriteString(*window_->Writer(), first_pos, history, {255, 255, 255}, {0, 0, 0});
   cursor_.x = linebuf_index_ + 1;
   return draw_area;
 }
@@ -734,6 +903,10 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
   }
 
   if (term_desc && term_desc->exit_after_command) {
+    // パイプの読み手として終了する場合は、書き手が待ち続けないようにする
+    if (auto& in = term_desc->files[0]; in && in->Type() == FileType::kPipe) {
+      static_cast<PipeDescriptor&>(*in).FinishRead();
+    }
     delete term_desc;
     __asm__("cli");
     task_manager->Finish(terminal->LastExitCode());
@@ -845,64 +1018,92 @@ std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
 /**
  * PipeDescriptor
  */
-PipeDescriptor::PipeDescriptor(Task& task) : task_{task} {}
+PipeDescriptor::PipeDescriptor(Task& task, size_t capacity)
+    : reader_{&task}, buf_(capacity) {}
 
 size_t PipeDescriptor::Read(void* buf, size_t len) {
-  if (len_ > 0) {
-    const size_t copy_bytes = std::min(len_, len);
-    memcpy(buf, data_, copy_bytes);
-    len_ -= copy_bytes;
-    memmove(data_, &data_[copy_bytes], len_);
-    return copy_bytes;
-  }
-  if (closed_) {
-    return 0;
-  }
-  while (true) {
-    __asm__("cli");
-    auto msg = task_.ReceiveMessage();
-    if (!msg) {
-      task_.Sleep();
-      continue;
-    }
-    __asm__("sti");
-
-    if (msg->type != Message::kPipe) {
-      continue;
-    }
-
-    if (msg->arg.pipe.len == 0) {
-      closed_ = true;
+  __asm__("cli");
+  while (len_ == 0) {
+    if (write_closed_) {
+      __asm__("sti");
       return 0;
     }
+    reader_->Sleep();
+    __asm__("cli");
+  }
+  const size_t copy_bytes = std::min(len_, len);
+  const size_t head = head_;
+  __asm__("sti");
+
+  // 書き手は読み出し中の領域には書き込まないので、コピーは割り込みを許可したまま行う
+  auto bufc = reinterpret_cast<uint8_t*>(buf);
+  const size_t first = std::min(copy_bytes, buf_.size() - head);
+  memcpy(bufc, &buf_[head], first);
+  memcpy(bufc + first, &buf_[0], copy_bytes - first);
 
-    const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-    memcpy(buf, msg->arg.pipe.data, copy_bytes);
-    len_ = msg->arg.pipe.len - copy_bytes;
-    memcpy(data_, &msg->arg.pipe.data[copy_bytes], len_);
-    return copy_bytes;
+  __asm__("cli");
+  head_ = (head_ + copy_bytes) % buf_.size();
+  len_ -= copy_bytes;
+  if (writer_) {
+    task_manager->Wakeup(writer_);
+    writer_ = nullptr;
   }
+  __asm__("sti");
+  return copy_bytes;
 }
 
 size_t PipeDescriptor::Write(const void* buf, size_t len) {
-  auto bufc = reinterpret_cast<const char*>(buf);
-  Message msg{Message::kPipe};
+  auto bufc = reinterpret_cast<const uint8_t*>(buf);
   size_t sent_bytes = 0;
   while (sent_bytes < len) {
-    msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
-    memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-    sent_bytes += msg.arg.pipe.len;
     __asm__("cli");
-    task_.SendMessage(msg);
+    if (read_closed_) {
+      __asm__("sti");
+      break;
+    }
+    if (len_ == buf_.size()) {
+      // バッファが空くまで待つ
+      writer_ = &CurrentTaskOnCPU();
+      writer_->Sleep();
+      continue;
+    }
+    const size_t copy_bytes = std::min(buf_.size() - len_, len - sent_bytes);
+    const size_t tail = (head_ + len_) % buf_.size();
+    __asm__("sti");
+
+    const size_t first = std::min(copy_bytes, buf_.size() - tail);
+    memcpy(&buf_[tail], bufc + sent_bytes, first);
+    memcpy(&buf_[0], bufc + sent_bytes + first, copy_bytes - first);
+    sent_bytes += copy_bytes;
+
+    __asm__("cli");
+    len_ += copy_bytes;
+    // コピーの間に読み手が終了していれば、そのタスクはもう存在しない
+    if (reader_) {
+      task_manager->Wakeup(reader_);
+    }
     __asm__("sti");
   }
-  return len;
+  // 読み込み側が閉じられたら、それまでに送れた分だけを返して書き込み側に止めさせる
+  return sent_bytes;
 }
 
 void PipeDescriptor::FinishWrite() {
-  Message msg{Message::kPipe};
-  msg.arg.pipe.len = 0;
   __asm__("cli");
-  task_.SendMessage(msg);
+  write_closed_ = true;
+  if (reader_) {
+    task_manager->Wakeup(reader_);
+  }
+  __asm__("sti");
+}
+
+void PipeDescriptor::FinishRead() {
+  __asm__("cli");
+  read_closed_ = true;
+  reader_ = nullptr;
+  if (writer_) {
+    task_manager->Wakeup(writer_);
+    writer_ = nullptr;
+  }
   __asm__("sti");
 }
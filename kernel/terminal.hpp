@@ -4,6 +4,7 @@
 #include <map>
 #include <optional>
 #include <memory>
+#include <vector>
 #include "window.hpp"
 #include "task.hpp"
 #include "layer.hpp"
@@ -73,7 +74,11 @@ class TerminalFileDescriptor : public FileDescriptor {
     size_t Read(void* buf, size_t len) override;
     size_t Write(const void* buf, size_t len) override;
     size_t Size() const override { return 0; }
+    FileType Type() const override { return FileType::kTerminal; }
     size_t Load(void*buf, size_t len, size_t offset) override;
+    size_t Store(const void* buf, size_t len, size_t offset) override { return 0; }
+    void Seek(size_t offset) override {}
+    size_t Offset() const override { return 0; }
 
   private:
     Terminal& term_;
@@ -91,19 +96,32 @@ struct AppLoadInfo {
 extern std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
 
 // パイプ 読み書きができる対象なので FileDescriptor の一種
+// 書き込まれたデータはカーネル内のリングバッファを経由して読み手に渡す
+// バッファが空なら読み手が、満杯なら書き手がスリープする
 class PipeDescriptor : public FileDescriptor {
   public:
-    explicit PipeDescriptor(Task& task);
+    static const size_t kDefaultCapacity = 4096;
+
+    // task: パイプから読み込むタスク
+    explicit PipeDescriptor(Task& task, size_t capacity = kDefaultCapacity);
     size_t Read(void* buf, size_t len) override;
     size_t Write(const void* buf, size_t len) override;
     size_t Size() const override { return 0; }
+    FileType Type() const override { return FileType::kPipe; }
     size_t Load(void*buf, size_t len, size_t offset) override { return 0; }
+    size_t Store(const void* buf, size_t len, size_t offset) override { return 0; }
+    void Seek(size_t offset) override {}
+    size_t Offset() const override { return 0; }
 
+    // 書き込みの終了を読み手に伝える
     void FinishWrite();
+    // 読み手が終了したことを伝える. 以後の書き込みは捨てられる
+    void FinishRead();
 
   private:
-    Task& task_;
-    char data_[16];
-    size_t len_{0};
-    bool closed_{false};
+    Task* reader_;  // パイプから読み込むタスク. FinishRead の後は終了して解放されるので nullptr にする
+    Task* writer_{nullptr};  // バッファが空くのを待っている書き手
+    std::vector<uint8_t> buf_;
+    size_t head_{0}, len_{0};  // 読み出し位置と、読み出せるバイト数
+    bool write_closed_{false}, read_closed_{false};
 };
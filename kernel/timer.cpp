@@ -2,6 +2,7 @@
 #include "interrupt.hpp"
 #include "acpi.hpp"
 #include "task.hpp"
+#include "asmfunc.h"
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
@@ -59,6 +60,18 @@ bool TimerManager::Tick() {
       continue;
     }
 
+    if (t.Value() == kFrameTimerValue) {
+      // フレームタイマは周期的に再設定する
+      const Timer next{tick_ + kFrameTimerPeriod, kFrameTimerValue, t.TaskID()};
+      Message m{Message::kTimerTimeout};
+      m.arg.timer.timeout = t.Timeout();
+      m.arg.timer.value = kFrameTimerValue;
+      task_manager->SendMessage(t.TaskID(), m);
+      timers_.pop();
+      timers_.push(next);
+      continue;
+    }
+
     Message m{Message::kTimerTimeout};
     m.arg.timer.timeout = t.Timeout();
     m.arg.timer.value = t.Value();
@@ -72,6 +85,7 @@ bool TimerManager::Tick() {
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 // Local APIC タイマーの周期ごとに割り込みハンドラから呼び出される処理
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
@@ -90,12 +104,15 @@ void InitializeLAPICTimer() {
   divide_config = 0b1011; // divide 1:1
   lvt_timer = 0b001 << 1;  // masked, one-shot
   
+  const auto tsc_start = ReadTSC();
   StartLAPICTimer();
   acpi::WaitMilliseconds(100);
   const auto elapsed = LAPICTimerElapsed();
   StopLAPICTimer();
+  const auto tsc_elapsed = ReadTSC() - tsc_start;
 
   lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  tsc_freq = tsc_elapsed * 10;
 
   divide_config = 0b1011; // divide 1:1
   lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;  // not-masked, periodic
@@ -43,7 +43,9 @@ class TimerManager {
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq; // 1秒あたりのLocal APIC タイマのカウント数
-const int kTimerFreq = 100;
+extern unsigned long tsc_freq;         // 1秒あたりの TSC のカウント数
+// フレームレートの倍数にして、フレームタイマの周期がずれないようにする
+const int kTimerFreq = 120;
 
 void InitializeLAPICTimer();
 
@@ -51,3 +53,8 @@ void InitializeLAPICTimer();
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
 const int kTaskTimerValue = std::numeric_limits<int>::max();
 
+// 画面を描画するタイミングを決めるタイマ. メインタスクに届く
+const int kFrameRate = 60;
+const int kFrameTimerPeriod = kTimerFreq / kFrameRate;
+const int kFrameTimerValue = std::numeric_limits<int>::max() - 1;
+
@@ -0,0 +1,183 @@
+#include "virtio_blk.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+  const uint16_t kVendorID = 0x1af4;
+  const uint16_t kDeviceIDTransitionalBlock = 0x1001;
+
+  // legacy インターフェースのレジスタ (BAR0 の I/O ポートからのオフセット)
+  const uint16_t kRegDeviceFeatures = 0x00;
+  const uint16_t kRegGuestFeatures  = 0x04;
+  const uint16_t kRegQueueAddress   = 0x08;
+  const uint16_t kRegQueueSize      = 0x0c;
+  const uint16_t kRegQueueSelect    = 0x0e;
+  const uint16_t kRegQueueNotify    = 0x10;
+  const uint16_t kRegDeviceStatus   = 0x12;
+  const uint16_t kRegCapacity       = 0x14;  // virtio-blk 固有の設定領域 (セクタ数)
+
+  const uint8_t kStatusAcknowledge = 1;
+  const uint8_t kStatusDriver      = 2;
+  const uint8_t kStatusDriverOK    = 4;
+  const uint8_t kStatusFailed      = 128;
+
+  const uint32_t kFeatureReadOnly = 1u << 5;  // VIRTIO_BLK_F_RO
+
+  const uint16_t kDescNext  = 1;
+  const uint16_t kDescWrite = 2;  // デバイスが書き込むバッファ
+  const uint16_t kAvailNoInterrupt = 1;
+
+  const uint32_t kRequestIn  = 0;  // デバイスからの読み込み
+  const uint32_t kRequestOut = 1;  // デバイスへの書き込み
+  const uint8_t kRequestOK = 0;
+
+  // 1 回の要求で転送するセクタ数の上限
+  const size_t kMaxSectorsPerRequest = 128;
+
+  size_t AlignUp(size_t value, size_t align) {
+    return (value + align - 1) / align * align;
+  }
+}
+
+namespace virtio {
+  BlockDevice::BlockDevice(const pci::Device& dev) : dev_{dev} {
+  }
+
+  Error BlockDevice::Initialize() {
+    const uint32_t bar = pci::ReadConfReg(dev_, pci::CalcBarAddress(0));
+    if ((bar & 1u) == 0) {  // legacy インターフェースは I/O 空間にある
+      return MAKE_ERROR(Error::kUnknownDevice);
+    }
+    io_base_ = bar & ~0x3u;
+
+    // I/O 空間へのアクセスとバスマスタ (DMA) を有効にする
+    const uint32_t command = pci::ReadConfReg(dev_, 0x04);
+    pci::WriteConfReg(dev_, 0x04, command | 0x5u);
+
+    IoOut8(io_base_ + kRegDeviceStatus, 0);  // リセット
+    IoOut8(io_base_ + kRegDeviceStatus, kStatusAcknowledge);
+    IoOut8(io_base_ + kRegDeviceStatus, kStatusAcknowledge | kStatusDriver);
+
+    read_only_ = IoIn32(io_base_ + kRegDeviceFeatures) & kFeatureReadOnly;
+    IoOut32(io_base_ + kRegGuestFeatures, 0);
+    capacity_ = IoIn32(io_base_ + kRegCapacity) |
+      static_cast<uint64_t>(IoIn32(io_base_ + kRegCapacity + 4)) << 32;
+
+    IoOut16(io_base_ + kRegQueueSelect, 0);
+    queue_size_ = IoIn16(io_base_ + kRegQueueSize);
+    if (queue_size_ < 3) {
+      IoOut8(io_base_ + kRegDeviceStatus, kStatusFailed);
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+
+    // legacy インターフェースの仮想キューは、ディスクリプタ表と avail リングの後に
+    // ページ境界から used リングを置いた、物理的に連続した領域
+    const size_t used_offset = AlignUp(
+        sizeof(VirtqDesc) * queue_size_ + sizeof(uint16_t) * (3 + queue_size_), kBytesPerFrame);
+    const size_t queue_bytes = used_offset + AlignUp(
+        sizeof(uint16_t) * 3 + sizeof(VirtqUsedElem) * queue_size_, kBytesPerFrame);
+    // キューの後ろの 1 フレームに要求のヘッダとステータスを置く
+    const size_t num_frames = queue_bytes / kBytesPerFrame + 1;
+    auto frame = memory_manager->Allocate(num_frames);
+    if (frame.error) {
+      IoOut8(io_base_ + kRegDeviceStatus, kStatusFailed);
+      return frame.error;
+    }
+    auto queue = reinterpret_cast<uint8_t*>(frame.value.Frame());
+    memset(queue, 0, num_frames * kBytesPerFrame);
+
+    desc_ = reinterpret_cast<VirtqDesc*>(queue);
+    avail_ = reinterpret_cast<VirtqAvail*>(queue + sizeof(VirtqDesc) * queue_size_);
+    used_ = reinterpret_cast<VirtqUsed*>(queue + used_offset);
+    header_ = reinterpret_cast<BlockRequestHeader*>(queue + queue_bytes);
+    status_ = queue + queue_bytes + sizeof(BlockRequestHeader);
+
+    avail_->flags = kAvailNoInterrupt;
+    IoOut32(io_base_ + kRegQueueAddress, frame.value.ID());
+
+    IoOut8(io_base_ + kRegDeviceStatus, kStatusAcknowledge | kStatusDriver | kStatusDriverOK);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error BlockDevice::Read(uint64_t lba, void* buf, size_t count) {
+    return Transfer(kRequestIn, lba, buf, count);
+  }
+
+  Error BlockDevice::Write(uint64_t lba, const void* buf, size_t count) {
+    if (read_only_) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+    return Transfer(kRequestOut, lba, const_cast<void*>(buf), count);
+  }
+
+  // ヘッダ・データ・ステータスの 3 つのディスクリプタをつないだ要求を発行して完了を待つ
+  // ディスクリプタは常に先頭の 3 つを使うので、要求の間は割り込みを禁止しておく
+  Error BlockDevice::Transfer(uint32_t type, uint64_t lba, void* buf, size_t count) {
+    if (lba + count > capacity_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    auto p = reinterpret_cast<uint8_t*>(buf);
+    while (count > 0) {
+      const size_t n = std::min(count, kMaxSectorsPerRequest);
+      const bool intr = DisableInterrupt();
+
+      header_->type = type;
+      header_->reserved = 0;
+      header_->sector = lba;
+      *status_ = 0xff;
+
+      desc_[0] = {reinterpret_cast<uint64_t>(header_), sizeof(BlockRequestHeader), kDescNext, 1};
+      desc_[1] = {reinterpret_cast<uint64_t>(p), static_cast<uint32_t>(n * kBlockSize),
+                  static_cast<uint16_t>(kDescNext | (type == kRequestIn ? kDescWrite : 0)), 2};
+      desc_[2] = {reinterpret_cast<uint64_t>(status_), 1, kDescWrite, 0};
+
+      avail_->ring[avail_->idx % queue_size_] = 0;
+      __atomic_store_n(&avail_->idx, avail_->idx + 1, __ATOMIC_RELEASE);
+      IoOut16(io_base_ + kRegQueueNotify, 0);
+
+      while (__atomic_load_n(&used_->idx, __ATOMIC_ACQUIRE) == last_used_idx_) {
+        __asm__ volatile("pause");
+      }
+      ++last_used_idx_;
+      const uint8_t status = __atomic_load_n(status_, __ATOMIC_ACQUIRE);
+      RestoreInterrupt(intr);
+
+      if (status != kRequestOK) {
+        Log(kError, "virtio-blk: request %u at %lu failed (%u)\n", type, lba, status);
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      p += n * kBlockSize;
+      lba += n;
+      count -= n;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  std::vector<std::unique_ptr<BlockDevice>> FindBlockDevices() {
+    std::vector<std::unique_ptr<BlockDevice>> devs;
+    for (int i = 0; i < pci::num_device; ++i) {
+      const auto& dev = pci::devices[i];
+      if (pci::ReadVendorId(dev) != kVendorID ||
+          pci::ReadDeviceId(dev.bus, dev.device, dev.function) != kDeviceIDTransitionalBlock) {
+        continue;
+      }
+
+      auto blk = std::make_unique<BlockDevice>(dev);
+      if (auto err = blk->Initialize()) {
+        Log(kWarn, "virtio-blk %d.%d.%d: %s\n", dev.bus, dev.device, dev.function, err.Name());
+        continue;
+      }
+      Log(kInfo, "virtio-blk %d.%d.%d: %lu sectors\n",
+          dev.bus, dev.device, dev.function, blk->NumBlocks());
+      devs.push_back(std::move(blk));
+    }
+    return devs;
+  }
+}
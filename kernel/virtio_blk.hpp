@@ -0,0 +1,87 @@
+/**
+ * @file virtio_blk.hpp
+ *
+ * virtio-blk (legacy インターフェース) のドライバ
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "block.hpp"
+#include "pci.hpp"
+
+namespace virtio {
+  // 仮想キューのディスクリプタ
+  struct VirtqDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+  };
+
+  // 送信側のリング. ring[] の後に used_event が続く
+  struct VirtqAvail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+  };
+
+  struct VirtqUsedElem {
+    uint32_t id;
+    uint32_t len;
+  };
+
+  // 完了側のリング. ring[] の後に avail_event が続く
+  struct VirtqUsed {
+    uint16_t flags;
+    uint16_t idx;
+    VirtqUsedElem ring[];
+  };
+
+  // 要求の先頭に置くヘッダ
+  struct BlockRequestHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+  } __attribute__((packed));
+
+  // I/O ポート経由で操作する virtio-blk デバイス
+  // 要求は 1 つずつ発行し、完了をポーリングで待つ. 割り込みは使わない
+  class BlockDevice : public ::BlockDevice {
+    public:
+      static const size_t kBlockSize = 512;
+
+      explicit BlockDevice(const pci::Device& dev);
+      Error Initialize();
+      const pci::Device& PCIDevice() const { return dev_; }
+
+      size_t BlockSize() const override { return kBlockSize; }
+      uint64_t NumBlocks() const override { return capacity_; }
+      Error Read(uint64_t lba, void* buf, size_t count) override;
+      Error Write(uint64_t lba, const void* buf, size_t count) override;
+
+    private:
+      pci::Device dev_;
+      uint16_t io_base_{0};
+      uint64_t capacity_{0};
+      bool read_only_{false};
+
+      uint16_t queue_size_{0};
+      VirtqDesc* desc_{nullptr};
+      VirtqAvail* avail_{nullptr};
+      VirtqUsed* used_{nullptr};
+      uint16_t last_used_idx_{0};
+
+      BlockRequestHeader* header_{nullptr};
+      uint8_t* status_{nullptr};
+
+      Error Transfer(uint32_t type, uint64_t lba, void* buf, size_t count);
+  };
+
+  // PCI デバイスの一覧から virtio-blk デバイスを探し、初期化できたものを返す
+  std::vector<std::unique_ptr<BlockDevice>> FindBlockDevices();
+}
@@ -4,13 +4,12 @@
 
 #include <algorithm>
 
-Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height} {
-  // 各ピクセルの色を格納する2次元配列を生成し、指定ウィンドウサイズに合わせて要素数を拡大
-  data_.resize(height);
-  for (int y = 0; y < height; ++y) {
-    data_[y].resize(width);
-  }
+namespace {
+  WindowStat window_stat{};
+}
 
+Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height} {
+  // ピクセルの色はシャドウバッファにだけ保持する
   FrameBufferConfig config{};
   config.frame_buffer = nullptr;
   config.horizontal_resolution = width;
@@ -21,6 +20,16 @@ Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}
     Log(kError, "failed to initialize shadow buffer: %s at %s:%d\n",
         err.Name(), err.File(), err.Line());
   }
+
+  ++window_stat.windows;
+  window_stat.pixels += static_cast<size_t>(width) * height;
+  window_stat.rows += height;
+}
+
+Window::~Window() {
+  --window_stat.windows;
+  window_stat.pixels -= static_cast<size_t>(width_) * height_;
+  window_stat.rows -= height_;
 }
 
 void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos) {
@@ -29,24 +38,15 @@ void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos) {
 }
 
 void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area) {
-  // 透過色が設定されていない場合は、指定範囲のうちこのウィンドウと重なる部分のデータをコピー
+  // 指定範囲のうちこのウィンドウと重なる部分のデータをコピー
+  Rectangle<int> window_area{pos, Size()};
+  Rectangle<int> intersection = area & window_area;
+  const Rectangle<int> src_area{intersection.pos - pos, intersection.size};
   if (!transparent_color_) {
-    Rectangle<int> window_area{pos, Size()};
-    Rectangle<int> intersection = area & window_area;
-    dst.Copy(intersection.pos, shadow_buffer_, {intersection.pos - pos, intersection.size});
-    return;
-  }
-
-  // 透過色が設定されている場合
-  const auto tc = transparent_color_.value();
-  auto& writer = dst.Writer();
-  for (int y = std::max(0, 0 - pos.y); y < std::min(Height(), writer.Height() - pos.y); ++y) {
-    for (int x = std::max(0, 0 - pos.x); x < std::min(Width(), writer.Width() - pos.x); ++x) {
-      const auto c = At(Vector2D<int>{x, y});
-      if (c != tc) {
-        writer.Write(pos + Vector2D<int>{x, y}, c);
-      }
-    }
+    dst.Copy(intersection.pos, shadow_buffer_, src_area);
+  } else {
+    // 透過色が設定されている場合は、透過色のピクセルを除いてコピー
+    dst.CopyTransparent(intersection.pos, shadow_buffer_, src_area, transparent_color_.value());
   }
 }
 
@@ -58,17 +58,59 @@ Window::WindowWriter* Window::Writer() {
   return &writer_;
 }
 
-const PixelColor& Window::At(Vector2D<int> pos) const {
-  return data_[pos.y][pos.x];
+PixelColor Window::At(Vector2D<int> pos) const {
+  const auto& config = shadow_buffer_.Config();
+  const auto p = reinterpret_cast<const uint32_t*>(config.frame_buffer);
+  return DecodePixel(config.pixel_format, p[config.pixels_per_scan_line * pos.y + pos.x]);
 }
 
 void Window::Write(Vector2D<int> pos, PixelColor c) {
-  data_[pos.y][pos.x] = c;
   shadow_buffer_.Writer().Write(pos, c);
+  AddDirty({pos, {1, 1}});
+}
+
+void Window::FillSpan(Vector2D<int> pos, int n, const PixelColor& c) {
+  shadow_buffer_.Writer().FillSpan(pos, n, c);
+  AddDirty({pos, {n, 1}});
+}
+
+void Window::WriteSpan(Vector2D<int> pos, const PixelColor* colors, int n) {
+  shadow_buffer_.Writer().WriteSpan(pos, colors, n);
+  AddDirty({pos, {n, 1}});
+}
+
+void Window::WritePixels(Vector2D<int> pos, const uint32_t* pixels, int n, PixelFormat format) {
+  shadow_buffer_.Writer().WritePixels(pos, pixels, n, format);
+  AddDirty({pos, {n, 1}});
 }
 
 void Window::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
   shadow_buffer_.Move(dst_pos, src);
+  AddDirty({dst_pos, src.size});
+}
+
+Rectangle<int> Window::TakeDirty() {
+  const auto dirty = dirty_;
+  dirty_ = {{0, 0}, {0, 0}};
+  return dirty;
+}
+
+void Window::AddDirty(const Rectangle<int>& area) {
+  const auto r = area & Rectangle<int>{{0, 0}, Size()};
+  if (r.size.x <= 0 || r.size.y <= 0) {
+    return;
+  }
+  if (dirty_.size.x <= 0 || dirty_.size.y <= 0) {
+    dirty_ = r;
+    return;
+  }
+  const auto pos = ElementMin(dirty_.pos, r.pos);
+  const auto end = ElementMax(dirty_.pos + dirty_.size, r.pos + r.size);
+  dirty_ = {pos, end - pos};
+}
+
+WindowStat GetWindowStat() {
+  return window_stat;
 }
 
 int Window::Width() const {
@@ -107,6 +149,25 @@ namespace {
     ".$$$$$$$$$$$$$$@",
     "@@@@@@@@@@@@@@@@",
   };
+
+  // 閉じるボタンを 1 行ずつ描く
+  void DrawCloseButton(PixelWriter& writer, int win_w) {
+    PixelColor row[kCloseButtonWidth];
+    for (int y = 0; y < kCloseButtonHeight; ++y) {
+      for (int x = 0; x < kCloseButtonWidth; ++x) {
+        PixelColor c = ToColor(0xffffff);
+        if (close_button[y][x] == '@') {
+          c = ToColor(0x000000);
+        } else if (close_button[y][x] == '$') {
+          c = ToColor(0x848484);
+        } else if (close_button[y][x] == ':') {
+          c = ToColor(0xc6c6c6);
+        }
+        row[x] = c;
+      }
+      writer.WriteSpan({win_w - 5 - kCloseButtonWidth, 5 + y}, row, kCloseButtonWidth);
+    }
+  }
 }
 
 ToplevelWindow::ToplevelWindow(int width, int height, PixelFormat shadow_format, const std::string& title) 
@@ -162,19 +223,7 @@ void DrawWindow(PixelWriter& writer, const char* title) {
 
   WriteString(writer, {24, 4}, title, ToColor(0xffffff));
 
-  for (int y = 0; y < kCloseButtonHeight; ++y) {
-    for (int x = 0; x < kCloseButtonWidth; ++x) {
-      PixelColor c = ToColor(0xffffff);
-      if (close_button[y][x] == '@') {
-        c = ToColor(0x000000);
-      } else if (close_button[y][x] == '$') {
-        c = ToColor(0x848484);
-      } else if (close_button[y][x] == ':') {
-        c = ToColor(0xc6c6c6);
-      }
-      writer.Write({win_w - 5 - kCloseButtonWidth + x, 5 + y}, c);
-    }
-  }
+  DrawCloseButton(writer, win_w);
 }
 
 void DrawWindowTitle(PixelWriter& writer, const char* title, bool active) {
@@ -187,19 +236,7 @@ void DrawWindowTitle(PixelWriter& writer, const char* title, bool active) {
   FillRectangle(writer, {3, 3}, {win_w - 6, 18}, ToColor(bgcolor));
   WriteString(writer, {24, 4}, title, ToColor(0xffffff));
 
-  for (int y = 0; y < kCloseButtonHeight; ++y) {
-    for (int x = 0; x < kCloseButtonWidth; ++x) {
-      PixelColor c = ToColor(0xffffff);
-      if (close_button[y][x] == '@') {
-        c = ToColor(0x000000);
-      } else if (close_button[y][x] == '$') {
-        c = ToColor(0x848484);
-      } else if (close_button[y][x] == ':') {
-        c = ToColor(0xc6c6c6);
-      }
-      writer.Write({win_w - 5 - kCloseButtonWidth + x, 5 + y}, c);
-    }
-  }
+  DrawCloseButton(writer, win_w);
 }
 
 namespace {
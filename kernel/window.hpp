@@ -13,6 +13,15 @@ enum class WindowRegion {
   kOther,
 };
 
+// 存在するウィンドウの統計
+struct WindowStat {
+  size_t windows;
+  size_t pixels;  // 全ウィンドウのピクセル数の合計
+  size_t rows;    // 全ウィンドウの行数の合計
+};
+
+WindowStat GetWindowStat();
+
 /* 画面上の(Layer上の)矩形領域 */
 class Window {
   public:
@@ -24,6 +33,15 @@ class Window {
         virtual void Write(Vector2D<int> pos, const PixelColor& c) override {
           window_.Write(pos, c);
         }
+        virtual void FillSpan(Vector2D<int> pos, int n, const PixelColor& c) override {
+          window_.FillSpan(pos, n, c);
+        }
+        virtual void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int n) override {
+          window_.WriteSpan(pos, colors, n);
+        }
+        virtual void WritePixels(Vector2D<int> pos, const uint32_t* pixels, int n, PixelFormat format) override {
+          window_.WritePixels(pos, pixels, n, format);
+        }
 
         virtual int Width() const override { return window_.Width(); }
         virtual int Height() const override { return window_.Height(); }
@@ -35,7 +53,7 @@ class Window {
     // 指定した大きさのウィンドウを生成
     Window(int width, int height, PixelFormat shadow_format);
 
-    virtual ~Window() = default;
+    virtual ~Window();
     Window(const Window& rhs) = delete;
     Window& operator=(const Window& rhs) = delete;
 
@@ -45,19 +63,28 @@ class Window {
 
     // 透過色を設定
     void SetTransparentColor(std::optional<PixelColor> c);
+    // 透過色が設定されていなければ、背面のレイヤを完全に覆い隠す
+    bool IsOpaque() const { return !transparent_color_; }
 
     // 関連付けられている WindowWriter を取得
     WindowWriter* Writer();
 
 
-    // 指定位置のピクセルの色を返す
-    const PixelColor& At(Vector2D<int> pos) const;
+    // 指定位置のピクセルの色を返す(シャドウバッファから復元する)
+    PixelColor At(Vector2D<int> pos) const;
 
     // 指定した位置に指定した色を描画
     void Write(Vector2D<int> pos, PixelColor c);
+    // 指定した位置から右に n ピクセルを描画(ウィンドウの範囲外は描かない)
+    void FillSpan(Vector2D<int> pos, int n, const PixelColor& c);
+    void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int n);
+    void WritePixels(Vector2D<int> pos, const uint32_t* pixels, int n, PixelFormat format);
     
     // dst_pos に src の領域内の画像を移動させる
     void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
+
+    // 前回呼び出してから書き換えられた範囲を囲む矩形(ウィンドウ内の座標)を返し、空にする
+    Rectangle<int> TakeDirty();
     
     // ウィンドウの幅・高さを取得
     int Width() const;
@@ -71,11 +98,13 @@ class Window {
 
   private:
     int width_, height_;
-    std::vector<std::vector<PixelColor>> data_{};
     WindowWriter writer_{*this};
     std::optional<PixelColor> transparent_color_{std::nullopt};
 
     FrameBuffer shadow_buffer_{};
+    Rectangle<int> dirty_{{0, 0}, {0, 0}};
+
+    void AddDirty(const Rectangle<int>& area);
 };
 
 class ToplevelWindow : public Window {
@@ -91,6 +120,15 @@ class ToplevelWindow : public Window {
         virtual void Write(Vector2D<int> pos, const PixelColor& c) override {
           window_.Write(pos + kTopLeftMargin, c);
         }
+        virtual void FillSpan(Vector2D<int> pos, int n, const PixelColor& c) override {
+          window_.FillSpan(pos + kTopLeftMargin, n, c);
+        }
+        virtual void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int n) override {
+          window_.WriteSpan(pos + kTopLeftMargin, colors, n);
+        }
+        virtual void WritePixels(Vector2D<int> pos, const uint32_t* pixels, int n, PixelFormat format) override {
+          window_.WritePixels(pos + kTopLeftMargin, pixels, n, format);
+        }
         virtual int Width() const override {
           return window_.Width() - kTopLeftMargin.x - kBottomRightMargin.x;
         }